@@ -1,6 +1,7 @@
 #include <bits/stdc++.h>
-#include "../Http.h"
+#include "../http.h"
 #include "../networking.h"
+#include "../connection_pool.h"
 #include "../debugger.h"
 
 using namespace std;
@@ -21,10 +22,171 @@ const std::map<std::string, std::string> extension_map
                 }
         };
 
+/**
+ * A line of the command file: client_get or client_post, the path, and the server to send it to.
+ */
+struct Command
+{
+    std::string command, path, hostname, port;
+};
+
+/**
+ * Builds the request of a command, reading the uploaded file of a client_post.
+ */
+static std::optional<HTTP<Type::Request>> buildRequest(const Command &cmd) {
+    if (cmd.command == "client_get") {
+        HTTP_Builder<Type::Request> builder;
+        return builder.setCommand("GET").setURL(cmd.path).addHeader("Connection", "Keep-Alive").build();
+    }
+    const std::string &path = cmd.path;
+    std::ifstream file(path.substr(1), std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+        Err("%s : failed to open file", path.c_str());
+        return std::nullopt;
+    }
+    file.seekg(0, std::ios::end);
+    std::size_t length = file.tellg();
+    file.seekg(0, std::ios::beg);
+    if (file.fail()) {
+        Err("%s : failed to get size of file", path.c_str());
+        return std::nullopt;
+    }
+    // Read into a buffer the request shares, so the file is not copied into it.
+    auto data = std::make_shared<std::string>(length, '\0');
+    if (!file.read(&(*data)[0], length)) {
+        Err("%s : failed to read file", path.c_str());
+        return std::nullopt;
+    }
+    if (file) {
+        Debug("%s : all characters read successfully", path.c_str());
+    } else {
+        Err("%s : only %lld could be read", path.c_str(), (long long) file.gcount());
+        return std::nullopt;
+    }
+    int position = path.find_last_of(".");
+    string extension = path.substr(position + 1);
+    HTTP_Builder<Type::Request> builder;
+    return builder.setCommand("POST").setURL(path).addBody(Shared_Bytes{data, *data})
+            .addHeader("Content-Type", extension_map.at(extension)).addHeader("Connection", "Keep-Alive")
+            .addHeader("Content-Length", std::to_string(length)).build();
+}
+
+/**
+ * Handles the response to a command, the body of a client_get is written to the file at its path.
+ */
+static void handleResponse(const Command &cmd, const HTTP<Type::Request> &req, const HTTP<Type::Response> &resp) {
+    if (cmd.command != "client_get") {
+        Debug("\n-------------------------\n %s \n-------------------------\n", resp.to_string().c_str());
+        return;
+    }
+    string path = cmd.path.substr(1);
+    int position = path.find_last_of("/");
+    if (position != -1) {
+        string directories = path.substr(0, position);
+        // Directories created by an earlier download are fine.
+        std::error_code error;
+        std::filesystem::create_directories(directories, error);
+        if (error) {
+            Err("%s : failed to create directories", directories.c_str());
+            return;
+        }
+    }
+    std::ofstream file(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!file.is_open()) {
+        Err("%s : failed to open file", path.c_str());
+        return;
+    }
+    Debug("%s : writing %zu chars", path.c_str(), resp.get_body().size());
+    Debug("\n-------------------------\n %s \n-------------------------\n", req.to_string(false).c_str());
+    file << resp.get_body();
+    if (file) {
+        Debug("%s : written successfully", path.c_str());
+    } else {
+        Err("%s : error while writing data", path.c_str());
+    }
+}
+
+/**
+ * Runs the commands [begin, end), which all go to the same server, over one pooled connection: their requests are
+ * pipelined and the responses read in order afterwards. If the server closes the connection before answering all of
+ * them, the rest is sent again on another one, unless a fresh connection got no answer at all.
+ */
+static void runBatch(Connection_Pool &pool, const std::vector<Command> &commands, std::size_t begin, std::size_t end) {
+    const Command &server = commands[begin];
+    std::vector<std::pair<const Command *, HTTP<Type::Request>>> requests;
+    for (std::size_t i = begin; i < end; i++) {
+        auto req = buildRequest(commands[i]);
+        if (req) {
+            requests.emplace_back(&commands[i], std::move(*req));
+        }
+    }
+    std::size_t answered = 0;
+    while (answered < requests.size()) {
+        bool reused;
+        auto socket_ptr = pool.acquire(server.hostname, server.port, reused);
+        if (!socket_ptr) {
+            break;
+        }
+        std::size_t sent = answered;
+        while (sent < requests.size() && socket_ptr->sendHTTP(requests[sent].second)) {
+            sent++;
+        }
+        std::size_t progress = answered;
+        bool keep_alive = true;
+        while (answered < sent && keep_alive) {
+            auto resp_opt = socket_ptr->receiveResponse();
+            if (!resp_opt) {
+                keep_alive = false;
+                break;
+            }
+            handleResponse(*requests[answered].first, requests[answered].second, *resp_opt);
+            keep_alive = Connection_Pool::keepsAlive(*resp_opt);
+            answered++;
+        }
+        if (keep_alive && answered == requests.size()) {
+            pool.release(server.hostname, server.port, std::move(socket_ptr));
+        }
+        // A reused connection may have timed out on the server while it was idle, a fresh one has no excuse.
+        if (answered == progress && !reused) {
+            break;
+        }
+    }
+    for (std::size_t i = answered; i < requests.size(); i++) {
+        Err("%s : failed to receive HTTP response", requests[i].first->path.c_str());
+    }
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        Err("Only 1 argument is needed which is the filename");
+    // Commands sent at the same time, and how many of them may share a connection by pipelining.
+    unsigned concurrency = 1;
+    std::size_t pipeline_depth = 1;
+    // Speaks HTTPS, verifying servers against the CA file or the system's CAs unless insecure.
+    bool tls = false, insecure = false;
+    std::string ca_file;
+    char *filename = nullptr;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--concurrency" && i + 1 < argc) {
+            concurrency = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--pipeline" && i + 1 < argc) {
+            pipeline_depth = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--tls") {
+            tls = true;
+        } else if (arg == "--ca" && i + 1 < argc) {
+            tls = true;
+            ca_file = argv[++i];
+        } else if (arg == "--insecure") {
+            tls = insecure = true;
+        } else if (!filename) {
+            filename = argv[i];
+        } else {
+            filename = nullptr;
+            break;
+        }
+    }
+    if (!filename) {
+        Err("Usage: client <commands file> [--concurrency N] [--pipeline DEPTH] [--tls] [--ca FILE] [--insecure]. "
+            "Concurrent commands run in any order");
         return 0;
     }
     WSADATA wsaData;
@@ -33,90 +195,53 @@ int main(int argc, char *argv[]) {
         Err("WSAStartup failed: %d\n", iResult);
         return 1;
     }
-    char *filename = argv[1];
+    std::vector<Command> commands;
     std::ifstream stream{filename};
-    while (!stream.eof()) {
-        std::string command, path, hostname, port;
-        stream >> command >> path >> hostname >> port;
-        auto socket_ptr = connectToServer(hostname.c_str(), port.c_str());
-        if (command == "client_get") {
-            HTTP_Builder<Type::Request> builder;
-            HTTP<Type::Request> req = builder.setCommand("GET").setURL(path).addHeader("Connection", "Keep-Alive").build();
-            bool success = socket_ptr->sendHTTP(req.to_string());
-            if (!success) {
-                Err("%s : failed to send HTTP Request", path.c_str());
-                continue;
-            }
-            auto resp_str_opt = socket_ptr->receiveHTTP();
-            if (!resp_str_opt) {
-                continue;
-            }
-            HTTP<Type::Response> resp = read_response(*resp_str_opt);
-            path = path.substr(1);
-            int position = path.find_last_of("/");
-            if (position != -1) {
-                string directories = path.substr(0, position);
-                bool success = std::filesystem::create_directories(directories);
-                if (!success) {
-                    Err("%s : failed to create directories", directories.c_str());
-                    continue;
+    Command cmd;
+    while (stream >> cmd.command >> cmd.path >> cmd.hostname >> cmd.port) {
+        commands.push_back(cmd);
+    }
+
+    std::shared_ptr<Tls_Context> tls_context;
+    if (tls) {
+        try {
+            tls_context = Tls_Context::client(ca_file, !insecure);
+        } catch (const std::runtime_error &e) {
+            Err("%s", e.what());
+            return 1;
+        }
+    }
+    Connection_Pool pool(64, tls_context);
+    std::mutex queue_mutex;
+    std::size_t next = 0;
+    // Every worker takes the next run of up to pipeline_depth commands to the same server.
+    auto worker = [&]() {
+        while (true) {
+            std::size_t begin, end;
+            {
+                std::scoped_lock lock(queue_mutex);
+                if (next == commands.size()) {
+                    return;
                 }
+                begin = next;
+                end = begin + 1;
+                while (end < commands.size() && end - begin < pipeline_depth &&
+                       commands[end].hostname == commands[begin].hostname &&
+                       commands[end].port == commands[begin].port) {
+                    end++;
+                }
+                next = end;
             }
-            std::ofstream file(path, std::ios::out | std::ios::trunc | std::ios::binary);
-            if (!file.is_open()) {
-                Err("%s : failed to open file", path.c_str());
-                continue;
-            }
-            Debug("%s : writing %d chars", path.c_str(), resp.get_body().size());
-            Debug("\n-------------------------\n %s \n-------------------------\n", req.to_string(false).c_str());
-            file << resp.get_body();
-            if (file) {
-                Debug("%s : written successfully", path.c_str());
-            } else {
-                Err("%s : error while writing data", path.c_str());
-            }
-        } else {
-            std::ifstream file(path.substr(1), std::ios::in | std::ios::binary);
-            if (!file.is_open()) {
-                Err("%s : failed to open file", path.c_str());
-                continue;
-            }
-            file.seekg(0, std::ios::end);
-            std::size_t length = file.tellg();
-            file.seekg(0, std::ios::beg);
-            if (file.fail()) {
-                Err("%s : failed to get size of file", path.c_str());
-                continue;
-            }
-            std::string data(length, '\0');
-            if (!file.read(&data[0], length)) {
-                Err("%s : failed to read file", path.c_str());
-                continue;
-            }
-            if (file) {
-                Debug("%s : all characters read successfully", path.c_str());
-            } else {
-                Err("%s : only %d could be read", path.c_str(), file.gcount());
-                continue;
-            }
-            int position = path.find_last_of(".");
-            string extension = path.substr(position + 1);
-            HTTP_Builder<Type::Request> builder;
-            auto req = builder.setCommand("POST").setURL(path).addBody(move(data))
-                    .addHeader("Content-Type", extension_map.at(extension)).addHeader("Connection", "Keep-Alive")
-                    .addHeader("Content-Length", std::to_string(length)).build();
-            bool success = socket_ptr->sendHTTP(req.to_string());
-            if (!success) {
-                Err("%s : failed to send HTTP Request", path.c_str());
-                continue;
-            }
-            auto resp_str_opt = socket_ptr->receiveHTTP();
-            if (!resp_str_opt) {
-                Err("%s : failed to receive HTTP response", path.c_str());
-                continue;
-            }
-            Debug("\n-------------------------\n %s \n-------------------------\n", resp_str_opt->c_str());
+            runBatch(pool, commands, begin, end);
         }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < concurrency; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread: workers) {
+        thread.join();
     }
     WSACleanup();
 
@@ -1,15 +1,218 @@
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
 #include <chrono>
+#include <thread>
+#include <random>
+#include <deque>
 #include "../debugger.h"
 #include "../http.h"
 #include "../networking.h"
+#include "latency_histogram.h"
 
 using namespace std;
+using Clock = std::chrono::steady_clock;
 
-constexpr int MAX_SIZE = 15000;
+/**
+ * A URL requested by the load, picked with a probability proportional to its weight.
+ */
+struct Target
+{
+    std::string url;
+    unsigned weight;
+    // The serialized request, built once.
+    std::string request;
+};
+
+struct Load_Options
+{
+    std::string host = "127.0.0.1";
+    std::string port = "80";
+    // Connections kept busy at the same time, each driven by a thread of its own.
+    unsigned connections = 16;
+    double duration_seconds = 10;
+    // Requests per second over all connections, 0 sends the next request as soon as a connection may.
+    double rate = 0;
+    // Requests a connection may have in flight.
+    unsigned pipeline_depth = 1;
+    std::vector<Target> targets;
+    // Where the results go as JSON, "-" for stdout.
+    std::string json_path;
+    // Speaks HTTPS with this client context if set, reconnections resume the session.
+    std::shared_ptr<Tls_Context> tls;
+};
+
+/**
+ * What a connection measured, merged over all of them at the end.
+ */
+struct Load_Result
+{
+    Latency_Histogram latency;
+    std::uint64_t errors = 0;
+    std::uint64_t non_2xx = 0;
+    std::uint64_t bytes = 0;
+};
+
+/**
+ * Drives one connection until the deadline. With a rate every request has an intended send time on a fixed schedule
+ * and its latency is counted from then, not from when it was actually sent, so a stalled server is charged for the
+ * requests it held back too instead of the load backing off (coordinated omission). Without a rate the connection is
+ * kept as busy as the pipeline depth allows and latency counts from the send.
+ */
+static void driveConnection(const Load_Options &options, unsigned index, Clock::time_point start,
+                            Clock::time_point deadline, Load_Result &result) {
+    std::mt19937 rng(index);
+    unsigned total_weight = 0;
+    for (const Target &target: options.targets) {
+        total_weight += target.weight;
+    }
+    auto pick = [&]() -> const Target & {
+        unsigned ticket = std::uniform_int_distribution<unsigned>(0, total_weight - 1)(rng);
+        for (const Target &target: options.targets) {
+            if (ticket < target.weight) {
+                return target;
+            }
+            ticket -= target.weight;
+        }
+        return options.targets.back();
+    };
+    // The connections share the rate, their schedules interleave.
+    Clock::duration interval{};
+    Clock::time_point next_send = start;
+    if (options.rate > 0) {
+        interval = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(options.connections / options.rate));
+        next_send = start + interval * index / options.connections;
+    }
+    std::unique_ptr<Socket> socket;
+    std::deque<Clock::time_point> in_flight;
+    while (true) {
+        Clock::time_point now = Clock::now();
+        if (now >= deadline) {
+            break;
+        }
+        if (!socket) {
+            socket = connectToServer(options.host.c_str(), options.port.c_str(), options.tls);
+            if (!socket) {
+                result.errors++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+        }
+        bool failed = false;
+        while (in_flight.size() < options.pipeline_depth && (options.rate == 0 || next_send <= now)) {
+            if (!socket->sendHTTP(pick().request)) {
+                failed = true;
+                break;
+            }
+            in_flight.push_back(options.rate > 0 ? next_send : now);
+            next_send += interval;
+        }
+        if (!failed && in_flight.empty()) {
+            std::this_thread::sleep_until(std::min(next_send, deadline));
+            continue;
+        }
+        if (failed) {
+            result.errors++;
+        }
+        auto resp_opt = failed ? std::nullopt : socket->receiveResponse();
+        if (!resp_opt) {
+            // Whatever was in flight is lost with the connection.
+            result.errors += in_flight.size();
+            in_flight.clear();
+            socket.reset();
+            continue;
+        }
+        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - in_flight.front());
+        in_flight.pop_front();
+        result.latency.record(latency.count());
+        result.bytes += resp_opt->get_body().size();
+        if (resp_opt->get_status().empty() || resp_opt->get_status()[0] != '2') {
+            result.non_2xx++;
+        }
+        auto connection = resp_opt->find_header(Header_Id::Connection);
+        if (connection && iequals(*connection, "close")) {
+            result.errors += in_flight.size();
+            in_flight.clear();
+            socket.reset();
+        }
+    }
+}
+
+static double toMs(std::uint64_t nanoseconds) {
+    return double(nanoseconds) / 1e6;
+}
 
-int main()
+static void printJson(std::ostream &out, const Load_Options &options, const Load_Result &result, double elapsed) {
+    const Latency_Histogram &latency = result.latency;
+    out << "{\"connections\":" << options.connections << ",\"pipeline_depth\":" << options.pipeline_depth
+        << ",\"target_rate\":" << options.rate << ",\"duration_s\":" << elapsed
+        << ",\"requests\":" << latency.count() << ",\"errors\":" << result.errors
+        << ",\"non_2xx\":" << result.non_2xx << ",\"bytes\":" << result.bytes
+        << ",\"throughput_rps\":" << double(latency.count()) / elapsed
+        << ",\"latency_ms\":{\"min\":" << toMs(latency.min()) << ",\"mean\":" << latency.mean() / 1e6
+        << ",\"p50\":" << toMs(latency.percentile(50)) << ",\"p90\":" << toMs(latency.percentile(90))
+        << ",\"p99\":" << toMs(latency.percentile(99)) << ",\"p99_9\":" << toMs(latency.percentile(99.9))
+        << ",\"max\":" << toMs(latency.max()) << "}}" << std::endl;
+}
+
+// Usage: Evaluator [--host H] [--port P] [--connections N] [--duration SECONDS] [--rate REQUESTS_PER_SECOND]
+//                  [--pipeline DEPTH] [--url PATH[=WEIGHT]]... [--json FILE|-] [--tls system|insecure|CA_FILE]
+int main(int argc, char *argv[])
 {
+    Load_Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            Err("%s needs a value", arg.c_str());
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--host") {
+            options.host = value;
+        } else if (arg == "--port") {
+            options.port = value;
+        } else if (arg == "--connections") {
+            options.connections = std::max(1, atoi(value.c_str()));
+        } else if (arg == "--duration") {
+            options.duration_seconds = atof(value.c_str());
+        } else if (arg == "--rate") {
+            options.rate = std::max(0.0, atof(value.c_str()));
+        } else if (arg == "--pipeline") {
+            options.pipeline_depth = std::max(1, atoi(value.c_str()));
+        } else if (arg == "--url") {
+            // Only a number after the last '=' is a weight, a query string may contain one too.
+            auto equals = value.rfind('=');
+            if (equals != std::string::npos &&
+                (equals + 1 == value.size() || value.find_first_not_of("0123456789", equals + 1) != std::string::npos)) {
+                equals = std::string::npos;
+            }
+            unsigned weight = equals == std::string::npos ? 1 : std::max(1, atoi(value.c_str() + equals + 1));
+            options.targets.push_back({value.substr(0, equals), weight, {}});
+        } else if (arg == "--json") {
+            options.json_path = value;
+        } else if (arg == "--tls") {
+            // Verifies the server against the system's CAs, not at all, or against the CAs in the file.
+            try {
+                options.tls = value == "insecure" ? Tls_Context::client("", false)
+                                                  : Tls_Context::client(value == "system" ? "" : value);
+            } catch (const std::runtime_error &e) {
+                Err("%s", e.what());
+                return 1;
+            }
+        } else {
+            Err("unknown option %s", arg.c_str());
+            return 1;
+        }
+    }
+    if (options.targets.empty()) {
+        options.targets.push_back({"/text.txt", 1, {}});
+    }
+    for (Target &target: options.targets) {
+        HTTP_Builder<Type::Request> builder;
+        target.request = builder.setCommand("GET").setURL(target.url).addHeader("Host", options.host).build().to_string();
+    }
     WSADATA wsaData;
 
     int iResult = WSAStartup(MAKEWORD(2,2), &wsaData);
@@ -18,24 +221,54 @@ int main()
         Err("WSAStartup failed: %d\n", iResult);
         return 1;
     }
-    vector<unique_ptr<Socket>> sockets;
-    for(int i = 0; i < MAX_SIZE; i++){
-        sockets.emplace_back(connectToServer("127.0.0.1", "80"));
+    std::vector<Load_Result> results(options.connections);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(options.duration_seconds));
+    for (unsigned i = 0; i < options.connections; i++) {
+        threads.emplace_back(driveConnection, std::cref(options), i, start, deadline, std::ref(results[i]));
     }
-
-    double avg_time = 0;
-    for(int i = 0; i < MAX_SIZE; i++){
-        auto t1 = std::chrono::high_resolution_clock::now();
-        HTTP_Builder<Type::Request> builder;
-        HTTP<Type::Request> req = builder.setCommand("GET").setURL("/text.txt").build();
-        sockets[i]->sendHTTP(req.to_string());
-        auto unused = sockets[i]->receiveHTTP();
-        auto t2 = std::chrono::high_resolution_clock::now();
-        avg_time += 1.0 * std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count() / MAX_SIZE;
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    Load_Result total;
+    for (const Load_Result &result: results) {
+        total.latency.merge(result.latency);
+        total.errors += result.errors;
+        total.non_2xx += result.non_2xx;
+        total.bytes += result.bytes;
     }
 
-    std::cout << "Using " << MAX_SIZE << " concurrent requests, it takes on avg for a single request " << avg_time << " ms.";
-    cout.flush();
+    const Latency_Histogram &latency = total.latency;
+    std::cout << "\n" << latency.count() << " requests in " << elapsed << " s over " << options.connections
+              << " connections";
+    if (options.pipeline_depth > 1) {
+        std::cout << " with " << options.pipeline_depth << " pipelined requests per connection";
+    }
+    if (options.rate > 0) {
+        std::cout << ", open loop at " << options.rate << " req/s";
+    } else {
+        std::cout << ", closed loop";
+    }
+    std::cout << "\n  Throughput: " << double(latency.count()) / elapsed << " req/s, "
+              << double(total.bytes) / elapsed / (1 << 20) << " MiB/s of bodies"
+              << "\n  Errors: " << total.errors << ", non-2xx responses: " << total.non_2xx
+              << "\n  Latency (ms): min " << toMs(latency.min()) << "  mean " << latency.mean() / 1e6
+              << "  p50 " << toMs(latency.percentile(50)) << "  p90 " << toMs(latency.percentile(90))
+              << "  p99 " << toMs(latency.percentile(99)) << "  p99.9 " << toMs(latency.percentile(99.9))
+              << "  max " << toMs(latency.max()) << std::endl;
+    if (options.json_path == "-") {
+        printJson(std::cout, options, total, elapsed);
+    } else if (!options.json_path.empty()) {
+        std::ofstream json(options.json_path);
+        printJson(json, options, total, elapsed);
+        if (!json) {
+            Err("failed to write %s", options.json_path.c_str());
+            return 1;
+        }
+    }
     WSACleanup();
     return 0;
 }
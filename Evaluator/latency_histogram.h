@@ -0,0 +1,106 @@
+#ifndef LATENCY_HISTOGRAM_H_INCLUDED
+#define LATENCY_HISTOGRAM_H_INCLUDED
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Counts latencies in log-linear buckets the way an HDR histogram does: every power of two is split into 128 equal
+ * buckets, so any value is kept with less than 1% error at a fixed memory cost whatever its range. Recording is O(1)
+ * and histograms of several threads are merged by adding their counts.
+ */
+class Latency_Histogram
+{
+public:
+    Latency_Histogram() : counts_(bucket_count, 0) {}
+
+    /**
+     * Counts a latency in nanoseconds.
+     */
+    void record(std::uint64_t value) {
+        counts_[bucketOf(value)]++;
+        count_++;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void merge(const Latency_Histogram &other) {
+        for (std::size_t i = 0; i < bucket_count; i++) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    /**
+     * Returns the smallest value at least the given percentage of the recorded ones do not exceed, rounded up to
+     * the end of its bucket. The maximum is exact.
+     */
+    std::uint64_t percentile(double percent) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        auto target = std::max<std::uint64_t>(1, std::uint64_t(std::ceil(percent / 100 * double(count_))));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; i++) {
+            seen += counts_[i];
+            if (seen >= target) {
+                return std::min(highestIn(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    std::uint64_t count() const {
+        return count_;
+    }
+
+    std::uint64_t min() const {
+        return count_ ? min_ : 0;
+    }
+
+    std::uint64_t max() const {
+        return max_;
+    }
+
+    double mean() const {
+        return count_ ? double(sum_) / double(count_) : 0;
+    }
+private:
+    static constexpr unsigned sub_bucket_bits = 7;
+    static constexpr std::size_t bucket_count = (64 - sub_bucket_bits + 1) << sub_bucket_bits;
+
+    /**
+     * Values below 256 get a bucket each, above that the top 8 significant bits pick it.
+     */
+    static std::size_t bucketOf(std::uint64_t value) {
+        unsigned msb = 63 - __builtin_clzll(value | 1);
+        if (msb <= sub_bucket_bits) {
+            return value;
+        }
+        unsigned shift = msb - sub_bucket_bits;
+        return (std::size_t(shift + 1) << sub_bucket_bits) + (value >> shift) - (1u << sub_bucket_bits);
+    }
+
+    static std::uint64_t highestIn(std::size_t bucket) {
+        if (bucket < (2u << sub_bucket_bits)) {
+            return bucket;
+        }
+        unsigned shift = unsigned(bucket >> sub_bucket_bits) - 1;
+        std::uint64_t lowest = ((bucket & ((1u << sub_bucket_bits) - 1)) + (1u << sub_bucket_bits)) << shift;
+        return lowest + (std::uint64_t(1) << shift) - 1;
+    }
+
+    std::vector<std::uint64_t> counts_;
+    std::uint64_t count_ = 0;
+    std::uint64_t sum_ = 0;
+    std::uint64_t min_ = UINT64_MAX;
+    std::uint64_t max_ = 0;
+};
+
+#endif // LATENCY_HISTOGRAM_H_INCLUDED
@@ -0,0 +1,247 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+#include "../http.h"
+#include "../http_parser.h"
+#include "../router.h"
+#include "http_corpus.h"
+
+/**
+ * Every heap allocation of the process is counted, so each benchmark can report how many an operation costs.
+ * */
+static std::size_t allocations = 0;
+
+void* operator new(std::size_t size)
+{
+    allocations++;
+    if(void* ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+// Messages using the default memory resource allocate through the aligned forms.
+void* operator new(std::size_t size, std::align_val_t align)
+{
+    allocations++;
+    std::size_t alignment = std::max(std::size_t(align), sizeof(void*));
+    if(void* ptr = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+/**
+ * Runs op once per iteration and reports its throughput over bytes per call, if it has any, and its allocations
+ * per call.
+ * */
+template<typename Op>
+static void measure(benchmark::State& state, std::size_t bytes, Op op)
+{
+    std::size_t before = allocations;
+    for(auto _ : state)
+    {
+        op();
+    }
+    if(bytes != 0)
+    {
+        state.SetBytesProcessed(std::int64_t(state.iterations() * bytes));
+    }
+    state.counters["allocs/op"] = benchmark::Counter(double(allocations - before), benchmark::Counter::kAvgIterations);
+}
+
+static void BM_read_request(benchmark::State& state, const std::string& msg)
+{
+    measure(state, msg.size(), [&]{
+        benchmark::DoNotOptimize(read_request(msg));
+    });
+}
+
+static void BM_read_response(benchmark::State& state, const std::string& msg)
+{
+    measure(state, msg.size(), [&]{
+        benchmark::DoNotOptimize(read_response(msg));
+    });
+}
+
+/**
+ * Frames and reads every request of a pipelined batch in place, the way a server connection does.
+ * */
+static void BM_read_pipeline(benchmark::State& state, const std::string& batch)
+{
+    HTTP_Parser parser;
+    measure(state, batch.size(), [&]{
+        std::string_view rest = batch;
+        while(!rest.empty() && parser.parse(rest) == Parse_Status::Complete)
+        {
+            benchmark::DoNotOptimize(read_request(parser));
+            rest.remove_prefix(parser.message_size());
+            parser.reset();
+        }
+    });
+}
+
+/**
+ * Like BM_read_pipeline, but the requests come from an arena reset after every batch, as on a server connection.
+ * */
+static void BM_read_pipeline_arena(benchmark::State& state, const std::string& batch)
+{
+    HTTP_Parser parser;
+    // Released blocks go back to the pool, so a batch allocates nothing once it is warm.
+    std::pmr::unsynchronized_pool_resource pool(std::pmr::pool_options{0, 1 << 20});
+    std::pmr::monotonic_buffer_resource arena(4096, &pool);
+    measure(state, batch.size(), [&]{
+        std::string_view rest = batch;
+        while(!rest.empty() && parser.parse(rest) == Parse_Status::Complete)
+        {
+            benchmark::DoNotOptimize(read_request(parser, &arena));
+            rest.remove_prefix(parser.message_size());
+            parser.reset();
+        }
+        arena.release();
+    });
+}
+
+/**
+ * Routes requests through a table of API endpoints next to a static file tree, the handlers do no work.
+ * */
+static void BM_route(benchmark::State& state)
+{
+    Router router;
+    auto handler = [](const HTTP<Type::Request>&, const Route_Params& params)
+    {
+        benchmark::DoNotOptimize(params.size());
+        return HTTP<Type::Response>();
+    };
+    for(const char* pattern : {"/api/status", "/api/users", "/api/users/:id", "/api/users/:id/posts",
+                               "/api/users/:id/posts/:post", "/api/uploads/*rest", "/*path"})
+    {
+        router.addRoute("GET", pattern, handler);
+    }
+    std::vector<HTTP<Type::Request>> requests;
+    std::size_t bytes = 0;
+    for(const char* url : {"/api/status", "/api/users/42/posts/7", "/api/users/42?fields=name", "/api/uploads/a/b.txt",
+                           "/static/css/site.css"})
+    {
+        requests.push_back(read_request("GET " + std::string(url) + " HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+        bytes += std::string_view(url).size();
+    }
+    measure(state, bytes, [&]{
+        for(const auto& req : requests)
+        {
+            benchmark::DoNotOptimize(router.route(req));
+        }
+    });
+}
+
+static void BM_message_type(benchmark::State& state, const std::string& msg)
+{
+    measure(state, msg.size(), [&]{
+        benchmark::DoNotOptimize(message_type(msg));
+    });
+}
+
+static void BM_build_request(benchmark::State& state)
+{
+    measure(state, 0, [&]{
+        HTTP_Builder<Type::Request> builder;
+        benchmark::DoNotOptimize(builder.setCommand("GET").setURL("/static/css/main.3f1c9a.css")
+                .addHeader(Header_Id::Host, "www.example.com").addHeader(Header_Id::Connection, "keep-alive")
+                .addHeader("Accept", "text/css,*/*;q=0.1").addHeader("Accept-Encoding", "gzip, deflate, br")
+                .build());
+    });
+}
+
+static void BM_build_response(benchmark::State& state)
+{
+    std::string body(state.range(0), 'x');
+    measure(state, body.size(), [&]{
+        HTTP_Builder<Type::Response> builder;
+        benchmark::DoNotOptimize(builder.setStatus(200).addHeader(Header_Id::Content_Type, "text/plain")
+                .addHeader(Header_Id::Connection, "keep-alive").addBody(body).build());
+    });
+}
+
+static void BM_request_to_string(benchmark::State& state, const std::string& msg)
+{
+    HTTP<Type::Request> req = read_request(msg);
+    measure(state, msg.size(), [&]{
+        benchmark::DoNotOptimize(req.to_string());
+    });
+}
+
+static void BM_response_to_string(benchmark::State& state, const std::string& msg)
+{
+    HTTP<Type::Response> resp = read_response(msg);
+    measure(state, msg.size(), [&]{
+        benchmark::DoNotOptimize(resp.to_string());
+    });
+}
+
+/**
+ * Serializes the head into a reused buffer, which is how the server sends every response.
+ * */
+static void BM_response_write_head(benchmark::State& state, const std::string& msg)
+{
+    HTTP<Type::Response> resp = read_response(msg);
+    std::string head;
+    measure(state, msg.size() - resp.get_body().size(), [&]{
+        head.clear();
+        resp.write_head(head);
+        benchmark::DoNotOptimize(head.data());
+    });
+}
+
+static const std::string post_large = make_post(64 << 10);
+static const std::string response_large = make_response(64 << 10);
+static const std::string pipeline_small = make_pipeline(small_get, 16);
+static const std::string pipeline_browser = make_pipeline(browser_get, 16);
+
+BENCHMARK_CAPTURE(BM_read_request, small_get, small_get);
+BENCHMARK_CAPTURE(BM_read_request, browser_get, browser_get);
+BENCHMARK_CAPTURE(BM_read_request, post_64KiB, post_large);
+BENCHMARK_CAPTURE(BM_read_pipeline, small_get_x16, pipeline_small);
+BENCHMARK_CAPTURE(BM_read_pipeline, browser_get_x16, pipeline_browser);
+BENCHMARK_CAPTURE(BM_read_pipeline_arena, small_get_x16, pipeline_small);
+BENCHMARK_CAPTURE(BM_read_pipeline_arena, browser_get_x16, pipeline_browser);
+BENCHMARK_CAPTURE(BM_read_response, small, small_response);
+BENCHMARK_CAPTURE(BM_read_response, browser, browser_response);
+BENCHMARK_CAPTURE(BM_read_response, body_64KiB, response_large);
+BENCHMARK(BM_route);
+BENCHMARK_CAPTURE(BM_message_type, request, browser_get);
+BENCHMARK_CAPTURE(BM_message_type, response, browser_response);
+BENCHMARK(BM_build_request);
+BENCHMARK(BM_build_response)->Arg(13)->Arg(64 << 10);
+BENCHMARK_CAPTURE(BM_request_to_string, browser_get, browser_get);
+BENCHMARK_CAPTURE(BM_request_to_string, post_64KiB, post_large);
+BENCHMARK_CAPTURE(BM_response_to_string, browser, browser_response);
+BENCHMARK_CAPTURE(BM_response_to_string, body_64KiB, response_large);
+BENCHMARK_CAPTURE(BM_response_write_head, browser, browser_response);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,89 @@
+#ifndef HTTP_CORPUS_H_INCLUDED
+#define HTTP_CORPUS_H_INCLUDED
+
+#include <string>
+
+/**
+ * Realistic messages shared by the benchmarks: a bare client request, a browser asset request with the usual
+ * dozen headers, uploads of any size and the responses a server sends back.
+ * */
+
+inline const std::string small_get =
+        "GET /text.txt HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Connection: Keep-Alive\r\n"
+        "\r\n";
+
+inline const std::string browser_get =
+        "GET /static/css/main.3f1c9a.css?v=20201101 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/86.0.4240.75 Safari/537.36\r\n"
+        "Accept: text/css,*/*;q=0.1\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Dest: style\r\n"
+        "Referer: https://www.example.com/index.html\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-US,en;q=0.9,ar;q=0.8\r\n"
+        "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.2.1234567890.1603000000\r\n"
+        "If-None-Match: \"5f9a-3f1c9a\"\r\n"
+        "If-Modified-Since: Sun, 01 Nov 2020 10:00:00 GMT\r\n"
+        "\r\n";
+
+inline std::string make_post(std::size_t body_size)
+{
+    return "POST /uploads/photo.png HTTP/1.1\r\n"
+           "Host: 127.0.0.1\r\n"
+           "Content-Type: img/png\r\n"
+           "Connection: Keep-Alive\r\n"
+           "Content-Length: " + std::to_string(body_size) + "\r\n"
+           "\r\n" + std::string(body_size, 'x');
+}
+
+inline const std::string small_response =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 13\r\n"
+        "\r\n"
+        "Hello, world!";
+
+inline const std::string browser_response =
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Sun, 01 Nov 2020 10:00:00 GMT\r\n"
+        "Server: Network_lab\r\n"
+        "Content-Type: text/css\r\n"
+        "Content-Length: 0\r\n"
+        "Cache-Control: public, max-age=31536000, immutable\r\n"
+        "ETag: \"5f9a-3f1c9a\"\r\n"
+        "Last-Modified: Sun, 01 Nov 2020 09:00:00 GMT\r\n"
+        "Vary: Accept-Encoding\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "X-Content-Type-Options: nosniff\r\n"
+        "Strict-Transport-Security: max-age=63072000\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+
+inline std::string make_response(std::size_t body_size)
+{
+    return "HTTP/1.1 200 OK\r\n"
+           "Content-Type: img/png\r\n"
+           "Content-Length: " + std::to_string(body_size) + "\r\n"
+           "\r\n" + std::string(body_size, 'x');
+}
+
+/**
+ * Concatenates count copies of the message, as a client pipelining them would send them.
+ * */
+inline std::string make_pipeline(const std::string& msg, std::size_t count)
+{
+    std::string batch;
+    batch.reserve(msg.size() * count);
+    for(std::size_t i = 0; i < count; i++)
+    {
+        batch += msg;
+    }
+    return batch;
+}
+
+#endif // HTTP_CORPUS_H_INCLUDED
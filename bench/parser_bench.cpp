@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include "../http.h"
+#include "../http_parser.h"
+#include "http_corpus.h"
+
+using namespace std;
+
+/**
+ * The stringstream based parser that HTTP_Parser replaced, kept as the baseline of the comparison.
+ * */
+static HTTP<Type::Request> legacy_read_request(const std::string& msg)
+{
+    std::stringstream line_stream(msg);
+    HTTP_Builder<Type::Request> builder;
+    std::string line, token;
+    std::getline(line_stream, line);
+    std::stringstream stream(line);
+    stream >> token;
+    builder.setCommand(token);
+    stream >> token;
+    builder.setURL(token);
+    while(std::getline(line_stream, line))
+    {
+        line.pop_back();
+        if(line.empty())
+        {
+            break;
+        }
+        std::stringstream header_stream{line};
+        header_stream >> token;
+        token.pop_back();
+        std::string header_name = std::move(token);
+        header_stream >> token;
+        builder.addHeader(header_name, token);
+    }
+    builder.addBody(std::string (std::istreambuf_iterator<char>(line_stream), {}));
+    return builder.build();
+}
+
+/**
+ * Runs the parse function over the request mix and prints its cost per request.
+ * */
+template<typename Parse>
+static void run(const char* name, const vector<const string*>& mix, std::size_t iterations, Parse parse)
+{
+    std::size_t bytes = 0, sink = 0;
+    auto t1 = std::chrono::steady_clock::now();
+    for(std::size_t i = 0; i < iterations; i++)
+    {
+        const string& msg = *mix[i % mix.size()];
+        sink += parse(msg);
+        bytes += msg.size();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(t2 - t1).count();
+    cout << "  " << name << ": " << ns / iterations << " ns/request, "
+         << bytes / (ns / 1e9) / (1 << 20) << " MiB/s (" << sink % 10 << ")\n";
+}
+
+static void compare(const char* name, const vector<const string*>& mix, std::size_t iterations)
+{
+    cout << name << "\n";
+    run("stringstream read_request", mix, iterations, [](const string& msg){
+        return legacy_read_request(msg).get_url().size();
+    });
+    run("HTTP_Parser::parse        ", mix, iterations, [](const string& msg){
+        HTTP_Parser parser;
+        parser.parse(msg);
+        return parser.get_url().size();
+    });
+    run("HTTP_Parser + read_request", mix, iterations, [](const string& msg){
+        HTTP_Parser parser;
+        parser.parse(msg);
+        return read_request(parser).get_url().size();
+    });
+}
+
+int main(int argc, char* argv[])
+{
+    std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 200000;
+    const string post_small = make_post(512), post_large = make_post(64 << 10);
+
+    compare("small GET", {&small_get}, iterations);
+    compare("browser GET", {&browser_get}, iterations);
+    compare("POST 64 KiB", {&post_large}, iterations / 10);
+
+    // A realistic mix: mostly browser asset requests, some bare clients and a few uploads.
+    vector<const string*> mix;
+    mix.insert(mix.end(), 14, &browser_get);
+    mix.insert(mix.end(), 4, &small_get);
+    mix.insert(mix.end(), 2, &post_small);
+    std::shuffle(mix.begin(), mix.end(), std::mt19937(42));
+    compare("mixed (70% browser GET, 20% small GET, 10% POST 512 B)", mix, iterations);
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include "buffer.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <mutex>
+#include <array>
+
+// Size classes from min_block_size to max_pooled_size.
+constexpr std::size_t n_size_classes = 9;
+static_assert(Buffer_Pool::min_block_size << (n_size_classes - 1) == Buffer_Pool::max_pooled_size);
+// Blocks a thread keeps per size class before handing them to the shared lists.
+constexpr std::size_t thread_cache_blocks = 8;
+// Bytes the shared list of a size class may keep before blocks are freed for real.
+constexpr std::size_t shared_class_bytes = 16 << 20;
+
+static std::size_t size_class(std::size_t size) {
+    std::size_t cls = 0;
+    while ((Buffer_Pool::min_block_size << cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+namespace {
+    struct Shared_Class {
+        std::mutex mutex;
+        std::vector<char *> blocks;
+    };
+
+    std::array<Shared_Class, n_size_classes> &shared_classes() {
+        static std::array<Shared_Class, n_size_classes> classes;
+        return classes;
+    }
+
+    /**
+     * Hands a block to the shared list of its size class, or frees it if that list is full.
+     */
+    void release_shared(char *block, std::size_t cls) {
+        Shared_Class &shared = shared_classes()[cls];
+        {
+            std::scoped_lock<std::mutex> lock(shared.mutex);
+            if ((shared.blocks.size() + 1) * (Buffer_Pool::min_block_size << cls) <= shared_class_bytes) {
+                shared.blocks.push_back(block);
+                return;
+            }
+        }
+        delete[] block;
+    }
+
+    /**
+     * The blocks cached by one thread, handed to the shared lists when the thread exits.
+     */
+    struct Thread_Cache {
+        std::array<std::vector<char *>, n_size_classes> blocks;
+
+        ~Thread_Cache() {
+            for (std::size_t cls = 0; cls < n_size_classes; cls++) {
+                for (char *block: blocks[cls]) {
+                    release_shared(block, cls);
+                }
+            }
+        }
+    };
+
+    thread_local Thread_Cache thread_cache;
+}
+
+/**
+ * Returns a block of at least min_size bytes and stores its actual size in size.
+ */
+char *Buffer_Pool::acquire(std::size_t min_size, std::size_t &size) {
+    if (min_size > max_pooled_size) {
+        size = min_size;
+        return new char[size];
+    }
+    std::size_t cls = size_class(min_size);
+    size = min_block_size << cls;
+    auto &cached = thread_cache.blocks[cls];
+    if (!cached.empty()) {
+        char *block = cached.back();
+        cached.pop_back();
+        return block;
+    }
+    Shared_Class &shared = shared_classes()[cls];
+    {
+        std::scoped_lock<std::mutex> lock(shared.mutex);
+        if (!shared.blocks.empty()) {
+            char *block = shared.blocks.back();
+            shared.blocks.pop_back();
+            return block;
+        }
+    }
+    return new char[size];
+}
+
+/**
+ * Gives back a block returned by acquire() together with its size.
+ */
+void Buffer_Pool::release(char *block, std::size_t size) {
+    if (size > max_pooled_size) {
+        delete[] block;
+        return;
+    }
+    std::size_t cls = size_class(size);
+    auto &cached = thread_cache.blocks[cls];
+    if (cached.size() < thread_cache_blocks) {
+        cached.push_back(block);
+        return;
+    }
+    release_shared(block, cls);
+}
+
+Recv_Buffer::~Recv_Buffer() {
+    release();
+}
+
+/**
+ * Returns free space of at least min_size bytes after the unread ones, moving them to the front of
+ * the block or to a larger block only when the free space is too small.
+ */
+std::pair<char *, std::size_t> Recv_Buffer::prepare(std::size_t min_size) {
+    std::size_t unread = end_ - begin_;
+    if (size_ - end_ < min_size) {
+        if (size_ - unread >= min_size && begin_ != 0) {
+            // Enough room once the already consumed bytes are reclaimed.
+            std::memmove(block_, block_ + begin_, unread);
+        } else {
+            std::size_t size;
+            char *block = Buffer_Pool::acquire(std::max(unread + min_size, 2 * size_), size);
+            if (block_) {
+                std::memcpy(block, block_ + begin_, unread);
+                Buffer_Pool::release(block_, size_);
+            }
+            block_ = block;
+            size_ = size;
+        }
+        begin_ = 0;
+        end_ = unread;
+    }
+    return {block_ + end_, size_ - end_};
+}
+
+/**
+ * Drops size bytes from the front, releasing the block once nothing is left.
+ */
+void Recv_Buffer::consume(std::size_t size) {
+    begin_ += size;
+    if (begin_ == end_) {
+        release();
+    }
+}
+
+/**
+ * Gives the block back to the pool, dropping any unread bytes.
+ */
+void Recv_Buffer::release() {
+    if (block_) {
+        Buffer_Pool::release(block_, size_);
+    }
+    block_ = nullptr;
+    size_ = begin_ = end_ = 0;
+}
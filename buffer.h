@@ -0,0 +1,83 @@
+#ifndef BUFFER_H_INCLUDED
+#define BUFFER_H_INCLUDED
+
+#include <string_view>
+#include <cstddef>
+#include <utility>
+
+/**
+ * A process wide pool of receive blocks in power of two size classes. Every thread keeps a few blocks of
+ * each class for itself and only touches the shared, locked free lists when that cache runs empty or full.
+ */
+class Buffer_Pool
+{
+public:
+    static constexpr std::size_t min_block_size = 1 << 12;
+    static constexpr std::size_t max_pooled_size = 1 << 20;
+
+    /**
+     * Returns a block of at least min_size bytes and stores its actual size in size.
+     */
+    static char *acquire(std::size_t min_size, std::size_t &size);
+
+    /**
+     * Gives back a block returned by acquire() together with its size.
+     */
+    static void release(char *block, std::size_t size);
+};
+
+/**
+ * A growable receive buffer drawn from the Buffer_Pool.
+ *
+ * Bytes are received into the free space after the unread ones and consumed from the front, so messages are
+ * framed in place and the bytes of a pipelined message stay where they are until it is handled. The block
+ * goes back to the pool as soon as everything is consumed, so an idle connection holds no memory.
+ */
+class Recv_Buffer
+{
+public:
+    Recv_Buffer() = default;
+    Recv_Buffer(const Recv_Buffer &) = delete;
+    Recv_Buffer &operator=(const Recv_Buffer &) = delete;
+    ~Recv_Buffer();
+
+    /**
+     * The received bytes that have not been consumed yet.
+     */
+    std::string_view data() const {
+        return {block_ + begin_, end_ - begin_};
+    }
+    bool empty() const {
+        return begin_ == end_;
+    }
+
+    /**
+     * Returns free space of at least min_size bytes after the unread ones, moving them to the front of
+     * the block or to a larger block only when the free space is too small.
+     */
+    std::pair<char *, std::size_t> prepare(std::size_t min_size = Buffer_Pool::min_block_size);
+
+    /**
+     * Marks size bytes of the space returned by prepare() as received.
+     */
+    void commit(std::size_t size) {
+        end_ += size;
+    }
+
+    /**
+     * Drops size bytes from the front, releasing the block once nothing is left.
+     */
+    void consume(std::size_t size);
+
+    /**
+     * Gives the block back to the pool, dropping any unread bytes.
+     */
+    void release();
+private:
+    char *block_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+};
+
+#endif // BUFFER_H_INCLUDED
@@ -0,0 +1,415 @@
+#include "compression.h"
+#include <algorithm>
+#include <charconv>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+static constexpr std::array<std::string_view, 3> coding_names{"identity", "gzip", "br"};
+static constexpr std::array<std::string_view, 3> coding_extensions{"", ".gz", ".br"};
+
+bool codingSupported(Content_Coding coding) {
+    switch (coding) {
+        case Content_Coding::Identity:
+            return true;
+        case Content_Coding::Gzip:
+#ifdef HAVE_ZLIB
+            return true;
+#else
+            return false;
+#endif
+        case Content_Coding::Brotli:
+#ifdef HAVE_BROTLI
+            return true;
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+std::string_view codingName(Content_Coding coding) {
+    return coding_names[static_cast<std::size_t>(coding)];
+}
+
+std::string_view codingExtension(Content_Coding coding) {
+    return coding_extensions[static_cast<std::size_t>(coding)];
+}
+
+static std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+/**
+ * Parses the weight of an element of Accept-Encoding, "q=0.5", in thousandths. Malformed weights count as 1.
+ */
+static int parseWeight(std::string_view params) {
+    std::size_t q = params.find("q=");
+    if (q == std::string_view::npos) {
+        q = params.find("Q=");
+    }
+    if (q == std::string_view::npos) {
+        return 1000;
+    }
+    std::string_view value = trim(params.substr(q + 2));
+    int weight = 0;
+    if (value.empty() || (value[0] != '0' && value[0] != '1')) {
+        return 1000;
+    }
+    weight = (value[0] - '0') * 1000;
+    if (value.size() > 1 && value[1] == '.') {
+        int scale = 100;
+        for (std::size_t i = 2; i < value.size() && i < 5 && value[i] >= '0' && value[i] <= '9'; i++) {
+            weight += (value[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    return std::min(weight, 1000);
+}
+
+/**
+ * Chooses the supported coding the value of an Accept-Encoding header prefers by its q-values, Brotli before
+ * gzip before identity on a tie. Identity is chosen if the header is absent.
+ */
+Content_Coding negotiateCoding(std::optional<std::string_view> accept_encoding) {
+    if (!accept_encoding) {
+        return Content_Coding::Identity;
+    }
+    // Weights of identity, gzip and br, -1 while not named, then the weight of "*" applies.
+    std::array<int, 3> weights{-1, -1, -1};
+    int any = -1;
+    std::string_view list = *accept_encoding;
+    while (!list.empty()) {
+        std::size_t comma = list.find(',');
+        std::string_view element = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        std::size_t semicolon = element.find(';');
+        std::string_view name = trim(element.substr(0, semicolon));
+        int weight = semicolon == std::string_view::npos ? 1000 : parseWeight(element.substr(semicolon + 1));
+        if (name == "*") {
+            any = weight;
+        } else if (iequals(name, "x-gzip")) {
+            weights[1] = std::max(weights[1], weight);
+        } else {
+            for (std::size_t i = 0; i < coding_names.size(); i++) {
+                if (iequals(name, coding_names[i])) {
+                    weights[i] = std::max(weights[i], weight);
+                }
+            }
+        }
+    }
+    Content_Coding best = Content_Coding::Identity;
+    // Identity is acceptable unless excluded, but only preferred over an accepted coding if weighted higher.
+    int best_weight = weights[0] >= 0 ? weights[0] : (any == 0 ? 0 : 1);
+    for (Content_Coding coding: {Content_Coding::Gzip, Content_Coding::Brotli}) {
+        int weight = weights[static_cast<std::size_t>(coding)];
+        weight = weight >= 0 ? weight : any;
+        if (codingSupported(coding) && weight > 0 && weight >= best_weight) {
+            best = coding;
+            best_weight = weight;
+        }
+    }
+    return best;
+}
+
+/**
+ * Whether a body of the given Content-Type shrinks when compressed: text, scripts, JSON, XML and SVG but not
+ * images, video, archives and other formats that are compressed already.
+ */
+bool isCompressible(std::string_view content_type) {
+    content_type = trim(content_type.substr(0, content_type.find(';')));
+    if (content_type.size() >= 5 && iequals(content_type.substr(0, 5), "text/")) {
+        return true;
+    }
+    for (std::string_view kind: {"javascript", "json", "xml", "svg", "wasm"}) {
+        if (content_type.find(kind) != std::string_view::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef HAVE_ZLIB
+static bool gzipCompress(std::string_view in, int level, std::string &out) {
+    z_stream stream{};
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&stream, uLong(in.size())));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    stream.avail_in = uInt(in.size());
+    stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    stream.avail_out = uInt(out.size());
+    int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+#endif
+
+#ifdef HAVE_BROTLI
+static bool brotliCompress(std::string_view in, int quality, std::string &out) {
+    std::size_t size = BrotliEncoderMaxCompressedSize(in.size());
+    out.resize(size != 0 ? size : in.size() + 1024);
+    size = out.size();
+    if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, in.size(),
+                               reinterpret_cast<const std::uint8_t *>(in.data()), &size,
+                               reinterpret_cast<std::uint8_t *>(&out[0]))) {
+        return false;
+    }
+    out.resize(size);
+    return true;
+}
+#endif
+
+/**
+ * The ETag of a coded representation, the ETag of the file tagged with the coding: "\"c-1a\"" -> "\"c-1a-gzip\"".
+ */
+static std::string codedEtag(std::string_view etag, Content_Coding coding) {
+    std::string coded(etag);
+    if (!coded.empty() && coded.back() == '"') {
+        coded.insert(coded.size() - 1, "-" + std::string(codingName(coding)));
+    }
+    return coded;
+}
+
+/**
+ * Starts the coded answer for a full response, carrying its headers except those describing its body.
+ */
+static HTTP_Builder<Type::Response> codedAnswer(const HTTP<Type::Response> &full, Content_Coding coding,
+                                                std::string_view etag, std::pmr::memory_resource *resource) {
+    HTTP_Builder<Type::Response> builder(resource);
+    builder.setStatus(200);
+    const Header_Map &headers = full.get_headers();
+    builder.reserveHeaders(headers.wire().size() + 96);
+    for (std::size_t i = 0; i < headers.size(); i++) {
+        Header_View header = headers[i];
+        Header_Id id = header_id(header.name);
+        if (id != Header_Id::Content_Length && id != Header_Id::ETag) {
+            builder.addHeader(header.name, header.value);
+        }
+    }
+    return builder.addHeader(Header_Id::Content_Encoding, codingName(coding)).addHeader(Header_Id::ETag, etag)
+            .addHeader("Vary", "Accept-Encoding");
+}
+
+/**
+ * Creates a cache holding at most capacity bytes of compressed files, compressing files of at most
+ * max_file_size bytes.
+ */
+Compression_Cache::Compression_Cache(std::size_t capacity, std::size_t max_file_size, int gzip_level,
+                                     int brotli_quality, std::chrono::milliseconds revalidate_interval)
+        : shard_capacity_(capacity / n_shards), max_file_size_(max_file_size), gzip_level_(gzip_level),
+          brotli_quality_(brotli_quality), revalidate_interval_(revalidate_interval) {}
+
+/**
+ * Turns the full 200 response for the file at the given path, carrying its ETag and Content-Type, into one
+ * in the coding the request prefers, with an ETag of its own. Responses of a compressible type get
+ * Vary: Accept-Encoding either way, the others, and those that compression would not shrink, are returned
+ * as they are. The answer is allocated from the resource of the request.
+ */
+HTTP<Type::Response> Compression_Cache::encode(const HTTP<Type::Request> &req, HTTP<Type::Response> full,
+                                               const std::string &path) {
+    auto content_type = full.find_header(Header_Id::Content_Type);
+    if (full.get_status().substr(0, 3) != "200" || full.get_stream_body() || !content_type ||
+        !isCompressible(*content_type) || full.find_header(Header_Id::Content_Encoding)) {
+        return full;
+    }
+    Content_Coding coding = negotiateCoding(req.find_header(Header_Id::Accept_Encoding));
+    auto etag = full.find_header(Header_Id::ETag);
+    if (coding != Content_Coding::Identity && etag) {
+        auto entry = coded(full, path, coding, *etag);
+        if (entry && entry->sibling) {
+            const auto &sibling = entry->sibling;
+            precompressed_++;
+            return codedAnswer(full, coding, codedEtag(sibling->etag(), coding), req.get_resource())
+                    .addFileBody({sibling, 0, sibling->size()}).build();
+        }
+        if (entry && entry->data.owner) {
+            return codedAnswer(full, coding, codedEtag(*etag, coding), req.get_resource())
+                    .addBody(entry->data).build();
+        }
+    }
+    // Caches have to keep the identity answer apart from the coded ones.
+    return HTTP_Builder<Type::Response>(std::move(full)).addHeader("Vary", "Accept-Encoding").build();
+}
+
+static std::int64_t steadyMs() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Opens the precompressed sibling of the file, nullptr if there is none or it is older than the file, left
+ * behind by an earlier version of it.
+ */
+static std::shared_ptr<const File_Handle> openSibling(const HTTP<Type::Response> &full, const std::string &path,
+                                                      Content_Coding coding) {
+    auto last_modified = full.find_header(Header_Id::Last_Modified);
+    auto modified = last_modified ? parse_http_date(*last_modified) : std::nullopt;
+    if (!modified) {
+        return nullptr;
+    }
+    auto sibling = File_Handle::open(path + std::string(codingExtension(coding)));
+    if (!sibling || sibling->mtime() < *modified) {
+        return nullptr;
+    }
+    return sibling;
+}
+
+/**
+ * Returns the precompressed sibling or the compressed file, from the cache if it holds the current version
+ * and the sibling was looked up within the revalidation interval, nullptr if the file could not be read.
+ */
+std::shared_ptr<const Compression_Cache::Entry> Compression_Cache::coded(const HTTP<Type::Response> &full,
+                                                                         const std::string &path,
+                                                                         Content_Coding coding,
+                                                                         std::string_view etag) {
+    std::string key = path;
+    key += '\0';
+    key += codingName(coding);
+    Shard &shard = shards_[std::hash<std::string>{}(key) % n_shards];
+    std::shared_ptr<const Entry> cached;
+    {
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end() && it->second->entry->source_etag == etag) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            cached = it->second->entry;
+        }
+    }
+    std::int64_t now = steadyMs();
+    if (cached && now - cached->checked_ms.load(std::memory_order_relaxed) < revalidate_interval_.count()) {
+        if (!cached->sibling) {
+            hits_++;
+        }
+        return cached;
+    }
+    if (auto sibling = openSibling(full, path, coding)) {
+        auto entry = std::make_shared<Entry>();
+        entry->source_etag = etag;
+        entry->sibling = std::move(sibling);
+        entry->checked_ms.store(now, std::memory_order_relaxed);
+        insert(shard, key, entry);
+        return entry;
+    }
+    // Still no sibling, what was compressed for this version stays good.
+    if (cached && !cached->sibling) {
+        cached->checked_ms.store(now, std::memory_order_relaxed);
+        hits_++;
+        return cached;
+    }
+    misses_++;
+    std::shared_ptr<Entry> entry;
+    if (full.body_size() > max_file_size_) {
+        // Remembered as sent as it is, so the sibling is not looked for on every request.
+        entry = std::make_shared<Entry>();
+        entry->source_etag = etag;
+    } else {
+        // Compressed outside the lock, two threads missing at once both compress and the later result is kept.
+        entry = compress(full, coding, etag);
+        if (!entry) {
+            return nullptr;
+        }
+    }
+    entry->checked_ms.store(now, std::memory_order_relaxed);
+    insert(shard, key, entry);
+    return entry;
+}
+
+/**
+ * Compresses the whole body of the response, in memory or from its file.
+ */
+std::shared_ptr<Compression_Cache::Entry> Compression_Cache::compress(const HTTP<Type::Response> &full,
+                                                                      Content_Coding coding,
+                                                                      std::string_view etag) const {
+    std::string_view in = full.get_body();
+    std::string read;
+    const File_Range &file = full.get_file_body();
+    if (file.length != 0) {
+        read.reserve(in.size() + file.length);
+        read.append(in);
+        read.resize(in.size() + file.length);
+        std::uint64_t offset = 0;
+        while (offset < file.length) {
+            long n = file.file->read_at(&read[in.size() + offset], file.length - offset, file.offset + offset);
+            if (n <= 0) {
+                return nullptr;
+            }
+            offset += n;
+        }
+        in = read;
+    }
+    auto out = std::make_shared<std::string>();
+    bool done = false;
+#ifdef HAVE_ZLIB
+    if (coding == Content_Coding::Gzip) {
+        done = gzipCompress(in, gzip_level_, *out);
+    }
+#endif
+#ifdef HAVE_BROTLI
+    if (coding == Content_Coding::Brotli) {
+        done = brotliCompress(in, brotli_quality_, *out);
+    }
+#endif
+    if (!done) {
+        return nullptr;
+    }
+    auto entry = std::make_shared<Entry>();
+    entry->source_etag = etag;
+    // Remembered as not worth it, so the file is not compressed again for every request.
+    if (out->size() < in.size()) {
+        out->shrink_to_fit();
+        entry->data = {out, *out};
+    }
+    return entry;
+}
+
+/**
+ * Bytes of memory an entry is charged for, a sibling counts with its size so the open files stay bounded too.
+ */
+std::size_t Compression_Cache::entrySize(const std::string &key, const Entry &entry) {
+    return key.size() + entry.data.data.size() + (entry.sibling ? std::size_t(entry.sibling->size()) : 0);
+}
+
+void Compression_Cache::insert(Shard &shard, const std::string &key, std::shared_ptr<const Entry> entry) {
+    std::size_t size = entrySize(key, *entry);
+    std::scoped_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+        // Another thread compressed the same file meanwhile, or an older version of it is cached.
+        shard.bytes -= entrySize(key, *it->second->entry);
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    shard.lru.push_front({key, std::move(entry)});
+    shard.index.emplace(key, shard.lru.begin());
+    shard.bytes += size;
+    while (shard.bytes > shard_capacity_ && shard.lru.size() > 1) {
+        Node &victim = shard.lru.back();
+        shard.bytes -= entrySize(victim.key, *victim.entry);
+        shard.index.erase(victim.key);
+        shard.lru.pop_back();
+        evictions_++;
+    }
+}
+
+Compression_Cache::Stats Compression_Cache::stats() const {
+    Stats stats{hits_.load(), misses_.load(), precompressed_.load(), evictions_.load(), 0, 0};
+    for (auto &shard: shards_) {
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        stats.entries += shard.index.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
@@ -0,0 +1,150 @@
+#ifndef COMPRESSION_H_INCLUDED
+#define COMPRESSION_H_INCLUDED
+
+#include "http.h"
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <array>
+
+/**
+ * A content coding a response can be sent in. Gzip needs zlib and Brotli libbrotlienc at build time, without
+ * them those codings are never chosen.
+ */
+enum class Content_Coding
+{
+    Identity, Gzip, Brotli
+};
+
+/**
+ * Whether the coding was built in.
+ */
+bool codingSupported(Content_Coding coding);
+
+/**
+ * The value of Content-Encoding for the coding, and the extension of a file precompressed with it.
+ */
+std::string_view codingName(Content_Coding coding);
+std::string_view codingExtension(Content_Coding coding);
+
+/**
+ * Chooses the supported coding the value of an Accept-Encoding header prefers by its q-values, Brotli before
+ * gzip before identity on a tie. Identity is chosen if the header is absent.
+ */
+Content_Coding negotiateCoding(std::optional<std::string_view> accept_encoding);
+
+/**
+ * Whether a body of the given Content-Type shrinks when compressed: text, scripts, JSON, XML and SVG but not
+ * images, video, archives and other formats that are compressed already.
+ */
+bool isCompressible(std::string_view content_type);
+
+/**
+ * Serves static files in the content coding the client prefers.
+ *
+ * A precompressed sibling of the file on disk, "x.css.br" or "x.css.gz" for "x.css", is sent as it is when it is
+ * at least as new as the file. Otherwise the file is compressed on the fly. Either outcome is cached, keyed by path
+ * and coding and validated against the ETag of the file, which changes with its size and mtime, so every version
+ * is compressed once. Whether a sibling exists is looked up again at most once per revalidation interval, like
+ * File_Cache does for the file itself. The least recently used entries are evicted once the cache is full, which is
+ * split into independently locked shards like File_Cache.
+ */
+class Compression_Cache
+{
+public:
+    struct Stats
+    {
+        std::uint64_t hits;
+        std::uint64_t misses;
+        // Answers sent from a precompressed sibling.
+        std::uint64_t precompressed;
+        std::uint64_t evictions;
+        std::size_t entries;
+        std::size_t bytes;
+    };
+
+    /**
+     * Creates a cache holding at most capacity bytes of compressed files, compressing files of at most
+     * max_file_size bytes.
+     */
+    explicit Compression_Cache(std::size_t capacity = 32 << 20, std::size_t max_file_size = 8 << 20,
+                               int gzip_level = 6, int brotli_quality = 5,
+                               std::chrono::milliseconds revalidate_interval = std::chrono::seconds(1));
+
+    /**
+     * Turns the full 200 response for the file at the given path, carrying its ETag and Content-Type, into one
+     * in the coding the request prefers, with an ETag of its own. Responses of a compressible type get
+     * Vary: Accept-Encoding either way, the others, and those that compression would not shrink, are returned
+     * as they are. The answer is allocated from the resource of the request.
+     */
+    HTTP<Type::Response> encode(const HTTP<Type::Request> &req, HTTP<Type::Response> full, const std::string &path);
+
+    Stats stats() const;
+private:
+    struct Entry
+    {
+        // ETag of the version of the file that was compressed.
+        std::string source_etag;
+        // The precompressed sibling sent instead of compressing, nullptr if there was none.
+        std::shared_ptr<const File_Handle> sibling;
+        // Empty if there is a sibling, or if compressing did not make the file smaller or it is too large to be
+        // compressed, it is then sent as it is.
+        Shared_Bytes data;
+        // Milliseconds on the steady clock of the last lookup of the sibling.
+        mutable std::atomic<std::int64_t> checked_ms{0};
+    };
+
+    struct Node
+    {
+        std::string key;
+        std::shared_ptr<const Entry> entry;
+    };
+
+    /**
+     * An independently locked part of the cache, most recently used entries first.
+     */
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        std::list<Node> lru;
+        std::unordered_map<std::string, std::list<Node>::iterator> index;
+        std::size_t bytes = 0;
+    };
+    static constexpr std::size_t n_shards = 8;
+
+    /**
+     * Returns the precompressed sibling or the compressed file, from the cache if it holds the current version
+     * and the sibling was looked up within the revalidation interval, nullptr if the file could not be read.
+     */
+    std::shared_ptr<const Entry> coded(const HTTP<Type::Response> &full, const std::string &path,
+                                            Content_Coding coding, std::string_view etag);
+
+    /**
+     * Compresses the whole body of the response, in memory or from its file.
+     */
+    std::shared_ptr<Entry> compress(const HTTP<Type::Response> &full, Content_Coding coding,
+                                    std::string_view etag) const;
+
+    void insert(Shard &shard, const std::string &key, std::shared_ptr<const Entry> entry);
+
+    /**
+     * Bytes of memory an entry is charged for, a sibling counts with its size so the open files stay bounded too.
+     */
+    static std::size_t entrySize(const std::string &key, const Entry &entry);
+
+    std::size_t shard_capacity_;
+    std::size_t max_file_size_;
+    int gzip_level_;
+    int brotli_quality_;
+    std::chrono::milliseconds revalidate_interval_;
+    std::array<Shard, n_shards> shards_;
+    std::atomic<std::uint64_t> hits_{0}, misses_{0}, precompressed_{0}, evictions_{0};
+};
+
+#endif // COMPRESSION_H_INCLUDED
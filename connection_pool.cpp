@@ -0,0 +1,48 @@
+#include "connection_pool.h"
+
+/**
+ * Creates an empty pool holding at most max_idle_per_host idle connections to every server, which speak TLS
+ * with the given client context if there is one.
+ */
+Connection_Pool::Connection_Pool(std::size_t max_idle_per_host, std::shared_ptr<Tls_Context> tls)
+        : max_idle_per_host_(max_idle_per_host), tls_(std::move(tls)) {}
+
+/**
+ * Returns an idle connection to the server, or connects a new one if there is none. reused tells which, a
+ * reused connection may have been closed by the server in the meantime. Returns nullptr if connecting fails.
+ */
+std::unique_ptr<Socket> Connection_Pool::acquire(const std::string &host, const std::string &port, bool &reused) {
+    {
+        std::scoped_lock lock(mutex_);
+        auto it = idle_.find(host + ':' + port);
+        if (it != idle_.end() && !it->second.empty()) {
+            // The most recently used connection is the least likely to have timed out.
+            std::unique_ptr<Socket> socket = std::move(it->second.back());
+            it->second.pop_back();
+            reused = true;
+            return socket;
+        }
+    }
+    reused = false;
+    // A new connection resumes the last TLS session with the server, so only the first one pays the full handshake.
+    return connectToServer(host.c_str(), port.c_str(), tls_);
+}
+
+/**
+ * Hands back a connection whose requests are all answered, so it can carry the next ones.
+ */
+void Connection_Pool::release(const std::string &host, const std::string &port, std::unique_ptr<Socket> socket) {
+    std::scoped_lock lock(mutex_);
+    auto &idle = idle_[host + ':' + port];
+    if (idle.size() < max_idle_per_host_) {
+        idle.push_back(std::move(socket));
+    }
+}
+
+/**
+ * Returns whether a connection can carry another request after the given response.
+ */
+bool Connection_Pool::keepsAlive(const HTTP<Type::Response> &resp) {
+    auto connection = resp.find_header(Header_Id::Connection);
+    return !connection || !iequals(*connection, "close");
+}
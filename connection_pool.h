@@ -0,0 +1,48 @@
+#ifndef CONNECTION_POOL_H_INCLUDED
+#define CONNECTION_POOL_H_INCLUDED
+
+#include "networking.h"
+#include <mutex>
+#include <unordered_map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Keeps the idle keep-alive connections of a client keyed by host and port, so the next request to the same server
+ * skips the connect. Safe to share between threads, each connection is used by one of them at a time.
+ */
+class Connection_Pool
+{
+public:
+    /**
+     * Creates an empty pool holding at most max_idle_per_host idle connections to every server, which speak TLS
+     * with the given client context if there is one.
+     */
+    explicit Connection_Pool(std::size_t max_idle_per_host = 64, std::shared_ptr<Tls_Context> tls = nullptr);
+    Connection_Pool(const Connection_Pool &) = delete;
+    Connection_Pool &operator=(const Connection_Pool &) = delete;
+
+    /**
+     * Returns an idle connection to the server, or connects a new one if there is none. reused tells which, a
+     * reused connection may have been closed by the server in the meantime. Returns nullptr if connecting fails.
+     */
+    std::unique_ptr<Socket> acquire(const std::string &host, const std::string &port, bool &reused);
+
+    /**
+     * Hands back a connection whose requests are all answered, so it can carry the next ones.
+     */
+    void release(const std::string &host, const std::string &port, std::unique_ptr<Socket> socket);
+
+    /**
+     * Returns whether a connection can carry another request after the given response.
+     */
+    static bool keepsAlive(const HTTP<Type::Response> &resp);
+private:
+    std::size_t max_idle_per_host_;
+    std::shared_ptr<Tls_Context> tls_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::vector<std::unique_ptr<Socket>>> idle_;
+};
+
+#endif // CONNECTION_POOL_H_INCLUDED
@@ -0,0 +1,445 @@
+#ifdef __linux__
+
+#include "event_loop.h"
+#include "debugger.h"
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <stdexcept>
+#include <algorithm>
+
+constexpr int max_events = 256;
+// Upper bound on reads per wakeup so one busy connection cannot starve the others.
+constexpr int max_reads_per_event = 16;
+// Largest free space requested for a single receive.
+constexpr std::size_t max_receive_size = 1 << 20;
+// Buffers handed to a single gather write.
+constexpr int max_io_buffers = 64;
+// Largest chunk handed to a single sendfile, so one big file cannot monopolize the loop.
+constexpr std::uint64_t max_sendfile_size = 1 << 20;
+
+/**
+ * Creates a reactor that accepts from the given non-blocking listening socket and answers
+ * requests using the handlers, on the worker pool if there is one.
+ */
+Event_Loop::Event_Loop(SOCKET listen_socket, const Server::Handler &handler, const Body_Handler &body_handler,
+                       const Server_Options &options, Worker_Pool *workers)
+        : Server_Loop(handler, body_handler, options, workers), listen_socket_(listen_socket), tls_(options.tls) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1) {
+        throw std::runtime_error("epoll_create1 failed: " + std::to_string(errno) + "\n");
+    }
+    // Every loop waits on the listening socket, EPOLLEXCLUSIVE wakes only one of them per connection.
+    struct epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.fd = listen_socket_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_socket_, &ev) == -1) {
+        close(epoll_fd_);
+        throw std::runtime_error("epoll_ctl failed: " + std::to_string(errno) + "\n");
+    }
+    if (wake_fd_ != -1) {
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd_;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) == -1) {
+            close(epoll_fd_);
+            throw std::runtime_error("epoll_ctl failed: " + std::to_string(errno) + "\n");
+        }
+    }
+}
+
+/**
+ * Closes the epoll instance and every connection owned by this loop.
+ */
+Event_Loop::~Event_Loop() {
+    for (auto &ent: connections_) {
+        closesocket(ent.first);
+    }
+    close(epoll_fd_);
+}
+
+/**
+ * A blocking function call that runs the reactor forever.
+ */
+[[noreturn]] void Event_Loop::run() {
+    std::array<struct epoll_event, max_events> events{};
+    while (true) {
+        // Sleep until the next deadline at the latest.
+        int n = epoll_wait(epoll_fd_, events.data(), max_events, timerTimeout());
+        if (n == -1 && errno != EINTR) {
+            Err("epoll_wait failed: %d", errno);
+        }
+        now_ = Timer_Wheel::Clock::now();
+        for (int i = 0; i < n; i++) {
+            SOCKET fd = events[i].data.fd;
+            if (fd == listen_socket_) {
+                acceptConnections();
+                continue;
+            }
+            if (fd == wake_fd_) {
+                handleWake();
+                continue;
+            }
+            auto it = connections_.find(fd);
+            if (it == connections_.end()) {
+                continue;
+            }
+            Connection &conn = *it->second;
+            bool alive = !(events[i].events & (EPOLLERR | EPOLLHUP));
+            if (alive && (events[i].events & EPOLLOUT)) {
+                alive = handleWritable(conn);
+            }
+            if (alive && (events[i].events & EPOLLIN)) {
+                alive = handleReadable(conn);
+            }
+            if (alive) {
+                updateDeadline(conn);
+            } else {
+                closeConnection(fd);
+            }
+        }
+        expireConnections([this](Server_Loop::Connection &conn) {
+            closeConnection(static_cast<Connection &>(conn).socket);
+        });
+    }
+}
+
+/**
+ *  Accepts every pending connection on the listening socket.
+ */
+void Event_Loop::acceptConnections() {
+    while (true) {
+        SOCKET socket = accept4(listen_socket_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket == INVALID_SOCKET) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                Err("accept failed: %d", errno);
+            }
+            return;
+        }
+        int one = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        auto conn = std::make_unique<Connection>(&arena_pool_);
+        conn->socket = socket;
+        if (tls_) {
+            try {
+                conn->tls = std::make_unique<Tls_Session>(tls_, socket);
+            } catch (const std::runtime_error &e) {
+                Err("%s", e.what());
+                closesocket(socket);
+                continue;
+            }
+            conn->handshaking = true;
+        }
+        updateDeadline(*conn);
+        struct epoll_event ev{};
+        ev.events = conn->events = interest(*conn);
+        ev.data.fd = socket;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, socket, &ev) == -1) {
+            Err("epoll_ctl failed: %d", errno);
+            closesocket(socket);
+            continue;
+        }
+        connections_.emplace(socket, std::move(conn));
+        threadMetrics().accepted.add();
+    }
+}
+
+/**
+ *  Advances the TLS handshake of the connection and reads the first requests once it is done.
+ *  Returns false if the connection has to be closed.
+ */
+bool Event_Loop::handleHandshake(Connection &conn) {
+    Thread_Metrics &metrics = threadMetrics();
+    switch (conn.tls->handshake()) {
+        case Handshake_Status::Done:
+            conn.handshaking = false;
+            metrics.tls_handshakes.add();
+            if (conn.tls->resumed()) {
+                metrics.tls_resumed.add();
+            }
+            if (conn.tls->kernelSend()) {
+                metrics.tls_kernel_send.add();
+            }
+            // The first request may have come along with the end of the handshake.
+            return handleReadable(conn);
+        case Handshake_Status::Want_Read:
+        case Handshake_Status::Want_Write:
+            if (conn.events != interest(conn)) {
+                updateInterest(conn);
+            }
+            return true;
+        case Handshake_Status::Failed:
+            break;
+    }
+    Debug("TLS handshake failed");
+    metrics.tls_failed.add();
+    return false;
+}
+
+/**
+ *  Reads whatever is available on the connection and answers every complete request.
+ *  Returns false if the connection has to be closed.
+ */
+bool Event_Loop::handleReadable(Connection &conn) {
+    if (conn.handshaking) {
+        return handleHandshake(conn);
+    }
+    // Do not read more requests while the answer of the previous ones is still pending.
+    if (!conn.out.empty()) {
+        return true;
+    }
+    for (int i = 0; i < max_reads_per_event; i++) {
+        auto [space, space_size] = conn.in.prepare(receiveSize(conn));
+        ssize_t iResult = receive(conn, space, space_size);
+        if (iResult > 0) {
+            conn.in.commit(iResult);
+            threadMetrics().bytes_in.add(iResult);
+            // A streamed body is handed on after every receive, so it never piles up in the buffer. TLS returns a
+            // record at a time, so a short read does not mean the socket is drained.
+            if ((std::size_t(iResult) < space_size && !conn.tls) || conn.sink) {
+                break;
+            }
+        } else if (iResult == 0) {
+            Debug("Connection closed");
+            return false;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            Err("recv failed: %d", errno);
+            return false;
+        }
+    }
+    if (!answerInput(conn)) {
+        return false;
+    }
+    // Epoll does not report what TLS already took off the socket, it has to be read before waiting again.
+    if (conn.tls && conn.out.empty() && conn.tls->pending()) {
+        return handleReadable(conn);
+    }
+    return true;
+}
+
+/**
+ *  Flushes pending output, then answers the pipelined requests that were held back while it was pending.
+ *  Returns false if the connection has to be closed.
+ */
+bool Event_Loop::handleWritable(Connection &conn) {
+    if (conn.handshaking) {
+        return handleHandshake(conn);
+    }
+    if (!flush(conn)) {
+        return false;
+    }
+    if (!conn.out.empty()) {
+        return true;
+    }
+    if (conn.tls && conn.tls->pending()) {
+        return handleReadable(conn);
+    }
+    if (conn.in.empty()) {
+        return true;
+    }
+    return answerInput(conn);
+}
+
+/**
+ *  Answers and flushes batch after batch of the buffered requests until they are used up or the socket
+ *  stops taking output. Returns false if the connection has to be closed.
+ */
+bool Event_Loop::answerInput(Connection &conn) {
+    bool batch_full;
+    do {
+        batch_full = processInput(conn);
+        if (!flush(conn)) {
+            return false;
+        }
+    } while (batch_full && conn.out.empty());
+    return true;
+}
+
+/**
+ *  Returns how much free space to receive into: the rest of a message whose head is already parsed,
+ *  otherwise one small block.
+ */
+std::size_t Event_Loop::receiveSize(const Connection &conn) {
+    if (conn.sink) {
+        return stream_receive_size;
+    }
+    std::size_t buffered = conn.in.data().size();
+    if (conn.parser.header_size() != 0 && conn.parser.message_size() > buffered) {
+        return std::clamp(conn.parser.message_size() - buffered, Buffer_Pool::min_block_size, max_receive_size);
+    }
+    return Buffer_Pool::min_block_size;
+}
+
+/**
+ *  Sends as much of the pending output as the socket accepts without blocking.
+ *  Returns false if the connection has to be closed.
+ */
+bool Event_Loop::flush(Connection &conn) {
+    std::array<IO_Buffer, max_io_buffers> buffers{};
+    while (conn.out_begin < conn.out.size() && conn.out[conn.out_begin].ready) {
+        Output &front = conn.out[conn.out_begin];
+        std::size_t front_memory = front.head.size() + front.response.get_body().size();
+        bool streaming = front.sent >= front_memory && front.response.get_stream_body();
+        long iResult;
+        if (streaming) {
+            iResult = sendStream(conn, front);
+            if (iResult == 0) {
+                retireFront(conn);
+                continue;
+            }
+        } else if (front.sent >= front_memory) {
+            // Only the file part of the front response is left, it goes from the page cache to the socket.
+            const File_Range &file_body = front.response.get_file_body();
+            std::uint64_t file_sent = front.sent - front_memory;
+            std::uint64_t offset = file_body.offset + file_sent;
+            std::size_t size = std::min<std::uint64_t>(file_body.length - file_sent, max_sendfile_size);
+            if (conn.tls) {
+                iResult = conn.tls->sendFile(*file_body.file, offset, size);
+            } else {
+                off_t file_offset = off_t(offset);
+                iResult = sendfile(conn.socket, file_body.file->fd(), &file_offset, size);
+            }
+            if (iResult == 0) {
+                Err("file shrank while being sent");
+                return false;
+            }
+        } else {
+            // Gather as many queued responses as fit into one write.
+            bool more;
+            int count = gatherOutput(conn, buffers.data(), max_io_buffers, more);
+            iResult = send(conn, buffers.data(), count, more);
+        }
+        if (iResult == SOCKET_ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            Err("send failed: %d", errno);
+            return false;
+        }
+        Debug("Bytes Sent: %ld", iResult);
+        threadMetrics().bytes_out.add(iResult);
+        if (streaming) {
+            continue;
+        }
+        commitSent(conn, iResult);
+    }
+    if (conn.out_begin == conn.out.size()) {
+        // Give the memory back while the connection is idle.
+        releaseOutput(conn);
+        if (conn.close_after_send) {
+            return false;
+        }
+    }
+    if (conn.events != interest(conn)) {
+        updateInterest(conn);
+    }
+    return true;
+}
+
+/**
+ *  Sends the next framed piece of the streamed body of a response, asking the stream for it once the
+ *  previous one is sent. Returns the number of bytes sent, 0 if the body is complete, or SOCKET_ERROR.
+ */
+long Event_Loop::sendStream(Connection &conn, Output &output) {
+    // Only one piece is buffered at a time, the stream is asked for the next one when the socket takes more.
+    while (output.chunk_begin == output.chunk.size()) {
+        if (output.stream_done) {
+            return 0;
+        }
+        output.chunk_begin = write_chunk(output.response.get_stream_body(), output.chunk, stream_chunk_size,
+                                         output.stream_done);
+    }
+    IO_Buffer buffer = makeIOBuffer(output.chunk.data() + output.chunk_begin, output.chunk.size() - output.chunk_begin);
+    long iResult = send(conn, &buffer, 1);
+    if (iResult > 0) {
+        output.chunk_begin += iResult;
+    }
+    return iResult;
+}
+
+/**
+ *  Receives into the buffer, through TLS if the connection speaks it, with the conventions of recv.
+ */
+long Event_Loop::receive(Connection &conn, char *buff, std::size_t size) {
+    if (conn.tls) {
+        return conn.tls->read(buff, size);
+    }
+    return recv(conn.socket, buff, size, 0);
+}
+
+/**
+ *  Sends the buffers, through TLS if the connection speaks it, with the conventions of send.
+ */
+long Event_Loop::send(Connection &conn, IO_Buffer *buffers, int count, bool more) {
+    if (conn.tls) {
+        return conn.tls->write(buffers, count);
+    }
+    return sendBuffers(conn.socket, buffers, count, more);
+}
+
+/**
+ *  Returns the events to wait for: those the TLS handshake waits for while it runs, then readability while no
+ *  output is pending, writability while the front response is ready to be sent and none while a worker is
+ *  still answering it. Only errors and hangups are
+ *  reported then, a half-closed connection would otherwise be reported over and over.
+ */
+std::uint32_t Event_Loop::interest(const Connection &conn) {
+    if (conn.handshaking) {
+        return (conn.tls->wantsWrite() ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP;
+    }
+    if (conn.out.empty()) {
+        return EPOLLIN | EPOLLRDHUP;
+    }
+    if (conn.out[conn.out_begin].ready) {
+        return EPOLLOUT | EPOLLRDHUP;
+    }
+    return 0;
+}
+
+/**
+ *  Registers interest in the events the connection waits for now.
+ */
+void Event_Loop::updateInterest(Connection &conn) {
+    conn.events = interest(conn);
+    struct epoll_event ev{};
+    ev.events = conn.events;
+    ev.data.fd = conn.socket;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.socket, &ev) == -1) {
+        Err("epoll_ctl failed: %d", errno);
+    }
+}
+
+/**
+ *  Sends the responses the workers finished and moves their connections on.
+ */
+void Event_Loop::handleWake() {
+    // Read before taking the finished jobs, so a job finished after that signals again.
+    std::uint64_t count;
+    if (read(wake_fd_, &count, sizeof(count)) == -1) {
+        Err("eventfd read failed: %d", errno);
+    }
+    finishJobs([this](Server_Loop::Connection &loop_conn) {
+        auto &conn = static_cast<Connection &>(loop_conn);
+        if (handleWritable(conn)) {
+            updateDeadline(conn);
+        } else {
+            closeConnection(conn.socket);
+        }
+    });
+}
+
+void Event_Loop::closeConnection(SOCKET socket) {
+    auto it = connections_.find(socket);
+    timers_.cancel(*it->second);
+    if (it->second->tls) {
+        it->second->tls->shutdown();
+    }
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, socket, nullptr);
+    closesocket(socket);
+    connections_.erase(it);
+    threadMetrics().closed.add();
+}
+
+#endif // __linux__
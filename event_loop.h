@@ -0,0 +1,135 @@
+#ifndef EVENT_LOOP_H_INCLUDED
+#define EVENT_LOOP_H_INCLUDED
+
+#ifdef __linux__
+
+#include "server_loop.h"
+#include "tls.h"
+#include <unordered_map>
+#include <memory>
+#include <array>
+
+/**
+ * A single threaded epoll reactor. Every loop of a server waits on the shared listening socket
+ * and serves the non-blocking connections it accepted until they are closed or miss a deadline.
+ */
+class Event_Loop : public Server_Loop
+{
+public:
+    /**
+     * Creates a reactor that accepts from the given non-blocking listening socket and answers
+     * requests using the handlers, on the worker pool if there is one.
+     */
+    Event_Loop(SOCKET listen_socket, const Server::Handler &handler, const Body_Handler &body_handler,
+               const Server_Options &options, Worker_Pool *workers);
+
+    /**
+     * Closes the epoll instance and every connection owned by this loop.
+     */
+    ~Event_Loop() override;
+
+    /**
+     * A blocking function call that runs the reactor forever.
+     */
+    [[noreturn]] void run() override;
+private:
+    /**
+     * State of a single client connection.
+     */
+    struct Connection : Server_Loop::Connection
+    {
+        using Server_Loop::Connection::Connection;
+
+        SOCKET socket;
+        // The events the loop currently waits for.
+        std::uint32_t events = 0;
+        // Encrypts the connection if the server speaks TLS.
+        std::unique_ptr<Tls_Session> tls;
+    };
+
+    /**
+     *  Accepts every pending connection on the listening socket.
+     */
+    void acceptConnections();
+
+    /**
+     *  Advances the TLS handshake of the connection and reads the first requests once it is done.
+     *  Returns false if the connection has to be closed.
+     */
+    bool handleHandshake(Connection &conn);
+
+    /**
+     *  Reads whatever is available on the connection and answers every complete request.
+     *  Returns false if the connection has to be closed.
+     */
+    bool handleReadable(Connection &conn);
+
+    /**
+     *  Flushes pending output, then answers the pipelined requests that were held back while it was pending.
+     *  Returns false if the connection has to be closed.
+     */
+    bool handleWritable(Connection &conn);
+
+    /**
+     *  Answers and flushes batch after batch of the buffered requests until they are used up or the socket
+     *  stops taking output. Returns false if the connection has to be closed.
+     */
+    bool answerInput(Connection &conn);
+
+    /**
+     *  Returns how much free space to receive into: the rest of a message whose head is already parsed,
+     *  otherwise one small block.
+     */
+    static std::size_t receiveSize(const Connection &conn);
+
+    /**
+     *  Sends as much of the pending output as the socket accepts without blocking.
+     *  Returns false if the connection has to be closed.
+     */
+    bool flush(Connection &conn);
+
+    /**
+     *  Sends the next framed piece of the streamed body of a response, asking the stream for it once the
+     *  previous one is sent. Returns the number of bytes sent, 0 if the body is complete, or SOCKET_ERROR.
+     */
+    static long sendStream(Connection &conn, Output &output);
+
+    /**
+     *  Receives into the buffer, through TLS if the connection speaks it, with the conventions of recv.
+     */
+    static long receive(Connection &conn, char *buff, std::size_t size);
+
+    /**
+     *  Sends the buffers, through TLS if the connection speaks it, with the conventions of send.
+     */
+    static long send(Connection &conn, IO_Buffer *buffers, int count, bool more = false);
+
+    /**
+     *  Returns the events to wait for: those the TLS handshake waits for while it runs, then readability while no
+     *  output is pending, writability while the front response is ready to be sent and none while a worker is
+     *  still answering it.
+     */
+    static std::uint32_t interest(const Connection &conn);
+
+    /**
+     *  Registers interest in the events the connection waits for now.
+     */
+    void updateInterest(Connection &conn);
+
+    /**
+     *  Sends the responses the workers finished and moves their connections on.
+     */
+    void handleWake();
+
+    void closeConnection(SOCKET socket);
+
+    int epoll_fd_;
+    SOCKET listen_socket_;
+    // Shared by the TLS sessions of the connections, nullptr if they are plaintext.
+    std::shared_ptr<Tls_Context> tls_;
+    std::unordered_map<SOCKET, std::unique_ptr<Connection>> connections_;
+};
+
+#endif // __linux__
+
+#endif // EVENT_LOOP_H_INCLUDED
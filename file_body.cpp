@@ -0,0 +1,89 @@
+#include "file_body.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+/**
+ * Returns the entity tag of the version of a file with the given size and modification time, e.g. "\"1f4-17a2\"".
+ * */
+std::string file_etag(std::uint64_t size, std::int64_t mtime_ns)
+{
+    char etag[48];
+    int length = std::snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long) size,
+                               (unsigned long long) mtime_ns);
+    return std::string(etag, std::size_t(length));
+}
+
+/**
+ * Opens the regular file at the given path, returns nullptr if it does not exist or cannot be read.
+ * */
+std::shared_ptr<const File_Handle> File_Handle::open(const std::string& path)
+{
+#ifdef _WIN32
+    int fd = ::_open(path.c_str(), _O_RDONLY | _O_BINARY);
+    struct _stat64 st{};
+    if(fd == -1 || _fstat64(fd, &st) == -1 || !(st.st_mode & _S_IFREG))
+    {
+        if(fd != -1)
+        {
+            ::_close(fd);
+        }
+        return nullptr;
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if(fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        if(fd != -1)
+        {
+            ::close(fd);
+        }
+        return nullptr;
+    }
+#endif
+#ifdef __linux__
+    std::int64_t mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    std::int64_t mtime_ns = std::int64_t(st.st_mtime) * 1000000000;
+#endif
+    return std::make_shared<const File_Handle>(fd, std::uint64_t(st.st_size), mtime_ns);
+}
+
+File_Handle::~File_Handle()
+{
+#ifdef _WIN32
+    ::_close(fd_);
+#else
+    ::close(fd_);
+#endif
+}
+
+/**
+ * Reads up to size bytes at the given offset without moving any shared file position,
+ * returns the number of bytes read or -1 on failure.
+ * */
+long File_Handle::read_at(char* buff, std::size_t size, std::uint64_t offset) const
+{
+#ifdef _WIN32
+    OVERLAPPED overlapped{};
+    overlapped.Offset = DWORD(offset);
+    overlapped.OffsetHigh = DWORD(offset >> 32);
+    DWORD read = 0;
+    if(!ReadFile((HANDLE) _get_osfhandle(fd_), buff, DWORD(size), &read, &overlapped))
+    {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return long(read);
+#else
+    return long(pread(fd_, buff, size, off_t(offset)));
+#endif
+}
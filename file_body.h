@@ -0,0 +1,85 @@
+#ifndef FILE_BODY_H_INCLUDED
+#define FILE_BODY_H_INCLUDED
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/**
+ * Returns the entity tag of the version of a file with the given size and modification time, e.g. "\"1f4-17a2\"".
+ * */
+std::string file_etag(std::uint64_t size, std::int64_t mtime_ns);
+
+/**
+ * A read-only file opened for serving, shared by every message sending (parts of) it and closed
+ * with the last of them.
+ * */
+class File_Handle{
+public:
+    /**
+     * Opens the regular file at the given path, returns nullptr if it does not exist or cannot be read.
+     * */
+    static std::shared_ptr<const File_Handle> open(const std::string& path);
+
+    File_Handle(int fd, std::uint64_t size, std::int64_t mtime_ns) : fd_(fd), size_(size), mtime_ns_(mtime_ns) {}
+    File_Handle(const File_Handle&) = delete;
+    File_Handle& operator=(const File_Handle&) = delete;
+    ~File_Handle();
+
+    int fd() const{
+        return fd_;
+    }
+    std::uint64_t size() const{
+        return size_;
+    }
+    /**
+     * Last modification time in seconds since the epoch.
+     * */
+    std::int64_t mtime() const{
+        return mtime_ns_ >= 0 ? mtime_ns_ / 1000000000 : (mtime_ns_ + 1) / 1000000000 - 1;
+    }
+    /**
+     * Last modification time in nanoseconds since the epoch, as precise as the file system keeps it.
+     * */
+    std::int64_t mtime_ns() const{
+        return mtime_ns_;
+    }
+    /**
+     * A strong entity tag of the current contents, which changes whenever the file is modified.
+     * */
+    std::string etag() const{
+        return file_etag(size_, mtime_ns_);
+    }
+
+    /**
+     * Reads up to size bytes at the given offset without moving any shared file position,
+     * returns the number of bytes read or -1 on failure.
+     * */
+    long read_at(char* buff, std::size_t size, std::uint64_t offset) const;
+private:
+    int fd_;
+    std::uint64_t size_;
+    std::int64_t mtime_ns_;
+};
+
+/**
+ * A byte range of a file used as a message body. It is sent straight from the page cache
+ * (sendfile) where the platform allows it, so the bytes are never copied into user space.
+ * */
+struct File_Range{
+    std::shared_ptr<const File_Handle> file;
+    std::uint64_t offset = 0;
+    std::uint64_t length = 0;
+};
+
+/**
+ * Bytes owned by someone else, such as a cache entry or a memory mapping, used as a message body
+ * without copying them. The owner is kept alive as long as the message refers to the bytes.
+ * */
+struct Shared_Bytes{
+    std::shared_ptr<const void> owner;
+    std::string_view data;
+};
+
+#endif // FILE_BODY_H_INCLUDED
@@ -0,0 +1,196 @@
+#include "file_cache.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/**
+ * Bytes of memory an entry is charged for.
+ */
+static std::size_t entry_size(const HTTP<Type::Response> &response) {
+    return response.body_size() + response.get_headers().wire().size();
+}
+
+static std::int64_t steady_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Brings the whole file into memory, mapped where the platform allows it.
+ * Returns bytes without an owner on failure.
+ */
+static Shared_Bytes map_file(const File_Handle &file) {
+    if (file.size() == 0) {
+        static const auto empty = std::make_shared<const char>('\0');
+        return {empty, {}};
+    }
+#ifdef _WIN32
+    auto data = std::make_shared<std::string>(file.size(), '\0');
+    std::uint64_t offset = 0;
+    while (offset < file.size()) {
+        long iResult = file.read_at(&(*data)[offset], file.size() - offset, offset);
+        if (iResult <= 0) {
+            return {};
+        }
+        offset += iResult;
+    }
+    return {data, *data};
+#else
+    std::size_t size = file.size();
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, file.fd(), 0);
+    if (addr == MAP_FAILED) {
+        return {};
+    }
+    std::shared_ptr<const void> owner(addr, [size](const void *ptr) {
+        munmap(const_cast<void *>(ptr), size);
+    });
+    return {owner, std::string_view(static_cast<const char *>(addr), size)};
+#endif
+}
+
+/**
+ * Creates a cache holding at most capacity bytes of files, each at most max_file_size bytes.
+ */
+File_Cache::File_Cache(Content_Type content_type, std::size_t capacity, std::size_t max_file_size,
+                       std::chrono::milliseconds revalidate_interval)
+        : content_type_(std::move(content_type)), shard_capacity_(capacity / n_shards),
+          max_file_size_(max_file_size), revalidate_interval_(revalidate_interval) {}
+
+/**
+ * Returns a response serving the file at the given path from memory, or std::nullopt if the
+ * file does not exist or is too large to be cached. The body is shared with the cache, only the
+ * head is copied into the given memory resource.
+ */
+std::optional<HTTP<Type::Response>> File_Cache::get(const std::string &path, std::pmr::memory_resource *resource) {
+    Shard &shard = shards_[std::hash<std::string>{}(path) % n_shards];
+    std::shared_ptr<const Entry> entry;
+    {
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(path);
+        if (it != shard.index.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            entry = it->second->entry;
+        }
+    }
+    std::int64_t now = steady_ms();
+    File_Identity identity;
+    if (entry) {
+        if (now - entry->checked_ms.load(std::memory_order_relaxed) < revalidate_interval_.count()) {
+            hits_++;
+            return HTTP<Type::Response>(entry->response, resource);
+        }
+        bool exists = stat_file(path, identity);
+        if (exists && identity == entry->identity) {
+            entry->checked_ms.store(now, std::memory_order_relaxed);
+            hits_++;
+            return HTTP<Type::Response>(entry->response, resource);
+        }
+        invalidations_++;
+        erase(shard, path, entry.get());
+        if (!exists) {
+            return std::nullopt;
+        }
+    } else if (!stat_file(path, identity)) {
+        return std::nullopt;
+    }
+    misses_++;
+    if (identity.size > max_file_size_) {
+        return std::nullopt;
+    }
+    auto loaded = load(path, identity);
+    if (!loaded) {
+        return std::nullopt;
+    }
+    loaded->checked_ms.store(now, std::memory_order_relaxed);
+    insert(shard, path, loaded);
+    return HTTP<Type::Response>(loaded->response, resource);
+}
+
+File_Cache::Stats File_Cache::stats() const {
+    Stats stats{hits_.load(), misses_.load(), invalidations_.load(), evictions_.load(), 0, 0};
+    for (auto &shard: shards_) {
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        stats.entries += shard.index.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
+
+bool File_Cache::stat_file(const std::string &path, File_Identity &identity) {
+#ifdef _WIN32
+    struct _stat64 st{};
+    if (_stat64(path.c_str(), &st) != 0 || !(st.st_mode & _S_IFREG)) {
+        return false;
+    }
+    identity.mtime_ns = std::int64_t(st.st_mtime) * 1000000000;
+#else
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    identity.mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    identity.size = std::uint64_t(st.st_size);
+    identity.inode = std::uint64_t(st.st_ino);
+    return true;
+}
+
+/**
+ * Maps the file and prebuilds its response, returns nullptr if it cannot be cached.
+ */
+std::shared_ptr<const File_Cache::Entry> File_Cache::load(const std::string &path,
+                                                          const File_Identity &identity) const {
+    auto file = File_Handle::open(path);
+    if (!file || file->size() != identity.size) {
+        return nullptr;
+    }
+    Shared_Bytes body = map_file(*file);
+    if (!body.owner) {
+        return nullptr;
+    }
+    auto entry = std::make_shared<Entry>();
+    HTTP_Builder<Type::Response> builder;
+    entry->response = builder.setStatus(200).addHeader(Header_Id::Content_Type, content_type_(path))
+            .addHeader(Header_Id::Content_Length, std::to_string(file->size()))
+            .addHeader(Header_Id::ETag, file_etag(identity.size, identity.mtime_ns))
+            .addHeader(Header_Id::Last_Modified, http_date(file->mtime())).addHeader(Header_Id::Accept_Ranges, "bytes")
+            .addBody(std::move(body)).build();
+    entry->identity = identity;
+    return entry;
+}
+
+void File_Cache::insert(Shard &shard, const std::string &path, std::shared_ptr<const Entry> entry) {
+    std::size_t size = entry_size(entry->response);
+    std::scoped_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(path);
+    if (it != shard.index.end()) {
+        // Another thread loaded the same file meanwhile, keep the newer one.
+        shard.bytes -= entry_size(it->second->entry->response);
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    shard.lru.push_front({path, std::move(entry)});
+    shard.index.emplace(path, shard.lru.begin());
+    shard.bytes += size;
+    while (shard.bytes > shard_capacity_ && shard.lru.size() > 1) {
+        Node &victim = shard.lru.back();
+        shard.bytes -= entry_size(victim.entry->response);
+        shard.index.erase(victim.path);
+        shard.lru.pop_back();
+        evictions_++;
+    }
+}
+
+void File_Cache::erase(Shard &shard, const std::string &path, const Entry *entry) {
+    std::scoped_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(path);
+    // Only drop the entry that was found stale, not one another thread has reloaded since.
+    if (it != shard.index.end() && it->second->entry.get() == entry) {
+        shard.bytes -= entry_size(entry->response);
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+}
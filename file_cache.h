@@ -0,0 +1,121 @@
+#ifndef FILE_CACHE_H_INCLUDED
+#define FILE_CACHE_H_INCLUDED
+
+#include "http.h"
+#include <unordered_map>
+#include <functional>
+#include <optional>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <mutex>
+#include <array>
+#include <list>
+
+/**
+ * A bounded in-memory cache of small static files, keyed by path.
+ *
+ * Every entry holds the mapped file contents and a prebuilt 200 response whose headers (Content-Type,
+ * Content-Length, ETag, Last-Modified, Accept-Ranges) are serialized once, so a hit costs a copy of the header
+ * block and no file system access. Entries are revalidated against the file's mtime, size and inode at most once per
+ * revalidation interval and the least recently used ones are evicted when the cache is full. The cache is
+ * split into independently locked shards so the reactor threads rarely contend on it.
+ */
+class File_Cache
+{
+public:
+    /**
+     * Maps the path of a file to the value of its Content-Type header.
+     */
+    using Content_Type = std::function<std::string(const std::string &path)>;
+
+    struct Stats
+    {
+        std::uint64_t hits;
+        std::uint64_t misses;
+        // Entries dropped because the file changed on disk.
+        std::uint64_t invalidations;
+        // Entries dropped to make room for others.
+        std::uint64_t evictions;
+        std::size_t entries;
+        std::size_t bytes;
+    };
+
+    /**
+     * Creates a cache holding at most capacity bytes of files, each at most max_file_size bytes.
+     */
+    explicit File_Cache(Content_Type content_type, std::size_t capacity = 64 << 20,
+                        std::size_t max_file_size = 1 << 20,
+                        std::chrono::milliseconds revalidate_interval = std::chrono::seconds(1));
+
+    /**
+     * Returns a response serving the file at the given path from memory, or std::nullopt if the
+     * file does not exist or is too large to be cached. The response is allocated from the given resource.
+     */
+    std::optional<HTTP<Type::Response>> get(const std::string &path,
+                                            std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+    Stats stats() const;
+private:
+    /**
+     * What identifies a version of a file on disk.
+     */
+    struct File_Identity
+    {
+        std::int64_t mtime_ns = 0;
+        std::uint64_t size = 0;
+        std::uint64_t inode = 0;
+
+        bool operator==(const File_Identity &other) const {
+            return mtime_ns == other.mtime_ns && size == other.size && inode == other.inode;
+        }
+    };
+
+    struct Entry
+    {
+        HTTP<Type::Response> response;
+        File_Identity identity;
+        // Milliseconds on the steady clock of the last comparison with the file on disk.
+        mutable std::atomic<std::int64_t> checked_ms{0};
+    };
+
+    struct Node
+    {
+        std::string path;
+        std::shared_ptr<const Entry> entry;
+    };
+
+    /**
+     * An independently locked part of the cache, most recently used entries first.
+     */
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        std::list<Node> lru;
+        std::unordered_map<std::string, std::list<Node>::iterator> index;
+        std::size_t bytes = 0;
+    };
+    static constexpr std::size_t n_shards = 16;
+
+    static bool stat_file(const std::string &path, File_Identity &identity);
+
+    /**
+     * Maps the file and prebuilds its response, returns nullptr if it cannot be cached.
+     */
+    std::shared_ptr<const Entry> load(const std::string &path, const File_Identity &identity) const;
+
+    void insert(Shard &shard, const std::string &path, std::shared_ptr<const Entry> entry);
+
+    void erase(Shard &shard, const std::string &path, const Entry *entry);
+
+    Content_Type content_type_;
+    std::size_t shard_capacity_;
+    std::size_t max_file_size_;
+    std::chrono::milliseconds revalidate_interval_;
+    std::array<Shard, n_shards> shards_;
+    std::atomic<std::uint64_t> hits_{0}, misses_{0}, invalidations_{0}, evictions_{0};
+};
+
+#endif // FILE_CACHE_H_INCLUDED
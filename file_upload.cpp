@@ -0,0 +1,206 @@
+#include "file_upload.h"
+#include "debugger.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <io.h>
+#include <share.h>
+#else
+#include <unistd.h>
+#endif
+
+/**
+ * Writes the whole buffer at the current position of the file, returns false on failure.
+ * */
+static bool write_all(int fd, const char* data, std::size_t size)
+{
+    while(size > 0)
+    {
+#ifdef _WIN32
+        int written = ::_write(fd, data, unsigned(size));
+#else
+        ssize_t written = ::write(fd, data, size);
+        if(written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+#endif
+        if(written <= 0)
+        {
+            return false;
+        }
+        data += written;
+        size -= std::size_t(written);
+    }
+    return true;
+}
+
+/**
+ * Starts an upload to the given path, creating missing parent directories. A known body size lets
+ * the file be allocated ahead of the bytes arriving.
+ * */
+File_Upload::File_Upload(std::string path, std::uint64_t expected_size) : path_(std::move(path)),
+                                                                          expected_size_(expected_size)
+{
+    std::filesystem::path parent = std::filesystem::path(path_).parent_path();
+    std::error_code error;
+    // Existing directories are fine, only a failure to create a missing one is an error.
+    if(!parent.empty() && !std::filesystem::create_directories(parent, error) && error)
+    {
+        Err("%s : failed to create directories", path_.c_str());
+        return;
+    }
+    // The temporary file lives in the same directory, a rename only replaces the destination atomically there.
+    temp_path_ = path_ + std::string(temp_suffix) + "XXXXXX";
+#ifdef _WIN32
+    if(_mktemp_s(&temp_path_[0], temp_path_.size() + 1) != 0 ||
+       _sopen_s(&fd_, temp_path_.c_str(), _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _SH_DENYWR,
+                _S_IREAD | _S_IWRITE) != 0)
+    {
+        fd_ = -1;
+    }
+#else
+    // mkstemp creates the file readable by its owner only, it stays so until the upload is complete.
+    fd_ = mkstemp(&temp_path_[0]);
+#endif
+    if(fd_ == -1)
+    {
+        Err("%s : failed to create a temporary file", path_.c_str());
+        return;
+    }
+    preallocate(0);
+    buffer_ = static_cast<char*>(::operator new(write_size, std::align_val_t(write_alignment)));
+}
+
+/**
+ * Removes the temporary file of an upload that did not complete.
+ * */
+File_Upload::~File_Upload()
+{
+    discard();
+    if(buffer_)
+    {
+        ::operator delete(buffer_, std::align_val_t(write_alignment));
+    }
+}
+
+/**
+ * Whether the path names the temporary file of an upload, which must not be served while it is written.
+ * */
+bool File_Upload::is_temporary(std::string_view path)
+{
+    std::size_t suffix = path.rfind(temp_suffix);
+    return suffix != std::string_view::npos && path.size() - suffix == temp_suffix.size() + 6;
+}
+
+bool File_Upload::write(std::string_view data)
+{
+    if(fd_ == -1)
+    {
+        return false;
+    }
+    size_ += data.size();
+    while(!data.empty())
+    {
+        std::size_t size = std::min(data.size(), write_size - buffered_);
+        std::memcpy(buffer_ + buffered_, data.data(), size);
+        buffered_ += size;
+        data.remove_prefix(size);
+        if(buffered_ == write_size && !flush())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes what is left and moves the file into place, answers 200 on success and 404 otherwise.
+ * */
+HTTP<Type::Response> File_Upload::finish()
+{
+    HTTP_Builder<Type::Response> builder;
+    if(fd_ == -1 || !flush())
+    {
+        discard();
+        return builder.setStatus(404).build();
+    }
+#ifdef _WIN32
+    ::_close(fd_);
+#else
+    // Drops what a preallocation reserved beyond the received body.
+    ftruncate(fd_, off_t(size_));
+    fchmod(fd_, 0644);
+    ::close(fd_);
+#endif
+    fd_ = -1;
+    std::error_code error;
+    std::filesystem::rename(temp_path_, path_, error);
+    if(error)
+    {
+        Err("%s : failed to move the upload into place", path_.c_str());
+        std::filesystem::remove(temp_path_, error);
+        return builder.setStatus(404).build();
+    }
+    Debug("%s : %llu bytes written successfully", path_.c_str(), (unsigned long long) size_);
+    return builder.setStatus(200).build();
+}
+
+/**
+ * Writes the buffered bytes to the file, returns false on failure.
+ * */
+bool File_Upload::flush()
+{
+    preallocate(size_);
+    if(!write_all(fd_, buffer_, buffered_))
+    {
+        Err("%s : error while writing data", path_.c_str());
+        discard();
+        return false;
+    }
+    buffered_ = 0;
+    return true;
+}
+
+/**
+ * Allocates the file up to preallocate_size bytes past the given size, at most up to the expected size.
+ * */
+void File_Upload::preallocate(std::uint64_t size)
+{
+#ifdef __linux__
+    std::uint64_t end = std::min(expected_size_, size + preallocate_size);
+    if(end > allocated_)
+    {
+        // Reserving the blocks ahead keeps the file contiguous, a failure only loses that.
+        posix_fallocate(fd_, off_t(allocated_), off_t(end - allocated_));
+        allocated_ = end;
+    }
+#else
+    (void) size;
+#endif
+}
+
+/**
+ * Closes and deletes the temporary file.
+ * */
+void File_Upload::discard()
+{
+    if(fd_ == -1)
+    {
+        return;
+    }
+#ifdef _WIN32
+    ::_close(fd_);
+#else
+    ::close(fd_);
+#endif
+    fd_ = -1;
+    std::error_code error;
+    std::filesystem::remove(temp_path_, error);
+}
@@ -0,0 +1,81 @@
+#ifndef FILE_UPLOAD_H_INCLUDED
+#define FILE_UPLOAD_H_INCLUDED
+
+#include "networking.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * Writes an uploaded request body straight to disk as it arrives.
+ *
+ * The body goes to a temporary file next to the destination through one aligned buffer, so the file is
+ * written in large, block aligned pieces and memory use does not grow with the size of the upload. Once
+ * the body is complete the temporary file atomically replaces the destination, so readers see either the
+ * old or the whole new file. An upload that fails or is aborted leaves the destination untouched.
+ * */
+class File_Upload : public Body_Sink
+{
+public:
+    // Size of the pieces the file is written in.
+    static constexpr std::size_t write_size = 1 << 20;
+    // Alignment of the write buffer, a multiple of the block size of common file systems.
+    static constexpr std::size_t write_alignment = 1 << 12;
+    // How far ahead of the received body the file is allocated, so a client announcing a large body does
+    // not reserve its whole size on disk before sending it.
+    static constexpr std::uint64_t preallocate_size = 16 << 20;
+    // Appended to the destination to name the temporary file, followed by six random characters.
+    static constexpr std::string_view temp_suffix = ".upload-";
+
+    /**
+     * Starts an upload to the given path, creating missing parent directories. A known body size lets
+     * the file be allocated ahead of the bytes arriving.
+     * */
+    explicit File_Upload(std::string path, std::uint64_t expected_size = 0);
+    File_Upload(const File_Upload&) = delete;
+    File_Upload& operator=(const File_Upload&) = delete;
+
+    /**
+     * Removes the temporary file of an upload that did not complete.
+     * */
+    ~File_Upload() override;
+
+    /**
+     * Whether the path names the temporary file of an upload, which must not be served while it is written.
+     * */
+    static bool is_temporary(std::string_view path);
+
+    bool write(std::string_view data) override;
+
+    /**
+     * Writes what is left and moves the file into place, answers 200 on success and 404 otherwise.
+     * */
+    HTTP<Type::Response> finish() override;
+private:
+    /**
+     * Writes the buffered bytes to the file, returns false on failure.
+     * */
+    bool flush();
+
+    /**
+     * Allocates the file up to preallocate_size bytes past the given size, at most up to the expected size.
+     * */
+    void preallocate(std::uint64_t size);
+
+    /**
+     * Closes and deletes the temporary file.
+     * */
+    void discard();
+
+    std::string path_;
+    std::string temp_path_;
+    int fd_ = -1;
+    char* buffer_ = nullptr;
+    std::size_t buffered_ = 0;
+    std::uint64_t size_ = 0;
+    std::uint64_t expected_size_ = 0;
+    // Bytes of the file allocated so far.
+    std::uint64_t allocated_ = 0;
+};
+
+#endif // FILE_UPLOAD_H_INCLUDED
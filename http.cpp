@@ -1,16 +1,109 @@
 #include "http.h"
-#include <sstream>
+#include "http_parser.h"
+#include <charconv>
+#include <cstring>
+#include <ctime>
 
 const std::string http_version{"HTTP/1.1"};
 
 const std::unordered_map<int, std::string> status_map
 {
     {200, "OK"},
+    {206, "Partial Content"},
     {301, "Moved Permanently"},
+    {304, "Not Modified"},
     {400, "Bad Request"},
-    {404, "Not Found"}
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {413, "Payload Too Large"},
+    {416, "Range Not Satisfiable"},
+    {503, "Service Unavailable"}
 };
 
+static constexpr std::array<std::string_view, 16> header_names
+{
+    "", "Host", "Connection", "Content-Length", "Content-Type", "Transfer-Encoding", "Accept-Encoding",
+    "Content-Encoding", "ETag", "Last-Modified", "If-None-Match", "If-Modified-Since", "Range", "Content-Range",
+    "If-Range", "Accept-Ranges"
+};
+
+/**
+ * Returns the id of the given header name regardless of its case, Header_Id::Other if it is not interned.
+ * */
+Header_Id header_id(std::string_view name)
+{
+    for(std::size_t i = 1; i < header_names.size(); i++)
+    {
+        if(iequals(header_names[i], name))
+        {
+            return static_cast<Header_Id>(i);
+        }
+    }
+    return Header_Id::Other;
+}
+
+/**
+ * Returns the canonical spelling of an interned header.
+ * */
+std::string_view header_name(Header_Id id)
+{
+    return header_names[static_cast<std::size_t>(id)];
+}
+
+void Header_Map::add(std::string_view name, std::string_view value, Header_Id id)
+{
+    Entry entry{};
+    entry.name_offset = std::uint32_t(buffer_.size());
+    entry.name_length = std::uint16_t(name.size());
+    entry.value_offset = std::uint32_t(buffer_.size() + name.size() + 2);
+    entry.value_length = std::uint32_t(value.size());
+    entry.id = id;
+    buffer_.append(name).append(": ").append(value).append("\r\n");
+    if(size_ < inline_capacity)
+    {
+        inline_[size_] = entry;
+    }
+    else
+    {
+        overflow_.push_back(entry);
+    }
+    size_++;
+}
+
+/**
+ * Case insensitive lookup of the first header with the given name.
+ * */
+std::optional<std::string_view> Header_Map::find(std::string_view name) const
+{
+    Header_Id id = header_id(name);
+    if(id != Header_Id::Other)
+    {
+        return find(id);
+    }
+    for(std::size_t i = 0; i < size_; i++)
+    {
+        const Entry& entry = at(i);
+        if(entry.id == Header_Id::Other && iequals(view(entry.name_offset, entry.name_length), name))
+        {
+            return view(entry.value_offset, entry.value_length);
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string_view> Header_Map::find(Header_Id id) const
+{
+    for(std::size_t i = 0; i < size_; i++)
+    {
+        const Entry& entry = at(i);
+        if(entry.id == id)
+        {
+            return view(entry.value_offset, entry.value_length);
+        }
+    }
+    return std::nullopt;
+}
+
 /**
  * Given string representation of a HTTP message, it identifies whether it is a request or a response.
  * */
@@ -20,33 +113,101 @@ Type message_type(const std::string& msg)
 }
 
 /**
- * Common functionality parsing between requests and responses.
+ * Formats a time in seconds since the epoch as a HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ * */
+std::string http_date(std::int64_t seconds)
+{
+    std::time_t time = std::time_t(seconds);
+    std::tm tm{};
+#ifdef _WIN32
+    gmtime_s(&tm, &time);
+#else
+    gmtime_r(&time, &tm);
+#endif
+    char buff[64];
+    std::size_t size = std::strftime(buff, sizeof(buff), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buff, size);
+}
+
+/**
+ * Parses the digits of the given field of a HTTP date, returns -1 if they are not all digits.
  * */
-template<Type T>
-static HTTP<T> parse_header_body(std::stringstream& line_stream, HTTP_Builder<T>& builder)
+static int date_field(std::string_view date, std::size_t offset, std::size_t length)
 {
-    std::string line, token;
-    while(std::getline(line_stream, line))
+    int value = 0;
+    for(std::size_t i = offset; i < offset + length; i++)
     {
-        // Pop /r
-        line.pop_back();
-        // Headers ended, next line is from message body.
-        if(line.empty())
+        if(date[i] < '0' || date[i] > '9')
         {
-            break;
+            return -1;
         }
-        std::stringstream stream{line};
-        // Read header value
-        stream >> token;
-        // Pop :
-        token.pop_back();
-        std::string header_name = std::move(token);
-        stream >> token;
-        builder.addHeader(header_name, token);
+        value = value * 10 + (date[i] - '0');
+    }
+    return value;
+}
+
+/**
+ * Parses a HTTP date in the IMF-fixdate format produced by http_date() into seconds since the epoch, returns
+ * std::nullopt if it is malformed. The obsolete RFC 850 and asctime formats are not accepted.
+ * */
+std::optional<std::int64_t> parse_http_date(std::string_view date)
+{
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    static constexpr std::string_view months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if(date.size() != 29 || date.substr(3, 2) != ", " || date[7] != ' ' || date[11] != ' ' || date[16] != ' ' ||
+       date[19] != ':' || date[22] != ':' || date.substr(25) != " GMT")
+    {
+        return std::nullopt;
+    }
+    std::size_t month = months.find(date.substr(8, 3));
+    int day = date_field(date, 5, 2), year = date_field(date, 12, 4);
+    int hour = date_field(date, 17, 2), minute = date_field(date, 20, 2), second = date_field(date, 23, 2);
+    if(month == std::string_view::npos || month % 3 != 0 || day < 1 || day > 31 || year < 0 || hour < 0 ||
+       hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+    {
+        return std::nullopt;
     }
+    // Days since the epoch of the civil date, counting years from March so the leap day is the last one.
+    int m = int(month / 3) + 1;
+    std::int64_t y = year - (m <= 2);
+    std::int64_t era = y / 400;
+    std::int64_t year_of_era = y - era * 400;
+    std::int64_t day_of_year = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+    std::int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    std::int64_t days = era * 146097 + day_of_era - 719468;
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
 
-    builder.addBody(std::string (std::istreambuf_iterator<char>(line_stream), {}));
-    return builder.build();
+/**
+ * Asks the stream for the next piece of its body and frames it as a chunk of the chunked transfer coding
+ * in out, followed by the last chunk once the stream is exhausted. Returns the offset in out at which the
+ * framed bytes start and sets done once the whole body is framed.
+ * */
+std::size_t write_chunk(const Body_Stream& stream, std::string& out, std::size_t max_size, bool& done)
+{
+    // The stream appends behind room left for the size line, which is then written right-aligned into it.
+    constexpr std::size_t max_size_line = 2 * sizeof(std::uint64_t) + 2;
+    out.assign(max_size_line, '\0');
+    done = !stream(out, max_size);
+    std::size_t size = out.size() - max_size_line;
+    std::size_t begin = max_size_line;
+    if(size != 0)
+    {
+        char digits[2 * sizeof(std::uint64_t)];
+        auto result = std::to_chars(digits, digits + sizeof(digits), size, 16);
+        std::size_t n_digits = result.ptr - digits;
+        begin = max_size_line - n_digits - 2;
+        std::memcpy(&out[begin], digits, n_digits);
+        out[max_size_line - 2] = '\r';
+        out[max_size_line - 1] = '\n';
+        out += "\r\n";
+    }
+    // An empty piece must not be framed, a chunk of size zero ends the body.
+    if(done)
+    {
+        out += "0\r\n\r\n";
+    }
+    return begin;
 }
 
 /**
@@ -54,19 +215,9 @@ static HTTP<T> parse_header_body(std::stringstream& line_stream, HTTP_Builder<T>
  * */
 HTTP<Type::Request> read_request(const std::string& msg)
 {
-    std::stringstream line_stream(msg);
-    HTTP_Builder<Type::Request> builder;
-    std::string line, token;
-    std::getline(line_stream, line);
-    // First line in HTTP request.
-    std::stringstream stream(line);
-    // Add Command.
-    stream >> token;
-    builder.setCommand(token);
-    // Add URL for the request.
-    stream >> token;
-    builder.setURL(token);
-    return parse_header_body(line_stream, builder);
+    HTTP_Parser parser;
+    parser.parse(msg);
+    return read_request(parser);
 }
 
 /**
@@ -74,16 +225,7 @@ HTTP<Type::Request> read_request(const std::string& msg)
  * */
 HTTP<Type::Response> read_response(const std::string& msg)
 {
-    std::stringstream line_stream(msg);
-    HTTP_Builder<Type::Response> builder;
-    std::string line, token;
-    std::getline(line_stream, line);
-    // First line in HTTP request.
-    std::stringstream stream(line);
-    // Skip version
-    stream >> token;
-    // Get status
-    stream >> token;
-    builder.setStatus(std::stoi(token));
-    return parse_header_body(line_stream, builder);
+    HTTP_Parser parser;
+    parser.parse(msg);
+    return read_response(parser);
 }
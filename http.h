@@ -1,53 +1,265 @@
 #ifndef HTTP_H_INCLUDED
 #define HTTP_H_INCLUDED
 
+#include "file_body.h"
 #include <type_traits>
+#include <functional>
+#include <charconv>
 #include <unordered_map>
-#include <map>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <optional>
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <memory_resource>
 
 enum class Type{Request, Response};
 
 extern const std::string http_version;
 extern const std::unordered_map<int, std::string> status_map;
 
+/**
+ * Compares two strings ignoring ASCII case, as required for header names.
+ * */
+inline bool iequals(std::string_view a, std::string_view b){
+    auto lower = [](char c){ return (c >= 'A' && c <= 'Z') ? char(c | 0x20) : c; };
+    if(a.size() != b.size()){
+        return false;
+    }
+    for(std::size_t i = 0; i < a.size(); i++){
+        if(lower(a[i]) != lower(b[i])){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Headers the server inspects on every message, interned when the header is added so lookups
+ * compare a single byte instead of the name.
+ * */
+enum class Header_Id : std::uint8_t{
+    Other, Host, Connection, Content_Length, Content_Type, Transfer_Encoding, Accept_Encoding,
+    Content_Encoding, ETag, Last_Modified, If_None_Match, If_Modified_Since, Range, Content_Range, If_Range,
+    Accept_Ranges
+};
+
+/**
+ * Returns the id of the given header name regardless of its case, Header_Id::Other if it is not interned.
+ * */
+Header_Id header_id(std::string_view name);
+
+/**
+ * Returns the canonical spelling of an interned header.
+ * */
+std::string_view header_name(Header_Id id);
+
+/**
+ * A header of a message, both parts are slices of the buffer holding the message.
+ * */
+struct Header_View{
+    std::string_view name;
+    std::string_view value;
+};
+
+/**
+ * Flat storage for the headers of a message.
+ *
+ * All headers live in one buffer in their wire format ("Name: value\r\n"), indexed by a small inline
+ * array of offsets, so adding a header allocates nothing but the occasional growth of the buffer and
+ * serializing them is a single append. The buffer comes from the memory resource of the message.
+ * */
+class Header_Map{
+public:
+    Header_Map() = default;
+    explicit Header_Map(std::pmr::memory_resource* resource) : buffer_(resource), overflow_(resource) {}
+    Header_Map(const Header_Map& other, std::pmr::memory_resource* resource)
+        : buffer_(other.buffer_, resource), inline_(other.inline_), overflow_(other.overflow_, resource),
+          size_(other.size_) {}
+
+    void add(std::string_view name, std::string_view value, Header_Id id);
+    void add(std::string_view name, std::string_view value){
+        add(name, value, header_id(name));
+    }
+    void add(Header_Id id, std::string_view value){
+        add(header_name(id), value, id);
+    }
+    /**
+     * Reserves room for the given number of bytes of header lines.
+     * */
+    void reserve(std::size_t bytes){
+        buffer_.reserve(bytes);
+    }
+
+    /**
+     * Case insensitive lookup of the first header with the given name.
+     * */
+    std::optional<std::string_view> find(std::string_view name) const;
+    std::optional<std::string_view> find(Header_Id id) const;
+
+    std::size_t size() const{
+        return size_;
+    }
+    Header_View operator[](std::size_t i) const{
+        const Entry& entry = at(i);
+        return {view(entry.name_offset, entry.name_length), view(entry.value_offset, entry.value_length)};
+    }
+    /**
+     * All header lines in wire format, without the empty line ending the head.
+     * */
+    std::string_view wire() const{
+        return buffer_;
+    }
+private:
+    struct Entry{
+        std::uint32_t name_offset;
+        std::uint32_t value_offset;
+        std::uint32_t value_length;
+        std::uint16_t name_length;
+        Header_Id id;
+    };
+    static constexpr std::size_t inline_capacity = 16;
+
+    const Entry& at(std::size_t i) const{
+        return i < inline_capacity ? inline_[i] : overflow_[i - inline_capacity];
+    }
+    std::string_view view(std::uint32_t offset, std::uint32_t length) const{
+        return std::string_view(buffer_).substr(offset, length);
+    }
+
+    std::pmr::string buffer_;
+    std::array<Entry, inline_capacity> inline_;
+    // Only messages with unusually many headers spill here.
+    std::pmr::vector<Entry> overflow_;
+    std::size_t size_ = 0;
+};
+
+/**
+ * Produces a body piece by piece while it is being sent, so it never has to be held as a whole and its first
+ * bytes go out before the last ones exist. Every call appends the next piece, of at most max_size bytes, to
+ * out and returns false once the body is complete. It is called on the thread sending the message whenever
+ * the peer can take more, so it should not block for long.
+ * */
+using Body_Stream = std::function<bool(std::string& out, std::size_t max_size)>;
+
+/**
+ * Asks the stream for the next piece of its body and frames it as a chunk of the chunked transfer coding
+ * in out, followed by the last chunk once the stream is exhausted. Returns the offset in out at which the
+ * framed bytes start and sets done once the whole body is framed.
+ * */
+std::size_t write_chunk(const Body_Stream& stream, std::string& out, std::size_t max_size, bool& done);
+
 template<Type T>
 class HTTP_Builder;
 
 /**
  * A base class to share common functionality between HTTP requests and responses.
+ *
+ * A message allocates its strings from a memory resource, the default heap unless it is given one, e.g. the
+ * arena of the connection it was received on. Copies of a message go to the heap unless they are given a
+ * resource too, so they never point into an arena that outlives them.
  * */
 template<Type T>
 class HTTP_Base{
 public:
+    HTTP_Base() = default;
+    explicit HTTP_Base(std::pmr::memory_resource* resource) : header_map(resource), body(resource) {}
+    HTTP_Base(const HTTP_Base& other, std::pmr::memory_resource* resource)
+        : header_map(other.header_map, resource), body(other.body, resource), shared_body(other.shared_body),
+          file_body(other.file_body), stream_body(other.stream_body) {}
+
+    /**
+     * The memory resource the message allocates from.
+     * */
+    std::pmr::memory_resource* get_resource() const{
+        return body.get_allocator().resource();
+    }
     const std::string& get_version() const{
         return http_version;
     }
-    const std::string& get_header(const std::string& header) const{
-        return header_map.at(header);
+    /**
+     * Returns the value of the header, names are matched ignoring case. Throws std::out_of_range
+     * if the message has no such header.
+     * */
+    std::string_view get_header(std::string_view header) const{
+        auto value = header_map.find(header);
+        if(!value){
+            throw std::out_of_range("no header " + std::string(header));
+        }
+        return *value;
+    }
+    bool has_header(std::string_view header) const{
+        return header_map.find(header).has_value();
+    }
+    std::optional<std::string_view> find_header(Header_Id id) const{
+        return header_map.find(id);
+    }
+    std::optional<std::string_view> find_header(std::string_view header) const{
+        return header_map.find(header);
+    }
+    const Header_Map& get_headers() const{
+        return header_map;
+    }
+    /**
+     * The in-memory body, either owned by the message or shared with its owner (e.g. a cache).
+     * */
+    std::string_view get_body() const{
+        return shared_body.owner ? shared_body.data : std::string_view(body);
     }
-    bool has_header(const std::string& header) const{
-        return header_map.find(header) != header_map.end();
+    /**
+     * The bytes used as in-memory body if they are shared with their owner, empty if the message owns its body.
+     * */
+    const Shared_Bytes& get_shared_body() const{
+        return shared_body;
     }
-    const std::string& get_body() const{
-        return body;
+    /**
+     * The part of the body that is sent from a file after the in-memory body, if any.
+     * */
+    const File_Range& get_file_body() const{
+        return file_body;
+    }
+    /**
+     * The body produced while it is sent instead of an in-memory or file one, if any.
+     * */
+    const Body_Stream& get_stream_body() const{
+        return stream_body;
+    }
+    /**
+     * Size of the body known upfront, in memory and from the file.
+     * */
+    std::uint64_t body_size() const{
+        return get_body().size() + file_body.length;
     }
 
-    std::string to_string(bool include_body = true) const {
-        std::string text;
-        for(const auto& ent: header_map){
-            text += ent.first + ": " + ent.second + "\r\n";
-        }
-        text += "\r\n";
-        if(include_body){
-            text += body;
+protected:
+    /**
+     * Appends the header lines and the empty line ending the head. A message that does not frame its body
+     * itself gets a Content-Length, or the chunked transfer coding if its body is streamed, so the peer can
+     * always find where it ends on a kept-alive connection. Messages that never have a body, like 304 responses,
+     * get neither.
+     * */
+    void write_headers(std::string& out, bool bodyless = false) const{
+        out += header_map.wire();
+        bool framed = bodyless || header_map.find(Header_Id::Content_Length) ||
+                      header_map.find(Header_Id::Transfer_Encoding);
+        if(stream_body && !framed){
+            out += "Transfer-Encoding: chunked\r\n";
+        }else if((T == Type::Response || body_size() != 0) && !framed){
+            out += "Content-Length: ";
+            out += std::to_string(body_size());
+            out += "\r\n";
         }
-        return text;
+        out += "\r\n";
     }
 private:
     friend class HTTP_Builder<T>;
-    std::map<std::string, std::string> header_map;
-    std::string body;
+    Header_Map header_map;
+    std::pmr::string body;
+    Shared_Bytes shared_body;
+    File_Range file_body;
+    Body_Stream stream_body;
 };
 
 template<Type T>
@@ -59,21 +271,40 @@ class HTTP : public HTTP_Base<T> {};
 template<>
 class HTTP<Type::Request> : public HTTP_Base<Type::Request>{
 public:
-    const std::string& get_command() const{
+    HTTP() = default;
+    explicit HTTP(std::pmr::memory_resource* resource) : HTTP_Base(resource), command(resource), url(resource) {}
+    HTTP(const HTTP& other, std::pmr::memory_resource* resource)
+        : HTTP_Base(other, resource), command(other.command, resource), url(other.url, resource) {}
+
+    std::string_view get_command() const{
         return command;
     }
-    const std::string& get_url() const{
+    std::string_view get_url() const{
         return url;
     }
+    /**
+     * Appends the request line and headers to the given buffer, the body is left to the caller.
+     * */
+    void write_head(std::string& out) const{
+        out += command;
+        out += ' ';
+        out += url;
+        out += ' ';
+        out += get_version();
+        out += "\r\n";
+        write_headers(out);
+    }
     std::string to_string(bool include_body = true) const {
         std::string text;
-        text += command + " " + url + " " + this->HTTP_Base<Type::Request>::get_version() + "\r\n";
-        text += this->HTTP_Base<Type::Request>::to_string(include_body);
+        write_head(text);
+        if(include_body){
+            text += get_body();
+        }
         return text;
     }
 private:
     friend class HTTP_Builder<Type::Request>;
-    std::string command, url;
+    std::pmr::string command, url;
 };
 
 /**
@@ -82,19 +313,39 @@ private:
 template<>
 class HTTP<Type::Response> : public HTTP_Base<Type::Response>{
 public:
-    const std::string& get_status() const{
+    HTTP() = default;
+    explicit HTTP(std::pmr::memory_resource* resource) : HTTP_Base(resource), status(resource) {}
+    HTTP(const HTTP& other, std::pmr::memory_resource* resource)
+        : HTTP_Base(other, resource), status(other.status, resource) {}
+
+    std::string_view get_status() const{
         return status;
     }
 
+    /**
+     * Appends the status line and headers to the given buffer, the body is left to the caller.
+     * */
+    void write_head(std::string& out) const{
+        out += get_version();
+        out += ' ';
+        out += status;
+        out += "\r\n";
+        // 1xx, 204 No Content and 304 Not Modified end with their head.
+        bool bodyless = status.size() >= 3 && (status[0] == '1' || status.compare(0, 3, "204") == 0 ||
+                                                status.compare(0, 3, "304") == 0);
+        write_headers(out, bodyless);
+    }
     std::string to_string(bool include_body = true) const {
         std::string text;
-        text += this->HTTP_Base<Type::Response>::get_version() + " " + status + "\r\n";
-        text += this->HTTP_Base<Type::Response>::to_string(include_body);
+        write_head(text);
+        if(include_body){
+            text += get_body();
+        }
         return text;
     }
 private:
     friend class HTTP_Builder<Type::Response>;
-    std::string status;
+    std::pmr::string status;
 };
 
 
@@ -104,31 +355,96 @@ private:
 template<Type T>
 class HTTP_Builder{
 public:
+    HTTP_Builder() = default;
+
+    /**
+     * Builds a message allocating from the given memory resource.
+     * */
+    explicit HTTP_Builder(std::pmr::memory_resource* resource) : http(resource) {}
+
+    /**
+     * Starts from an existing message, e.g. a prebuilt response, to add to it.
+     * */
+    explicit HTTP_Builder(HTTP<T> http) : http(std::move(http)) {}
+
+    /**
+     * Starts from a copy of an existing message allocated from the given memory resource.
+     * */
+    HTTP_Builder(const HTTP<T>& http, std::pmr::memory_resource* resource) : http(http, resource) {}
+
     template<Type T_ = T, std::enable_if_t<T_ == Type::Response && T_ == T>* = nullptr>
     HTTP_Builder<T>& setStatus(int status){
-        http.status = std::to_string(status) + " " + status_map.at(status);
+        char code[16];
+        auto result = std::to_chars(code, code + sizeof(code), status);
+        http.status.assign(code, result.ptr).append(" ").append(status_map.at(status));
         return *this;
     }
 
     template<Type T_ = T, std::enable_if_t<T_ == Type::Request && T_ == T>* = nullptr>
-    HTTP_Builder<T>& setCommand(std::string command){
-        http.command = std::move(command);
+    HTTP_Builder<T>& setCommand(std::string_view command){
+        http.command = command;
         return *this;
     }
 
     template<Type T_ = T, std::enable_if_t<T_ == Type::Request && T_ == T>* = nullptr>
-    HTTP_Builder<T>& setURL(std::string url){
-        http.url = std::move(url);
+    HTTP_Builder<T>& setURL(std::string_view url){
+        http.url = url;
+        return *this;
+    }
+
+    HTTP_Builder<T>& addHeader(std::string_view name, std::string_view value){
+        http.header_map.add(name, value);
+        return *this;
+    }
+
+    HTTP_Builder<T>& addHeader(Header_Id id, std::string_view value){
+        http.header_map.add(id, value);
+        return *this;
+    }
+
+    /**
+     * Reserves room for the given number of bytes of header lines.
+     * */
+    HTTP_Builder<T>& reserveHeaders(std::size_t bytes){
+        http.header_map.reserve(bytes);
         return *this;
     }
 
-    HTTP_Builder<T>& addHeader(std::string name, std::string value){
-        http.header_map.emplace(std::move(name), std::move(value));
+    /**
+     * Copies the body into the memory of the message, bodies that are large or already held elsewhere are
+     * better shared.
+     * */
+    HTTP_Builder<T>& addBody(std::string_view body){
+        http.body = body;
+        http.shared_body = {};
         return *this;
     }
 
-    HTTP_Builder<T>& addBody(std::string body){
-        http.body = std::move(body);
+    /**
+     * Uses bytes owned by someone else as the body, the message keeps them alive without copying them.
+     * */
+    HTTP_Builder<T>& addBody(Shared_Bytes body){
+        http.body.clear();
+        http.shared_body = std::move(body);
+        return *this;
+    }
+
+    /**
+     * Sends the given range of a file as the body, after the in-memory body if there is one.
+     * */
+    HTTP_Builder<T>& addFileBody(File_Range range){
+        http.file_body = std::move(range);
+        return *this;
+    }
+
+    /**
+     * Streams the body instead of holding it, it is sent with the chunked transfer coding.
+     * */
+    HTTP_Builder<T>& addStreamBody(Body_Stream stream){
+        http.body.clear();
+        http.shared_body = {};
+        http.file_body = {};
+        http.stream_body = std::move(stream);
         return *this;
     }
 
@@ -144,6 +460,17 @@ private:
  * */
 Type message_type(const std::string& msg);
 
+/**
+ * Formats a time in seconds since the epoch as a HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ * */
+std::string http_date(std::int64_t seconds);
+
+/**
+ * Parses a HTTP date in the IMF-fixdate format produced by http_date() into seconds since the epoch, returns
+ * std::nullopt if it is malformed. The obsolete RFC 850 and asctime formats are not accepted.
+ * */
+std::optional<std::int64_t> parse_http_date(std::string_view date);
+
 /**
  * Converts string representation of a HTTP request into a HTTP request object.
  * */
@@ -0,0 +1,337 @@
+#include "http_parser.h"
+#include "http_scan.h"
+#include <algorithm>
+#include <charconv>
+
+/**
+ * Returns the given slice of the buffer without leading and trailing spaces and tabs.
+ * */
+static std::string_view trim(std::string_view text)
+{
+    while(!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+    {
+        text.remove_prefix(1);
+    }
+    while(!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+    {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+// Longest chunk size or trailer line accepted, bounding the bytes scanned for its end.
+constexpr std::size_t max_chunk_line = 1 << 12;
+
+/**
+ * Decodes the body bytes at the front of the input. Sets consumed to the number of input bytes used up,
+ * framing included, and data to the decoded bytes among them, which are a slice of the input. Returns
+ * Complete once the body ended and Incomplete if decoding continues after the consumed bytes.
+ * */
+Parse_Status Body_Decoder::decode(std::string_view input, std::size_t& consumed, std::string_view& data)
+{
+    consumed = 0;
+    data = {};
+    while(state_ != State::Done)
+    {
+        std::string_view rest = input.substr(consumed);
+        if(state_ == State::Fixed || state_ == State::Data)
+        {
+            if(rest.empty())
+            {
+                return Parse_Status::Incomplete;
+            }
+            std::size_t size = std::size_t(std::min<std::uint64_t>(remaining_, rest.size()));
+            data = rest.substr(0, size);
+            consumed += size;
+            remaining_ -= size;
+            if(remaining_ == 0)
+            {
+                state_ = state_ == State::Fixed ? State::Done : State::Data_End;
+            }
+            return state_ == State::Done ? Parse_Status::Complete : Parse_Status::Incomplete;
+        }
+        if(state_ == State::Data_End)
+        {
+            if(rest.size() < 2)
+            {
+                return Parse_Status::Incomplete;
+            }
+            if(rest.substr(0, 2) != "\r\n")
+            {
+                return Parse_Status::Error;
+            }
+            consumed += 2;
+            state_ = State::Size;
+            continue;
+        }
+        // A chunk size line or a line of the trailer following the last chunk.
+        std::size_t end = rest.find("\r\n");
+        if(end == std::string_view::npos)
+        {
+            return rest.size() > max_chunk_line ? Parse_Status::Error : Parse_Status::Incomplete;
+        }
+        std::string_view line = rest.substr(0, end);
+        consumed += end + 2;
+        if(state_ == State::Trailer)
+        {
+            // Trailer fields are dropped, the empty line ends the body.
+            if(line.empty())
+            {
+                state_ = State::Done;
+            }
+            continue;
+        }
+        // Chunk extensions are ignored.
+        line = trim(line.substr(0, line.find(';')));
+        auto result = std::from_chars(line.data(), line.data() + line.size(), remaining_, 16);
+        if(line.empty() || result.ec != std::errc() || result.ptr != line.data() + line.size())
+        {
+            return Parse_Status::Error;
+        }
+        state_ = remaining_ == 0 ? State::Trailer : State::Data;
+    }
+    return Parse_Status::Complete;
+}
+
+/**
+ * Parses the message at the beginning of the buffer, returns Incomplete if more bytes are needed.
+ * A chunked body is decoded into a copy, since its framing interleaves with the data.
+ * */
+Parse_Status HTTP_Parser::parse(std::string_view buffer)
+{
+    Parse_Status status = parse_head(buffer);
+    if(status != Parse_Status::Complete)
+    {
+        return status;
+    }
+    if(!chunked_)
+    {
+        return buffer_.size() < message_size() ? Parse_Status::Incomplete : Parse_Status::Complete;
+    }
+    // Resume decoding after the bytes decoded by the previous calls.
+    std::size_t consumed;
+    status = body_.decode_all(buffer_.substr(header_size_ + body_consumed_), consumed, [this](std::string_view data)
+    {
+        decoded_.append(data);
+        return true;
+    });
+    body_consumed_ += consumed;
+    return status;
+}
+
+/**
+ * Parses only the head of the message at the beginning of the buffer, for callers receiving the body
+ * on their own using body_decoder(). Returns Incomplete if more bytes are needed.
+ * */
+Parse_Status HTTP_Parser::parse_head(std::string_view buffer)
+{
+    buffer_ = buffer;
+    if(header_size_ != 0)
+    {
+        return Parse_Status::Complete;
+    }
+    // The terminator may straddle the previously scanned bytes and the new ones.
+    std::size_t from = scanned_ < 3 ? 0 : scanned_ - 3;
+    std::size_t idx = find_head_end(buffer_, from);
+    if(idx == std::string_view::npos)
+    {
+        scanned_ = buffer_.size();
+        return scanned_ > max_header_size ? Parse_Status::Error : Parse_Status::Incomplete;
+    }
+    header_size_ = idx + 4;
+    if(header_size_ > max_header_size || !split_head())
+    {
+        return Parse_Status::Error;
+    }
+    body_ = body_decoder();
+    return Parse_Status::Complete;
+}
+
+/**
+ * Forgets the current message so the parser can be used for the next one.
+ * */
+void HTTP_Parser::reset()
+{
+    buffer_ = {};
+    scanned_ = header_size_ = content_length_ = body_consumed_ = n_headers_ = 0;
+    chunked_ = false;
+    body_ = Body_Decoder();
+    decoded_.clear();
+    status_code_ = 0;
+}
+
+/**
+ * Splits the start line and the header lines of the head into spans. The head is classified in one pass, after
+ * which the colon of a header line is the first byte of it that is no token character and its end the first
+ * byte after that which is no field character, so a control character or a bare LF anywhere in the head is
+ * rejected without looking at its bytes again.
+ * */
+bool HTTP_Parser::split_head()
+{
+    bool has_length = false;
+    std::string_view head = buffer_.substr(0, header_size_);
+    std::array<std::uint64_t, (max_header_size + 63) / 64> non_token, non_field;
+    classify_head(head, non_token.data(), non_field.data());
+    std::size_t end = next_set_bit(non_field.data(), 0);
+    if(head.substr(end, 2) != "\r\n" || !parse_start_line(end, next_set_bit(non_token.data(), 0)))
+    {
+        return false;
+    }
+    std::size_t pos = end + 2;
+    // The head ends with an empty line.
+    while(pos < header_size_ - 2)
+    {
+        // The head ends with a CR, which is no token character, so the colon is always within it.
+        std::size_t colon = next_set_bit(non_token.data(), pos);
+        if(colon == pos || head[colon] != ':' || n_headers_ == max_headers)
+        {
+            return false;
+        }
+        end = next_set_bit(non_field.data(), colon + 1);
+        if(head.substr(end, 2) != "\r\n")
+        {
+            return false;
+        }
+        std::string_view name = head.substr(pos, colon - pos);
+        std::string_view value = trim(head.substr(colon + 1, end - colon - 1));
+        headers_[n_headers_].name = {std::uint32_t(pos), std::uint32_t(name.size())};
+        headers_[n_headers_].value = {std::uint32_t(value.data() - buffer_.data()), std::uint32_t(value.size())};
+        n_headers_++;
+        if(iequals(name, "Content-Length"))
+        {
+            std::size_t length = 0;
+            auto result = std::from_chars(value.data(), value.data() + value.size(), length);
+            // Repeated lengths have to agree, otherwise which one frames the body is ambiguous (RFC 9110 8.6).
+            if(result.ec != std::errc() || result.ptr != value.data() + value.size() ||
+               (has_length && length != content_length_))
+            {
+                return false;
+            }
+            content_length_ = length;
+            has_length = true;
+        }
+        else if(iequals(name, "Transfer-Encoding"))
+        {
+            // Chunked has to be the final coding, otherwise the end of the body cannot be found.
+            constexpr std::string_view coding = "chunked";
+            chunked_ = value.size() >= coding.size() && iequals(value.substr(value.size() - coding.size()), coding);
+            if(!chunked_)
+            {
+                return false;
+            }
+        }
+        pos = end + 2;
+    }
+    // A message framed both ways is ambiguous, peers disagreeing on its end would let one smuggle requests.
+    return !(chunked_ && has_length);
+}
+
+/**
+ * Splits the start line into its three parts, for responses the reason phrase may contain spaces. token_end is
+ * where the token at the front of the line ends, for requests the method.
+ * */
+bool HTTP_Parser::parse_start_line(std::size_t end, std::size_t token_end)
+{
+    std::string_view line = buffer_.substr(0, end);
+    type_ = line.substr(0, http_version.size()) == http_version ? Type::Response : Type::Request;
+    std::size_t first = line.find(' ');
+    if(first == std::string_view::npos)
+    {
+        return false;
+    }
+    std::size_t second = line.find(' ', first + 1);
+    if(second == std::string_view::npos)
+    {
+        if(type_ == Type::Request)
+        {
+            return false;
+        }
+        // Responses may omit the reason phrase.
+        second = line.size();
+    }
+    if(type_ == Type::Request && token_end != first)
+    {
+        return false;
+    }
+    start_[0] = {0, std::uint32_t(first)};
+    start_[1] = {std::uint32_t(first + 1), std::uint32_t(second - first - 1)};
+    start_[2] = {std::uint32_t(std::min(second + 1, line.size())), std::uint32_t(line.size() - std::min(second + 1, line.size()))};
+    if(type_ == Type::Response)
+    {
+        std::string_view code = view(start_[1]);
+        auto result = std::from_chars(code.data(), code.data() + code.size(), status_code_);
+        return result.ec == std::errc() && result.ptr == code.data() + code.size();
+    }
+    return start_[0].length != 0 && start_[1].length != 0;
+}
+
+/**
+ * Case insensitive lookup of a header value.
+ * */
+std::optional<std::string_view> HTTP_Parser::find_header(std::string_view name) const
+{
+    for(std::size_t i = 0; i < n_headers_; i++)
+    {
+        if(iequals(view(headers_[i].name), name))
+        {
+            return view(headers_[i].value);
+        }
+    }
+    return std::nullopt;
+}
+
+/**
+ * Common functionality of building requests and responses out of a parsed message.
+ * */
+template<Type T>
+static HTTP<T> build_message(const HTTP_Parser& parser, HTTP_Builder<T>& builder, bool with_body = true)
+{
+    // Normalizing a header line adds at most the space after its colon.
+    builder.reserveHeaders(parser.header_size() + parser.header_count());
+    for(std::size_t i = 0; i < parser.header_count(); i++)
+    {
+        Header_View header = parser.header(i);
+        // A decoded body is no longer chunked, the message gets a Content-Length when it is sent on.
+        if(with_body && parser.chunked() && header_id(header.name) == Header_Id::Transfer_Encoding)
+        {
+            continue;
+        }
+        builder.addHeader(header.name, header.value);
+    }
+    if(with_body)
+    {
+        builder.addBody(parser.get_body());
+    }
+    return builder.build();
+}
+
+/**
+ * Converts a completely parsed HTTP request into a HTTP request object allocated from the given resource.
+ * */
+HTTP<Type::Request> read_request(const HTTP_Parser& parser, std::pmr::memory_resource* resource)
+{
+    HTTP_Builder<Type::Request> builder(resource);
+    builder.setCommand(parser.get_command()).setURL(parser.get_url());
+    return build_message(parser, builder);
+}
+
+/**
+ * Converts a completely parsed HTTP response into a HTTP response object allocated from the given resource.
+ * */
+HTTP<Type::Response> read_response(const HTTP_Parser& parser, std::pmr::memory_resource* resource)
+{
+    HTTP_Builder<Type::Response> builder(resource);
+    builder.setStatus(parser.get_status_code());
+    return build_message(parser, builder);
+}
+
+/**
+ * Converts the parsed head of a HTTP request into a HTTP request object without a body, for requests
+ * whose body is received separately.
+ * */
+HTTP<Type::Request> read_request_head(const HTTP_Parser& parser, std::pmr::memory_resource* resource)
+{
+    HTTP_Builder<Type::Request> builder(resource);
+    builder.setCommand(parser.get_command()).setURL(parser.get_url());
+    return build_message(parser, builder, false);
+}
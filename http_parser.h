@@ -0,0 +1,222 @@
+#ifndef HTTP_PARSER_H_INCLUDED
+#define HTTP_PARSER_H_INCLUDED
+
+#include "http.h"
+#include <string_view>
+#include <optional>
+#include <string>
+#include <cstdint>
+#include <array>
+
+/**
+ * Outcome of feeding bytes to a HTTP_Parser.
+ * */
+enum class Parse_Status{Complete, Incomplete, Error};
+
+/**
+ * Incrementally removes the framing of a message body, either a fixed Content-Length or the chunked
+ * transfer coding, from the bytes following the head. It keeps no bytes itself, so a body can be
+ * handed on piece by piece as it arrives without ever being held as a whole.
+ * */
+class Body_Decoder{
+public:
+    /**
+     * Decodes an empty body.
+     * */
+    Body_Decoder() = default;
+
+    /**
+     * Decodes a body of the given Content-Length.
+     * */
+    explicit Body_Decoder(std::uint64_t length) : state_(length != 0 ? State::Fixed : State::Done), remaining_(length) {}
+
+    /**
+     * Decodes a body sent with the chunked transfer coding.
+     * */
+    static Body_Decoder chunked(){
+        Body_Decoder decoder;
+        decoder.state_ = State::Size;
+        return decoder;
+    }
+
+    /**
+     * Decodes the body bytes at the front of the input. Sets consumed to the number of input bytes used up,
+     * framing included, and data to the decoded bytes among them, which are a slice of the input. Returns
+     * Complete once the body ended and Incomplete if decoding continues after the consumed bytes.
+     * */
+    Parse_Status decode(std::string_view input, std::size_t& consumed, std::string_view& data);
+
+    /**
+     * Decodes as much of the input as possible, handing every decoded piece to write, which may return false
+     * to stop early. Sets consumed to the number of input bytes used up and returns Complete once the body
+     * ended, Incomplete if it continues after them and Error if it is malformed.
+     * */
+    template<typename Write>
+    Parse_Status decode_all(std::string_view input, std::size_t& consumed, Write&& write){
+        consumed = 0;
+        Parse_Status status;
+        std::size_t used;
+        std::string_view data;
+        do{
+            status = decode(input.substr(consumed), used, data);
+            consumed += used;
+            if(!data.empty() && !write(data)){
+                break;
+            }
+        }while(status == Parse_Status::Incomplete && used != 0);
+        return status;
+    }
+
+    bool done() const{
+        return state_ == State::Done;
+    }
+private:
+    enum class State{Fixed, Size, Data, Data_End, Trailer, Done};
+    State state_ = State::Done;
+    // Bytes left of the fixed length body or of the current chunk.
+    std::uint64_t remaining_ = 0;
+};
+
+/**
+ * A resumable HTTP message parser that works in place on the receive buffer.
+ *
+ * The buffer handed to parse() must start at the beginning of the message and may only grow at its end
+ * between calls, so every byte is scanned once no matter how many receives the message took. Once parse()
+ * returned Complete, the accessors return slices of the buffer of that last call, which must stay alive
+ * and unchanged while they are used.
+ * */
+class HTTP_Parser{
+public:
+    // Limits that bound the memory and work spent on a single message head.
+    static constexpr std::size_t max_headers = 64;
+    static constexpr std::size_t max_header_size = 1 << 16;
+
+    /**
+     * Parses the message at the beginning of the buffer, returns Incomplete if more bytes are needed.
+     * A chunked body is decoded into a copy, since its framing interleaves with the data.
+     * */
+    Parse_Status parse(std::string_view buffer);
+
+    /**
+     * Parses only the head of the message at the beginning of the buffer, for callers receiving the body
+     * on their own using body_decoder(). Returns Incomplete if more bytes are needed.
+     * */
+    Parse_Status parse_head(std::string_view buffer);
+
+    /**
+     * Forgets the current message so the parser can be used for the next one.
+     * */
+    void reset();
+
+    Type type() const{
+        return type_;
+    }
+    // Start line of requests.
+    std::string_view get_command() const{
+        return view(start_[0]);
+    }
+    std::string_view get_url() const{
+        return view(start_[1]);
+    }
+    // Start line of responses.
+    int get_status_code() const{
+        return status_code_;
+    }
+    std::string_view get_reason() const{
+        return view(start_[2]);
+    }
+
+    std::size_t header_count() const{
+        return n_headers_;
+    }
+    Header_View header(std::size_t i) const{
+        return {view(headers_[i].name), view(headers_[i].value)};
+    }
+    /**
+     * Case insensitive lookup of a header value.
+     * */
+    std::optional<std::string_view> find_header(std::string_view name) const;
+
+    /**
+     * Size of the start line and headers including the terminating empty line.
+     * */
+    std::size_t header_size() const{
+        return header_size_;
+    }
+    std::size_t content_length() const{
+        return content_length_;
+    }
+    bool chunked() const{
+        return chunked_;
+    }
+    bool has_body() const{
+        return chunked_ || content_length_ != 0;
+    }
+    /**
+     * Returns a decoder for the body following the head.
+     * */
+    Body_Decoder body_decoder() const{
+        return chunked_ ? Body_Decoder::chunked() : Body_Decoder(content_length_);
+    }
+    /**
+     * Size of the whole message, valid once parse() returned Complete.
+     * */
+    std::size_t message_size() const{
+        return header_size_ + (chunked_ ? body_consumed_ : content_length_);
+    }
+    std::string_view get_body() const{
+        return chunked_ ? std::string_view(decoded_) : buffer_.substr(header_size_, content_length_);
+    }
+private:
+    struct Span{
+        std::uint32_t offset = 0;
+        std::uint32_t length = 0;
+    };
+    struct Header_Span{
+        Span name;
+        Span value;
+    };
+
+    std::string_view view(Span span) const{
+        return buffer_.substr(span.offset, span.length);
+    }
+    bool split_head();
+    bool parse_start_line(std::size_t end, std::size_t token_end);
+
+    std::string_view buffer_;
+    // Offset from which the search for the end of the head resumes.
+    std::size_t scanned_ = 0;
+    std::size_t header_size_ = 0;
+    std::size_t content_length_ = 0;
+    bool chunked_ = false;
+    // A chunked body is decoded as far as it arrived, body_consumed_ counts the encoded bytes behind the head.
+    Body_Decoder body_;
+    std::size_t body_consumed_ = 0;
+    std::string decoded_;
+    Type type_ = Type::Request;
+    int status_code_ = 0;
+    std::array<Span, 3> start_{};
+    std::array<Header_Span, max_headers> headers_{};
+    std::size_t n_headers_ = 0;
+};
+
+/**
+ * Converts a completely parsed HTTP request into a HTTP request object allocated from the given resource.
+ * */
+HTTP<Type::Request> read_request(const HTTP_Parser& parser,
+                                 std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+/**
+ * Converts a completely parsed HTTP response into a HTTP response object allocated from the given resource.
+ * */
+HTTP<Type::Response> read_response(const HTTP_Parser& parser,
+                                   std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+/**
+ * Converts the parsed head of a HTTP request into a HTTP request object without a body, for requests
+ * whose body is received separately.
+ * */
+HTTP<Type::Request> read_request_head(const HTTP_Parser& parser,
+                                      std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+#endif // HTTP_PARSER_H_INCLUDED
@@ -0,0 +1,280 @@
+#include "http_scan.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HTTP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Characters of a token, RFC 9110 section 5.6.2.
+ * */
+static constexpr bool is_tchar(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c != 0 && std::string_view("!#$%&'*+-.^_`|~").find(char(c)) != std::string_view::npos);
+}
+
+/**
+ * Characters of a header value or a start line: visible ones, SP, HTAB and obs-text.
+ * */
+static constexpr bool is_field_char(unsigned char c)
+{
+    return c == '\t' || (c >= 0x20 && c != 0x7f);
+}
+
+template<typename Is_Member>
+static constexpr std::array<bool, 256> make_table(Is_Member is_member)
+{
+    std::array<bool, 256> table{};
+    for(int c = 0; c < 256; c++)
+    {
+        table[c] = is_member((unsigned char) c);
+    }
+    return table;
+}
+
+static constexpr std::array<bool, 256> tchar_table = make_table(is_tchar);
+static constexpr std::array<bool, 256> field_table = make_table(is_field_char);
+
+static std::size_t find_head_end_scalar(std::string_view buffer, std::size_t from)
+{
+    return buffer.find("\r\n\r\n", from);
+}
+
+/**
+ * Sets the bits of the bytes past the end of the head, so scans of the maps stop there.
+ * */
+static void mark_tail(std::size_t size, std::uint64_t* non_token, std::uint64_t* non_field)
+{
+    if(size % 64 != 0)
+    {
+        std::uint64_t past = ~std::uint64_t(0) << (size % 64);
+        non_token[size / 64] |= past;
+        non_field[size / 64] |= past;
+    }
+}
+
+static void classify_head_scalar(std::string_view head, std::uint64_t* non_token, std::uint64_t* non_field)
+{
+    for(std::size_t word = 0; word * 64 < head.size(); word++)
+    {
+        std::uint64_t token_bits = 0, field_bits = 0;
+        std::size_t n = std::min<std::size_t>(64, head.size() - word * 64);
+        for(std::size_t i = 0; i < n; i++)
+        {
+            unsigned char c = (unsigned char) head[word * 64 + i];
+            token_bits |= std::uint64_t(!tchar_table[c]) << i;
+            field_bits |= std::uint64_t(!field_table[c]) << i;
+        }
+        non_token[word] = token_bits;
+        non_field[word] = field_bits;
+    }
+    mark_tail(head.size(), non_token, non_field);
+}
+
+#ifdef HTTP_SCAN_X86
+
+/**
+ * Token membership split by nibbles: entry l has bit h set if the character 0xhl is a tchar. None above 0x7f is,
+ * so a byte is looked up with one shuffle by its low nibble and one by its high nibble picking the bit.
+ * */
+static constexpr std::array<std::uint8_t, 16> tchar_nibbles = []
+{
+    std::array<std::uint8_t, 16> table{};
+    for(int c = 0; c < 0x80; c++)
+    {
+        if(is_tchar((unsigned char) c))
+        {
+            table[c & 0x0f] |= std::uint8_t(1 << (c >> 4));
+        }
+    }
+    return table;
+}();
+
+__attribute__((target("sse4.2")))
+static std::size_t find_head_end_sse42(std::string_view buffer, std::size_t from)
+{
+    const char* data = buffer.data();
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    std::size_t i = from;
+    // Every position is compared with all four bytes of the terminator at once through shifted loads.
+    for(; i + 16 + 3 <= buffer.size(); i += 16)
+    {
+        __m128i first = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i)), cr),
+                                      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i + 1)), lf));
+        __m128i second = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i + 2)), cr),
+                                       _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i + 3)), lf));
+        unsigned mask = unsigned(_mm_movemask_epi8(_mm_and_si128(first, second)));
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return find_head_end_scalar(buffer, i);
+}
+
+/**
+ * Copies the bytes of the head past its last whole 64 into a zero padded block, so the vector loads classifying
+ * them do not read past the head.
+ * */
+static void pad_tail(std::string_view head, std::size_t word, char* block)
+{
+    std::memset(block, 0, 64);
+    std::memcpy(block, head.data() + word * 64, head.size() - word * 64);
+}
+
+__attribute__((target("sse4.2")))
+static inline void classify_block_sse42(const char* data, std::uint64_t& non_token, std::uint64_t& non_field)
+{
+    const __m128i table = _mm_loadu_si128((const __m128i*) tchar_nibbles.data());
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i low = _mm_set1_epi8(0x0f);
+    const __m128i max_control = _mm_set1_epi8(0x1f), tab = _mm_set1_epi8('\t'), del = _mm_set1_epi8(0x7f);
+    non_token = non_field = 0;
+    for(int i = 0; i < 64; i += 16)
+    {
+        __m128i chars = _mm_loadu_si128((const __m128i*) (data + i));
+        __m128i row = _mm_shuffle_epi8(table, _mm_and_si128(chars, low));
+        __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(chars, 4), low));
+        __m128i non_tchar = _mm_cmpeq_epi8(_mm_and_si128(row, bit), _mm_setzero_si128());
+        __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(chars, max_control), max_control);
+        __m128i invalid = _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(chars, tab), control),
+                                       _mm_cmpeq_epi8(chars, del));
+        non_token |= std::uint64_t(unsigned(_mm_movemask_epi8(non_tchar))) << i;
+        non_field |= std::uint64_t(unsigned(_mm_movemask_epi8(invalid))) << i;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void classify_head_sse42(std::string_view head, std::uint64_t* non_token, std::uint64_t* non_field)
+{
+    std::size_t word = 0;
+    for(; word * 64 + 64 <= head.size(); word++)
+    {
+        classify_block_sse42(head.data() + word * 64, non_token[word], non_field[word]);
+    }
+    if(word * 64 < head.size())
+    {
+        char block[64];
+        pad_tail(head, word, block);
+        classify_block_sse42(block, non_token[word], non_field[word]);
+    }
+    mark_tail(head.size(), non_token, non_field);
+}
+
+__attribute__((target("avx2")))
+static std::size_t find_head_end_avx2(std::string_view buffer, std::size_t from)
+{
+    const char* data = buffer.data();
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    std::size_t i = from;
+    for(; i + 32 + 3 <= buffer.size(); i += 32)
+    {
+        __m256i first = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i)), cr),
+                                         _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i + 1)), lf));
+        __m256i second = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i + 2)), cr),
+                                          _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i + 3)), lf));
+        unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_and_si256(first, second)));
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return find_head_end_sse42(buffer, i);
+}
+
+__attribute__((target("avx2")))
+static inline void classify_block_avx2(const char* data, std::uint64_t& non_token, std::uint64_t& non_field)
+{
+    // The shuffles work within 128 bit lanes, so both lanes get a copy of the tables.
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) tchar_nibbles.data()));
+    const __m256i bits = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0));
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i max_control = _mm256_set1_epi8(0x1f), tab = _mm256_set1_epi8('\t'), del = _mm256_set1_epi8(0x7f);
+    non_token = non_field = 0;
+    for(int i = 0; i < 64; i += 32)
+    {
+        __m256i chars = _mm256_loadu_si256((const __m256i*) (data + i));
+        __m256i row = _mm256_shuffle_epi8(table, _mm256_and_si256(chars, low));
+        __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(chars, 4), low));
+        __m256i non_tchar = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), _mm256_setzero_si256());
+        __m256i control = _mm256_cmpeq_epi8(_mm256_max_epu8(chars, max_control), max_control);
+        __m256i invalid = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(chars, tab), control),
+                                          _mm256_cmpeq_epi8(chars, del));
+        non_token |= std::uint64_t(unsigned(_mm256_movemask_epi8(non_tchar))) << i;
+        non_field |= std::uint64_t(unsigned(_mm256_movemask_epi8(invalid))) << i;
+    }
+}
+
+__attribute__((target("avx2")))
+static void classify_head_avx2(std::string_view head, std::uint64_t* non_token, std::uint64_t* non_field)
+{
+    std::size_t word = 0;
+    for(; word * 64 + 64 <= head.size(); word++)
+    {
+        classify_block_avx2(head.data() + word * 64, non_token[word], non_field[word]);
+    }
+    if(word * 64 < head.size())
+    {
+        char block[64];
+        pad_tail(head, word, block);
+        classify_block_avx2(block, non_token[word], non_field[word]);
+    }
+    mark_tail(head.size(), non_token, non_field);
+}
+
+#endif // HTTP_SCAN_X86
+
+/**
+ * One set of kernels, all of them for the same instruction set.
+ * */
+struct Scan_Kernels
+{
+    std::size_t (*find_head_end)(std::string_view, std::size_t);
+    void (*classify_head)(std::string_view, std::uint64_t*, std::uint64_t*);
+    const char* name;
+};
+
+static Scan_Kernels select_kernels()
+{
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return {find_head_end_avx2, classify_head_avx2, "avx2"};
+    }
+    if(__builtin_cpu_supports("sse4.2"))
+    {
+        return {find_head_end_sse42, classify_head_sse42, "sse4.2"};
+    }
+#endif
+    return {find_head_end_scalar, classify_head_scalar, "scalar"};
+}
+
+/**
+ * Picked on first use, so parsers running during static initialization find them too.
+ * */
+static const Scan_Kernels& kernels()
+{
+    static const Scan_Kernels selected = select_kernels();
+    return selected;
+}
+
+std::size_t find_head_end(std::string_view buffer, std::size_t from)
+{
+    return kernels().find_head_end(buffer, from);
+}
+
+void classify_head(std::string_view head, std::uint64_t* non_token, std::uint64_t* non_field)
+{
+    kernels().classify_head(head, non_token, non_field);
+}
+
+const char* scan_kernels()
+{
+    return kernels().name;
+}
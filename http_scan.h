@@ -0,0 +1,49 @@
+#ifndef HTTP_SCAN_H_INCLUDED
+#define HTTP_SCAN_H_INCLUDED
+
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Scanning kernels of the HTTP parser. Each has a scalar version and, on x86-64, SSE4.2 and AVX2 versions
+ * working on 16 and 32 bytes at a time, the best one the CPU supports is picked once at startup.
+ * */
+
+/**
+ * Returns the offset of the "\r\n\r\n" ending a message head in buffer[from, size), or npos if there is none.
+ * */
+std::size_t find_head_end(std::string_view buffer, std::size_t from = 0);
+
+/**
+ * Classifies every byte of a message head in one pass, setting bit i of the maps, word i / 64 and bit i % 64,
+ * if byte i may not appear in a token (RFC 9110 tchar), i.e. a method or a header name, or if it may not appear
+ * in a header value or a start line, a control character other than HTAB. Both maps need room for
+ * (head.size() + 63) / 64 words, the bits past the end of the head are set in both.
+ *
+ * The first byte of a header line that is no token character is where its name ends, and the first one after
+ * that which is no field character is where its value ends, so the lines are split and validated without
+ * looking at their bytes again.
+ * */
+void classify_head(std::string_view head, std::uint64_t* non_token, std::uint64_t* non_field);
+
+/**
+ * Returns the position of the first bit set at or after from in a map filled by classify_head.
+ * */
+inline std::size_t next_set_bit(const std::uint64_t* map, std::size_t from)
+{
+    std::size_t word = from / 64;
+    std::uint64_t bits = map[word] & (~std::uint64_t(0) << (from % 64));
+    while(bits == 0)
+    {
+        bits = map[++word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+/**
+ * Names the kernels in use, "avx2", "sse4.2" or "scalar".
+ * */
+const char* scan_kernels();
+
+#endif // HTTP_SCAN_H_INCLUDED
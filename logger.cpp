@@ -0,0 +1,243 @@
+#include "logger.h"
+#include <array>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// Entries of the ring of every thread that logs, and their size including the header.
+constexpr std::size_t log_ring_entries = 1024;
+constexpr std::size_t log_record_size = 256;
+// The longest the writer sleeps while there is nothing to write, it backs off to it from a millisecond.
+constexpr std::chrono::milliseconds max_writer_sleep(10);
+
+namespace {
+    struct Log_Record {
+        // Wall clock time of the message in nanoseconds since the epoch.
+        std::int64_t time;
+        Log_Level level;
+        std::uint16_t length;
+        char text[log_record_size - sizeof(std::int64_t) - 4];
+    };
+
+    /**
+     * A single producer, single consumer ring: the thread owning it writes the records at tail, the writer thread
+     * reads them at head.
+     */
+    struct Log_Ring {
+        std::array<Log_Record, log_ring_entries> records;
+        alignas(64) std::atomic<std::uint64_t> head{0};
+        alignas(64) std::atomic<std::uint64_t> tail{0};
+        // Written by the owner only, the writer reports the ones it has not reported yet.
+        std::atomic<std::uint64_t> dropped{0};
+        std::uint64_t reported_dropped = 0;
+        // Set once the owning thread exited, the ring is dropped once it is drained.
+        std::atomic<bool> retired{false};
+    };
+
+    struct Log_Registry {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<Log_Ring>> rings;
+        // Held while draining, by the writer thread or a flush.
+        std::mutex drain_mutex;
+        std::once_flag writer_started;
+    };
+
+    Log_Registry &registry() {
+        // Never destroyed, threads may still log while the static destructors run.
+        static auto *registry = new Log_Registry;
+        return *registry;
+    }
+
+    /**
+     * Writes the records of every ring to the streams, returns false if there were none.
+     */
+    bool drain() {
+        Log_Registry &reg = registry();
+        std::scoped_lock drain_lock(reg.drain_mutex);
+        std::vector<std::shared_ptr<Log_Ring>> rings;
+        {
+            std::scoped_lock lock(reg.mutex);
+            rings = reg.rings;
+        }
+        std::string out, err;
+        bool any = false;
+        for (auto &ring: rings) {
+            bool retired = ring->retired.load(std::memory_order_acquire);
+            std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+            std::uint64_t tail = ring->tail.load(std::memory_order_acquire);
+            any = any || head != tail;
+            for (; head != tail; head++) {
+                const Log_Record &record = ring->records[head % log_ring_entries];
+                std::string &stream = record.level >= Log_Level::Error ? err : out;
+                std::time_t seconds = std::time_t(record.time / 1000000000);
+                struct tm tm{};
+#ifdef _WIN32
+                gmtime_s(&tm, &seconds);
+#else
+                gmtime_r(&seconds, &tm);
+#endif
+                char stamp[40];
+                std::size_t n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+                std::snprintf(stamp + n, sizeof(stamp) - n, ".%06dZ ", int(record.time % 1000000000 / 1000));
+                stream += stamp;
+                stream.append(record.text, record.length);
+                stream += '\n';
+            }
+            ring->head.store(tail, std::memory_order_release);
+            std::uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+            if (dropped != ring->reported_dropped) {
+                err += "ERROR: " + std::to_string(dropped - ring->reported_dropped) +
+                       " log messages dropped, the ring of their thread was full\n";
+                ring->reported_dropped = dropped;
+            }
+            if (retired) {
+                std::scoped_lock lock(reg.mutex);
+                reg.rings.erase(std::find(reg.rings.begin(), reg.rings.end(), ring));
+            }
+        }
+        if (!out.empty()) {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            std::fflush(stdout);
+        }
+        if (!err.empty()) {
+            std::fwrite(err.data(), 1, err.size(), stderr);
+            std::fflush(stderr);
+        }
+        return any;
+    }
+
+    [[noreturn]] void runWriter() {
+        auto sleep = std::chrono::milliseconds(1);
+        while (true) {
+            if (drain()) {
+                sleep = std::chrono::milliseconds(1);
+                continue;
+            }
+            std::this_thread::sleep_for(sleep);
+            sleep = std::min(sleep * 2, max_writer_sleep);
+        }
+    }
+
+    /**
+     * Owns the ring of a thread, which the writer drains and drops after the thread exited.
+     */
+    struct Ring_Owner {
+        std::shared_ptr<Log_Ring> ring;
+
+        Ring_Owner() : ring(std::make_shared<Log_Ring>()) {
+            Log_Registry &reg = registry();
+            {
+                std::scoped_lock lock(reg.mutex);
+                reg.rings.push_back(ring);
+            }
+            std::call_once(reg.writer_started, [] {
+                std::thread(runWriter).detach();
+                std::atexit(flushLogs);
+            });
+        }
+
+        ~Ring_Owner() {
+            ring->retired.store(true, std::memory_order_release);
+        }
+    };
+
+    /**
+     * Returns the record to fill at the tail of the ring of the calling thread, nullptr if the ring is full.
+     * The record is published by commit().
+     */
+    Log_Record *reserve(Log_Ring *&ring) {
+        // Created on the first message, so threads that never log have no ring.
+        thread_local Ring_Owner owner;
+        ring = owner.ring.get();
+        std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        if (tail - ring->head.load(std::memory_order_acquire) == log_ring_entries) {
+            ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Log_Record *record = &ring->records[tail % log_ring_entries];
+        record->time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        return record;
+    }
+
+    void commit(Log_Ring *ring, Log_Record *record, Log_Level level, int length) {
+        record->level = level;
+        record->length = std::uint16_t(std::clamp<int>(length, 0, sizeof(record->text) - 1));
+        ring->tail.store(ring->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    const char *const level_names[] = {"DEBUG", "INFO", "ERROR"};
+}
+
+/**
+ * Parses "debug", "info", "error" or "off", returns false for anything else.
+ */
+bool parseLogLevel(std::string_view name, Log_Level &level) {
+    static const std::pair<std::string_view, Log_Level> levels[] = {
+            {"debug", Log_Level::Debug}, {"info", Log_Level::Info}, {"error", Log_Level::Error}, {"off", Log_Level::Off}
+    };
+    for (auto &entry: levels) {
+        if (entry.first == name) {
+            level = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Formats a message with its source location into the ring of the calling thread. Messages longer than a ring
+ * entry are truncated.
+ */
+void logMessage(Log_Level level, const char *file, int line, const char *func, const char *fmt, ...) {
+    Log_Ring *ring;
+    Log_Record *record = reserve(ring);
+    if (!record) {
+        return;
+    }
+    int length = std::snprintf(record->text, sizeof(record->text), "%s: %s:%d:%s(): ",
+                               level_names[int(level)], file, line, func);
+    if (length >= 0 && std::size_t(length) < sizeof(record->text)) {
+        va_list args;
+        va_start(args, fmt);
+        int written = std::vsnprintf(record->text + length, sizeof(record->text) - length, fmt, args);
+        va_end(args);
+        length = written < 0 ? length : length + written;
+    }
+    commit(ring, record, level, length);
+}
+
+/**
+ * Logs the access line of an answered request at Info level: method, target, status, body size and the time
+ * the handler took.
+ */
+void logAccess(std::string_view method, std::string_view target, std::string_view status, std::uint64_t body_size,
+               std::chrono::nanoseconds duration) {
+    if (!logEnabled(Log_Level::Info)) {
+        return;
+    }
+    Log_Ring *ring;
+    Log_Record *record = reserve(ring);
+    if (!record) {
+        return;
+    }
+    int length = std::snprintf(record->text, sizeof(record->text), "INFO: %.*s %.*s %.*s %llu %.3fms",
+                               int(method.size()), method.data(), int(target.size()), target.data(),
+                               int(status.size()), status.data(), (unsigned long long) body_size,
+                               double(duration.count()) / 1e6);
+    commit(ring, record, Log_Level::Info, length);
+}
+
+/**
+ * Writes out every message logged so far, called at exit as well.
+ */
+void flushLogs() {
+    drain();
+}
@@ -0,0 +1,55 @@
+#ifndef LOGGER_H_INCLUDED
+#define LOGGER_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Asynchronous logging. Every thread formats its messages into a lock-free ring of its own, which a background
+ * writer thread drains to stdout, errors to stderr. A thread never waits for the output or for another thread,
+ * a message that finds its ring full is dropped and counted instead.
+ */
+
+enum class Log_Level : std::uint8_t
+{
+    Debug, Info, Error, Off
+};
+
+// Messages below the level are skipped before their arguments are evaluated.
+inline std::atomic<Log_Level> log_threshold{Log_Level::Error};
+
+inline bool logEnabled(Log_Level level) {
+    return level >= log_threshold.load(std::memory_order_relaxed);
+}
+
+inline void setLogLevel(Log_Level level) {
+    log_threshold.store(level, std::memory_order_relaxed);
+}
+
+/**
+ * Parses "debug", "info", "error" or "off", returns false for anything else.
+ */
+bool parseLogLevel(std::string_view name, Log_Level &level);
+
+/**
+ * Formats a message with its source location into the ring of the calling thread. Messages longer than a ring
+ * entry are truncated.
+ */
+void logMessage(Log_Level level, const char *file, int line, const char *func, const char *fmt, ...)
+        __attribute__((format(printf, 5, 6)));
+
+/**
+ * Logs the access line of an answered request at Info level: method, target, status, body size and the time
+ * the handler took.
+ */
+void logAccess(std::string_view method, std::string_view target, std::string_view status, std::uint64_t body_size,
+               std::chrono::nanoseconds duration);
+
+/**
+ * Writes out every message logged so far, called at exit as well.
+ */
+void flushLogs();
+
+#endif // LOGGER_H_INCLUDED
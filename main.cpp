@@ -1,6 +1,12 @@
 #include <bits/stdc++.h>
-#include "Http.h"
+#include "http.h"
 #include "networking.h"
+#include "file_cache.h"
+#include "compression.h"
+#include "file_upload.h"
+#include "router.h"
+#include "static_file.h"
+#include "metrics.h"
 #include "debugger.h"
 
 using namespace std;
@@ -26,7 +32,50 @@ const std::map<std::string, std::string> extension_map{
     }
 };
 
-int main()
+/**
+ * Whether a path captured by a mount stays inside the served directory: it is relative and has no ".." segment.
+ * */
+static bool inside_served_tree(std::string_view path)
+{
+    if(!path.empty() && (path.front() == '/' || path.front() == '\\'))
+    {
+        return false;
+    }
+    while(!path.empty())
+    {
+        std::size_t end = std::min(path.find_first_of("/\\"), path.size());
+        if(path.substr(0, end) == "..")
+        {
+            return false;
+        }
+        path.remove_prefix(std::min(end + 1, path.size()));
+    }
+    return true;
+}
+
+/**
+ * Refuses the body of a request right away and answers it with the given status.
+ * */
+class Refused_Body : public Body_Sink
+{
+public:
+    explicit Refused_Body(int status) : status_(status) {}
+
+    bool write(std::string_view) override
+    {
+        return false;
+    }
+
+    HTTP<Type::Response> finish() override
+    {
+        HTTP_Builder<Type::Response> builder;
+        return builder.setStatus(status_).addHeader("Connection", "close").build();
+    }
+private:
+    int status_;
+};
+
+int main(int argc, char *argv[])
 {
     WSADATA wsaData;
     int iResult = WSAStartup(MAKEWORD(2,2), &wsaData);
@@ -35,76 +84,161 @@ int main()
         Err("WSAStartup failed: %d\n", iResult);
         return 1;
     }
+    auto content_type = [](const std::string& path)
+    {
+        int position = path.find_last_of(".");
+        auto type = extension_map.find(path.substr(position+1));
+        return type != extension_map.end() ? type->second : "application/octet-stream";
+    };
+    // Small files are served from memory with their headers prebuilt.
+    File_Cache cache(content_type);
+    addMetricsSource([&cache](std::string& out)
+    {
+        File_Cache::Stats stats = cache.stats();
+        writeCounter(out, "file_cache_hits_total", "Requests answered from the file cache.", stats.hits);
+        writeCounter(out, "file_cache_misses_total", "Requests the file cache could not answer.", stats.misses);
+        writeCounter(out, "file_cache_invalidations_total", "File cache entries dropped because the file changed.",
+                     stats.invalidations);
+        writeCounter(out, "file_cache_evictions_total", "File cache entries dropped to make room for others.",
+                     stats.evictions);
+        writeGauge(out, "file_cache_entries", "Files held by the file cache.", stats.entries);
+        writeGauge(out, "file_cache_bytes", "Bytes held by the file cache.", stats.bytes);
+    });
+    // Text is sent compressed to clients accepting it, from a precompressed sibling or compressed once per version.
+    Compression_Cache compression;
+    addMetricsSource([&compression](std::string& out)
+    {
+        Compression_Cache::Stats stats = compression.stats();
+        writeCounter(out, "compression_cache_hits_total", "Coded responses answered from the compression cache.",
+                     stats.hits);
+        writeCounter(out, "compression_cache_misses_total", "Files compressed because the cache had no current copy.",
+                     stats.misses);
+        writeCounter(out, "compression_precompressed_total", "Coded responses sent from a precompressed file.",
+                     stats.precompressed);
+        writeCounter(out, "compression_cache_evictions_total", "Compressed files dropped to make room for others.",
+                     stats.evictions);
+        writeGauge(out, "compression_cache_entries", "Compressed files held by the compression cache.", stats.entries);
+        writeGauge(out, "compression_cache_bytes", "Bytes held by the compression cache.", stats.bytes);
+    });
+    // The static file tree is mounted at the root, routes added before it can serve API endpoints next to it.
+    Router router;
+    router.addRoute("GET", "/*path", [&](const HTTP<Type::Request>& req, const Route_Params& params)
+    {
+        // The response lives in the arena of the request until it is sent.
+        HTTP_Builder<Type::Response> builder(req.get_resource());
+        std::string url(*params.get("path"));
+        if(!inside_served_tree(url))
+        {
+            return builder.setStatus(400).build();
+        }
+        // Uploads in progress are not part of the tree until they are moved into place.
+        if(File_Upload::is_temporary(url))
+        {
+            return builder.setStatus(404).build();
+        }
+        // Revalidations and ranges are answered from the full response, which is never read for them.
+        if(auto cached = cache.get(url, req.get_resource()))
+        {
+            return answer_file_request(req, compression.encode(req, HTTP_Builder<Type::Response>(std::move(*cached))
+                    .addHeader("Connection", "Keep-Alive").build(), url));
+        }
+        // Files too large for the cache are sent straight from the page cache instead of being read into memory.
+        auto file = File_Handle::open(url);
+        if(!file)
+        {
+            Err("%s : failed to open file", url.c_str());
+            return builder.setStatus(404).build();
+        }
+        return answer_file_request(req, compression.encode(req, builder.setStatus(200)
+        .addHeader("Content-Type", content_type(url))
+        .addHeader("Connection", "Keep-Alive").addHeader("Content-Length", std::to_string(file->size()))
+        .addHeader(Header_Id::ETag, file->etag()).addHeader(Header_Id::Last_Modified, http_date(file->mtime()))
+        .addHeader(Header_Id::Accept_Ranges, "bytes")
+        .addFileBody({file, 0, file->size()}).build(), url));
+    });
+    // Uploads into the file tree are written to disk as they arrive instead of being buffered in memory.
+    router.addRoute("POST", "/*path", [](const HTTP<Type::Request>& req, const Route_Params& params)
+    {
+        // Only uploads without a body get here, the others are streamed to disk.
+        std::string path(*params.get("path"));
+        if(!inside_served_tree(path))
+        {
+            return HTTP_Builder<Type::Response>(req.get_resource()).setStatus(400).build();
+        }
+        File_Upload upload{path};
+        upload.write(req.get_body());
+        return upload.finish();
+    }, [](const HTTP<Type::Request>& head, const Route_Params& params) -> std::unique_ptr<Body_Sink>
+    {
+        std::string path(*params.get("path"));
+        if(!inside_served_tree(path))
+        {
+            return std::make_unique<Refused_Body>(400);
+        }
+        auto length = head.find_header(Header_Id::Content_Length);
+        return std::make_unique<File_Upload>(path, length ? std::stoull(std::string(*length)) : 0);
+    });
     Server::Handler handler = [&](const HTTP<Type::Request>& req)
     {
-        HTTP_Builder<Type::Response> builder;
-        auto url = req.get_url();
-        url = url.substr(1);
-        if(req.get_command() == "GET")
+        return router.route(req);
+    };
+    // Only the routes that stream their bodies get them piece by piece, the others receive them as a whole.
+    Body_Handler body_handler = [&](const HTTP<Type::Request>& head)
+    {
+        return router.stream(head);
+    };
+    try
+    {
+        Server_Options options;
+        // Empty until --port names one, the default depends on whether TLS is served.
+        std::string port;
+        for(int i = 1; i < argc; i++)
         {
-            std::ifstream file(url, std::ios::in | std::ios::binary);
-            if(!file.is_open())
+            std::string arg = argv[i];
+            // Serves with io_uring where the kernel supports it.
+            if(arg == "--io-uring")
             {
-                Err("%s : failed to open file", url.c_str());
-                return builder.setStatus(404).build();
+                options.backend = Server_Backend::IO_Uring;
             }
-            file.seekg(0, std::ios::end);
-            std::size_t length = file.tellg();
-            file.seekg(0, std::ios::beg);
-            if (file.fail())
+            // Gives every thread its own listening socket and CPU.
+            else if(arg == "--reuse-port")
             {
-                Err("%s : failed to get size of file", url.c_str());
-                return builder.setStatus(404).build();
+                options.reuse_port = true;
             }
-            std::string data(length, '\0');
-            if(!file.read(&data[0], length))
+            // Runs the handler on the threads serving the connections instead of a worker pool.
+            else if(arg == "--no-workers")
             {
-                Err("%s : failed to read file", url.c_str());
-                return builder.setStatus(404).build();
+                options.use_worker_pool = false;
             }
-            if (file){
-              Debug("%s : all characters read successfully", url.c_str());
-            }else{\
-              Err("%s : only %d could be read", url.c_str(), file.gcount());
-              return builder.setStatus(404).build();
-            }
-            int position = url.find_last_of(".");
-
-            string extension = url.substr(position+1);
-            return builder.setStatus(200).addHeader("Content-Type", extension_map.at(extension)).addHeader("Connection", "Keep-Alive")
-            .addHeader("Content-Length", std::to_string(length)).addBody(data).build();
-        }else if(req.get_command() == "POST"){
-            // Check and create directories
-            int position = url.find_last_of("/");
-            if(position != -1){
-                string directories = url.substr(0, position);
-                bool success = std::filesystem::create_directories(directories);
-                if(!success){
-                    Err("%s : failed to create directories");
-                    return builder.setStatus(404).build();
+            // debug, info for an access line per request, error (the default) or off.
+            else if(arg == "--log-level" && i + 1 < argc)
+            {
+                Log_Level level;
+                if(!parseLogLevel(argv[++i], level))
+                {
+                    cerr << "unknown log level " << argv[i] << '\n';
+                    return 1;
                 }
+                setLogLevel(level);
             }
-            std::ofstream file(url, std::ios::out | std::ios::trunc | std::ios::binary);
-            if(!file.is_open())
+            // Serves HTTPS with the certificate chain and private key in the given PEM files, on 443 unless --port
+            // names another port.
+            else if(arg == "--tls" && i + 2 < argc)
             {
-                Err("%s : failed to open file", url.c_str());
-                return builder.setStatus(404).build();
+                options.tls = Tls_Context::server(argv[i + 1], argv[i + 2]);
+                i += 2;
             }
-            Debug("%s : writing %d chars", url.c_str(), req.get_body().size());
-            file << req.get_body();
-            if(file){
-                Debug("%s : written successfully", url.c_str());
-            }else{
-                Err("%s : error while writing data", url.c_str());
-                return builder.setStatus(404).build();
+            // Listens on another port than 80, or 443 with --tls.
+            else if(arg == "--port" && i + 1 < argc)
+            {
+                port = argv[++i];
             }
-            return builder.setStatus(200).build();
         }
-        return builder.setStatus(400).addHeader("Connection", "Keep-Alive").build();
-    };
-    try
-    {
-        Server serv("80", handler);
+        if(port.empty())
+        {
+            port = options.tls ? "443" : "80";
+        }
+        Server serv(port.c_str(), handler, body_handler, options);
         serv.ListenAndServe();
     }
     catch(std::exception& e)
@@ -0,0 +1,12 @@
+#!/bin/sh
+# Creates a self-signed certificate for localhost and 127.0.0.1 to test HTTPS locally:
+#   ./make_test_cert.sh [DIR]
+#   Network_lab --tls DIR/cert.pem DIR/key.pem
+#   Client --ca DIR/cert.pem ...    Evaluator --tls DIR/cert.pem ...    curl --cacert DIR/cert.pem https://localhost/
+# Files are sent with sendfile over kernel TLS once the tls module is loaded (modprobe tls).
+set -e
+dir=${1:-.}
+mkdir -p "$dir"
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 365 \
+    -keyout "$dir/key.pem" -out "$dir/cert.pem" -subj "/CN=localhost" \
+    -addext "subjectAltName=DNS:localhost,IP:127.0.0.1"
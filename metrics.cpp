@@ -0,0 +1,249 @@
+#include "metrics.h"
+#include <charconv>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+static constexpr std::array<std::string_view, request_method_count> method_names
+{
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "other"
+};
+
+Request_Method requestMethod(std::string_view command) {
+    for (std::size_t i = 0; i + 1 < method_names.size(); i++) {
+        if (method_names[i] == command) {
+            return Request_Method(i);
+        }
+    }
+    return Request_Method::Other;
+}
+
+void Duration_Histogram::record(Metrics_Clock::duration duration) {
+    auto ns = std::uint64_t(std::max<std::int64_t>(0, std::chrono::nanoseconds(duration).count()));
+    std::uint64_t us = ns / 1000;
+    // The bit width of the microseconds, the durations below 2^i of them land in bucket i.
+    std::size_t i = us == 0 ? 0 : std::size_t(64 - __builtin_clzll(us));
+    buckets_[std::min(i, bucket_count - 1)].add();
+    sum_.add(ns);
+}
+
+/**
+ * Adds the counts of the other histogram, which may be written meanwhile.
+ */
+void Duration_Histogram::merge(const Duration_Histogram &other) {
+    for (std::size_t i = 0; i < bucket_count; i++) {
+        buckets_[i].add(other.buckets_[i].load());
+    }
+    sum_.add(other.sum_.load());
+}
+
+void Thread_Metrics::countResponse(std::string_view status) {
+    int code = 0;
+    std::from_chars(status.data(), status.data() + status.size(), code);
+    responses[code >= 0 && std::size_t(code) < responses.size() ? code : 0].add();
+}
+
+/**
+ * Adds the counts of the other metrics, which may be written meanwhile.
+ */
+void Thread_Metrics::merge(const Thread_Metrics &other) {
+    accepted.add(other.accepted.load());
+    closed.add(other.closed.load());
+    bytes_in.add(other.bytes_in.load());
+    bytes_out.add(other.bytes_out.load());
+    tls_handshakes.add(other.tls_handshakes.load());
+    tls_resumed.add(other.tls_resumed.load());
+    tls_kernel_send.add(other.tls_kernel_send.load());
+    tls_failed.add(other.tls_failed.load());
+    for (std::size_t i = 0; i < requests.size(); i++) {
+        requests[i].add(other.requests[i].load());
+    }
+    for (std::size_t i = 0; i < responses.size(); i++) {
+        responses[i].add(other.responses[i].load());
+    }
+    parse_time.merge(other.parse_time);
+    handler_time.merge(other.handler_time);
+    send_time.merge(other.send_time);
+}
+
+namespace {
+
+/**
+ * The metrics of the running threads and the sum of those of the exited ones.
+ */
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<const Thread_Metrics *> threads;
+    Thread_Metrics retired;
+    std::vector<Metrics_Source> sources;
+};
+
+Registry &registry() {
+    // Never destroyed, detached threads may still exit after the static destructors ran.
+    static auto *registry = new Registry;
+    return *registry;
+}
+
+/**
+ * The metrics of a thread, listed in the registry for as long as the thread runs.
+ */
+struct Registered_Metrics : Thread_Metrics
+{
+    Registered_Metrics() {
+        Registry &reg = registry();
+        std::scoped_lock lock(reg.mutex);
+        reg.threads.push_back(this);
+    }
+
+    ~Registered_Metrics() {
+        Registry &reg = registry();
+        std::scoped_lock lock(reg.mutex);
+        reg.retired.merge(*this);
+        reg.threads.erase(std::find(reg.threads.begin(), reg.threads.end(), this));
+    }
+};
+
+void writeMetric(std::string &out, const char *name, const char *help, const char *type, std::uint64_t value) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+    out += name;
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+}
+
+void writeHistogram(std::string &out, const char *name, const char *help, const Duration_Histogram &histogram) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " histogram\n";
+    std::uint64_t count = 0;
+    char bound[32];
+    for (std::size_t i = 0; i < Duration_Histogram::bucket_count; i++) {
+        count += histogram.bucket(i);
+        if (i + 1 < Duration_Histogram::bucket_count) {
+            std::snprintf(bound, sizeof(bound), "%g", double(std::uint64_t(1) << i) * 1e-6);
+        } else {
+            std::snprintf(bound, sizeof(bound), "+Inf");
+        }
+        out += name;
+        out += "_bucket{le=\"";
+        out += bound;
+        out += "\"} ";
+        out += std::to_string(count);
+        out += '\n';
+    }
+    std::snprintf(bound, sizeof(bound), "%.9f", double(histogram.sumNanoseconds()) * 1e-9);
+    out += name;
+    out += "_sum ";
+    out += bound;
+    out += '\n';
+    out += name;
+    out += "_count ";
+    out += std::to_string(count);
+    out += '\n';
+}
+
+}
+
+/**
+ * Appends a counter or a gauge with its help text to the output of a source.
+ */
+void writeCounter(std::string &out, const char *name, const char *help, std::uint64_t value) {
+    writeMetric(out, name, help, "counter", value);
+}
+
+void writeGauge(std::string &out, const char *name, const char *help, std::uint64_t value) {
+    writeMetric(out, name, help, "gauge", value);
+}
+
+/**
+ * Adds a source whose metrics are rendered after those of the threads. It is called on the thread rendering the
+ * metrics and has to stay valid for as long as the server runs.
+ */
+void addMetricsSource(Metrics_Source source) {
+    Registry &reg = registry();
+    std::scoped_lock lock(reg.mutex);
+    reg.sources.push_back(std::move(source));
+}
+
+/**
+ * Returns the metrics of the calling thread. They are merged into those of the retired threads when it exits.
+ */
+Thread_Metrics &threadMetrics() {
+    thread_local Registered_Metrics metrics;
+    return metrics;
+}
+
+/**
+ * Merges the metrics of all threads and returns them in the Prometheus text exposition format, followed by those
+ * of the sources. The counters of a thread are read while it goes on writing them, so the totals may be a few
+ * events apart from each other.
+ */
+std::string renderMetrics() {
+    Thread_Metrics total;
+    {
+        Registry &reg = registry();
+        std::scoped_lock lock(reg.mutex);
+        total.merge(reg.retired);
+        for (const Thread_Metrics *metrics: reg.threads) {
+            total.merge(*metrics);
+        }
+    }
+    std::string out;
+    writeCounter(out, "http_connections_accepted_total", "Connections accepted.", total.accepted.load());
+    std::uint64_t accepted = total.accepted.load();
+    std::uint64_t closed = std::min(total.closed.load(), accepted);
+    writeGauge(out, "http_connections_active", "Connections currently open.", accepted - closed);
+    writeCounter(out, "http_received_bytes_total", "Bytes received from clients.", total.bytes_in.load());
+    writeCounter(out, "http_sent_bytes_total", "Bytes sent to clients.", total.bytes_out.load());
+    writeCounter(out, "tls_handshakes_total", "TLS handshakes completed.", total.tls_handshakes.load());
+    writeCounter(out, "tls_resumed_handshakes_total", "TLS handshakes that resumed an earlier session.",
+                 total.tls_resumed.load());
+    writeCounter(out, "tls_kernel_send_connections_total", "TLS connections whose sending the kernel encrypts.",
+                 total.tls_kernel_send.load());
+    writeCounter(out, "tls_failed_handshakes_total", "TLS handshakes that failed.", total.tls_failed.load());
+    out += "# HELP http_requests_total Requests received by method.\n"
+           "# TYPE http_requests_total counter\n";
+    for (std::size_t i = 0; i < request_method_count; i++) {
+        out += "http_requests_total{method=\"";
+        out += method_names[i];
+        out += "\"} " + std::to_string(total.requests[i].load()) + '\n';
+    }
+    out += "# HELP http_responses_total Responses queued by status code.\n"
+           "# TYPE http_responses_total counter\n";
+    for (std::size_t code = 0; code < total.responses.size(); code++) {
+        std::uint64_t count = total.responses[code].load();
+        if (count != 0) {
+            out += "http_responses_total{code=\"" + std::to_string(code) + "\"} " + std::to_string(count) + '\n';
+        }
+    }
+    writeHistogram(out, "http_parse_duration_seconds", "Time spent framing a request once it arrived.",
+                   total.parse_time);
+    writeHistogram(out, "http_handler_duration_seconds", "Time spent in the request handler.", total.handler_time);
+    writeHistogram(out, "http_send_duration_seconds", "Time from queueing a response until it was sent.",
+                   total.send_time);
+    std::vector<Metrics_Source> sources;
+    {
+        Registry &reg = registry();
+        std::scoped_lock lock(reg.mutex);
+        sources = reg.sources;
+    }
+    for (const Metrics_Source &source: sources) {
+        source(out);
+    }
+    return out;
+}
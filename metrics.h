@@ -0,0 +1,137 @@
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+/**
+ * Counters and latency histograms of a server. Every thread records into a block of its own, which no other
+ * thread writes, so recording is a plain load and store without a lock or a shared cache line. The blocks are
+ * only merged when the metrics are read.
+ */
+
+using Metrics_Clock = std::chrono::steady_clock;
+
+/**
+ * The request methods counted apart, the others are counted together as Other.
+ */
+enum class Request_Method : std::uint8_t
+{
+    Get, Head, Post, Put, Delete, Options, Patch, Other
+};
+
+constexpr std::size_t request_method_count = 8;
+
+Request_Method requestMethod(std::string_view command);
+
+/**
+ * A counter written by a single thread and read by any.
+ */
+class Counter
+{
+public:
+    void add(std::uint64_t n = 1) {
+        // Only the owning thread writes, so the increment needs no atomic read-modify-write.
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t load() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+private:
+    std::atomic<std::uint64_t> value_{0};
+};
+
+/**
+ * Counts durations in buckets of powers of two microseconds, written by a single thread and read by any.
+ */
+class Duration_Histogram
+{
+public:
+    // Bucket i counts durations below 2^i microseconds that did not fit the one before, the last all longer ones.
+    static constexpr std::size_t bucket_count = 26;
+
+    void record(Metrics_Clock::duration duration);
+
+    /**
+     * Adds the counts of the other histogram, which may be written meanwhile.
+     */
+    void merge(const Duration_Histogram &other);
+
+    std::uint64_t bucket(std::size_t i) const {
+        return buckets_[i].load();
+    }
+
+    std::uint64_t sumNanoseconds() const {
+        return sum_.load();
+    }
+private:
+    std::array<Counter, bucket_count> buckets_;
+    Counter sum_;
+};
+
+/**
+ * The metrics recorded by one thread.
+ */
+struct Thread_Metrics
+{
+    Counter accepted;
+    Counter closed;
+    Counter bytes_in;
+    Counter bytes_out;
+    // Completed TLS handshakes, those of them that resumed a session and those after which the kernel encrypts.
+    Counter tls_handshakes;
+    Counter tls_resumed;
+    Counter tls_kernel_send;
+    Counter tls_failed;
+    std::array<Counter, request_method_count> requests;
+    // Responses by status code, those outside [0, 600) are counted at 0.
+    std::array<Counter, 600> responses;
+    // Framing a request once its last bytes arrived.
+    Duration_Histogram parse_time;
+    Duration_Histogram handler_time;
+    // From a response being queued until its last byte is handed to the socket.
+    Duration_Histogram send_time;
+
+    void countResponse(std::string_view status);
+
+    /**
+     * Adds the counts of the other metrics, which may be written meanwhile.
+     */
+    void merge(const Thread_Metrics &other);
+};
+
+/**
+ * Returns the metrics of the calling thread. They are merged into those of the retired threads when it exits.
+ */
+Thread_Metrics &threadMetrics();
+
+/**
+ * Appends metrics kept outside the threads, e.g. by a cache, in the Prometheus text exposition format.
+ */
+using Metrics_Source = std::function<void(std::string &out)>;
+
+/**
+ * Adds a source whose metrics are rendered after those of the threads. It is called on the thread rendering the
+ * metrics and has to stay valid for as long as the server runs.
+ */
+void addMetricsSource(Metrics_Source source);
+
+/**
+ * Appends a counter or a gauge with its help text to the output of a source.
+ */
+void writeCounter(std::string &out, const char *name, const char *help, std::uint64_t value);
+void writeGauge(std::string &out, const char *name, const char *help, std::uint64_t value);
+
+/**
+ * Merges the metrics of all threads and returns them in the Prometheus text exposition format, followed by those
+ * of the sources.
+ */
+std::string renderMetrics();
+
+#endif // METRICS_H_INCLUDED
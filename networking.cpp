@@ -1,16 +1,109 @@
 #include "networking.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "metrics.h"
 #include "debugger.h"
 #include <stdexcept>
+#include <algorithm>
 #include <optional>
 #include <iostream>
 #include <thread>
+#include <vector>
 
-constexpr int total_timeout_seconds = 50;
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <pthread.h>
+
+/**
+ * Returns the CPUs the process may run on in ascending order.
+ */
+static std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+            cpus.push_back(int(cpu));
+        }
+    }
+    return cpus;
+}
+
+/**
+ * Restricts the thread to run on the given CPU only.
+ */
+static void pinThread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (int error = pthread_setaffinity_np(thread, sizeof(set), &set)) {
+        Err("pthread_setaffinity_np failed: %d", error);
+    }
+}
+
+/**
+ * Makes the kernel hand every new connection to the listener of the loop pinned to the CPU the connection
+ * arrived on, so it is handled on that CPU from the handshake on. This takes a loop on every CPU, pinned in
+ * CPU order; otherwise the kernel keeps spreading connections over the listeners by their address hash.
+ */
+static void steerByCpu(SOCKET listen_socket, unsigned n_threads, const std::vector<int> &cpus) {
+    if (cpus.size() != n_threads || cpus.back() != int(n_threads) - 1) {
+        return;
+    }
+    // The listeners joined the group in the order of their loops, so the CPU is the index of the listener.
+    struct sock_filter code[] = {
+            {BPF_LD | BPF_W | BPF_ABS, 0, 0, std::uint32_t(SKF_AD_OFF + SKF_AD_CPU)},
+            {BPF_RET | BPF_A,          0, 0, 0},
+    };
+    struct sock_fprog program = {2, code};
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1) {
+        Err("attaching the reuseport program failed: %d", errno);
+    }
+}
+#endif
 
 /**
 * Creates a server with the specified port and the customized handler.
 */
-Server::Server(const char *port, Handler handler) : handler(handler) {
+Server::Server(const char *port, Handler handler, Server_Options options)
+        : Server(port, std::move(handler), nullptr, options) {}
+
+/**
+* Creates a server with the specified port and the customized handler, whose requests may have their
+* body streamed to a sink chosen by the body handler.
+*/
+Server::Server(const char *port, Handler handler, Body_Handler body_handler, Server_Options options)
+        : handler(std::move(handler)), body_handler(std::move(body_handler)), options_(options), port_(port) {
+    ListenSocket_ = listenOn(port, options_.reuse_port);
+    if (!options_.metrics_path.empty()) {
+        // Answered on whatever thread runs the handler, which reads the metrics of the others without locking them.
+        this->handler = [inner = std::move(this->handler), path = options_.metrics_path](
+                const HTTP<Type::Request> &req) {
+            if (req.get_command() != "GET" || req.get_url() != path) {
+                return inner(req);
+            }
+            std::string metrics = renderMetrics();
+            HTTP_Builder<Type::Response> builder(req.get_resource());
+            return builder.setStatus(200).addHeader(Header_Id::Content_Type, "text/plain; version=0.0.4")
+                    .addBody(metrics).build();
+        };
+    }
+}
+
+/**
+*  Creates a listening socket bound to the given port, one that other sockets can share the port with
+*  if reuse_port is set.
+*/
+std::unique_ptr<Socket> Server::listenOn(const char *port, bool reuse_port) {
     struct addrinfo *result = NULL, *ptr = NULL, hints;
     ZeroMemory(&hints, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -34,8 +127,22 @@ Server::Server(const char *port, Handler handler) : handler(handler) {
         throw std::runtime_error(err_msg);
     }
 
-    ListenSocket_ = std::make_unique<Socket>(ListenSocket);
+    auto listen_socket = std::make_unique<Socket>(ListenSocket);
 
+#ifdef __linux__
+    // The reactors accept without blocking, and a restarted server must be able to rebind right away.
+    int one = 1;
+    setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // Every socket of a server sharing the port has to ask for it before binding.
+    if (reuse_port && setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        freeaddrinfo(result);
+        throw std::runtime_error("setsockopt SO_REUSEPORT failed: " + std::to_string(errno) + "\n");
+    }
+    if (!setNonBlocking(ListenSocket)) {
+        freeaddrinfo(result);
+        throw std::runtime_error("fcntl failed: " + std::to_string(errno) + "\n");
+    }
+#endif
 
     // Setup the TCP listening socket
     iResult = bind(ListenSocket, result->ai_addr, (int) result->ai_addrlen);
@@ -51,6 +158,7 @@ Server::Server(const char *port, Handler handler) : handler(handler) {
         std::string err_msg = "Listen failed with error: " + std::to_string(WSAGetLastError()) + "\n";
         throw std::runtime_error(err_msg);
     }
+    return listen_socket;
 }
 
 /**
@@ -72,11 +180,71 @@ std::unique_ptr<Socket> Server::acceptConnection() {
 * A blocking function call that administers the server to start listening and serving requests.
 */
 [[noreturn]] void Server::ListenAndServe() {
+#ifdef __linux__
+    // A fixed set of reactors serve every connection, so the thread count no longer grows with the clients.
+    std::vector<int> cpus = allowedCpus();
+    unsigned n_threads = options_.n_threads;
+    if (n_threads == 0) {
+        n_threads = unsigned(cpus.size());
+    }
+    // Without reuse_port all the loops accept from the same listening socket.
+    std::vector<SOCKET> listen_sockets(n_threads, ListenSocket_->getRawSocket());
+    std::vector<std::unique_ptr<Socket>> shard_sockets;
+    if (options_.reuse_port) {
+        for (unsigned i = 1; i < n_threads; i++) {
+            shard_sockets.push_back(listenOn(port_.c_str(), true));
+            listen_sockets[i] = shard_sockets.back()->getRawSocket();
+        }
+        steerByCpu(ListenSocket_->getRawSocket(), n_threads, cpus);
+    }
+    std::unique_ptr<Worker_Pool> workers;
+    if (options_.use_worker_pool) {
+        unsigned n_workers = options_.n_workers != 0 ? options_.n_workers : unsigned(cpus.size());
+        workers = std::make_unique<Worker_Pool>(n_workers, options_.max_queued_requests);
+    }
+    std::vector<std::unique_ptr<Server_Loop>> loops;
+    for (unsigned i = 0; i < n_threads; i++) {
+#ifdef HAVE_IO_URING
+        if (options_.backend == Server_Backend::IO_Uring && options_.tls) {
+            Err("io_uring does not speak TLS, serving with epoll instead");
+            options_.backend = Server_Backend::Epoll;
+        }
+        if (options_.backend == Server_Backend::IO_Uring) {
+            try {
+                loops.push_back(std::make_unique<Uring_Loop>(listen_sockets[i], handler, body_handler, options_,
+                                                             workers.get()));
+                continue;
+            } catch (std::runtime_error &e) {
+                Err("io_uring is unavailable, serving with epoll instead: %s", e.what());
+                options_.backend = Server_Backend::Epoll;
+            }
+        }
+#endif
+        loops.push_back(std::make_unique<Event_Loop>(listen_sockets[i], handler, body_handler, options_, workers.get()));
+    }
+    for (unsigned i = 1; i < n_threads; i++) {
+        std::thread thread(&Server_Loop::run, loops[i].get());
+        if (options_.reuse_port) {
+            pinThread(thread.native_handle(), cpus[i % cpus.size()]);
+        }
+        thread.detach();
+    }
+    if (options_.reuse_port) {
+        pinThread(pthread_self(), cpus[0]);
+    }
+    loops[0]->run();
+    // The compiler does not carry [[noreturn]] over to virtual calls.
+    __builtin_unreachable();
+#else
     while (true) {
         auto socket_ptr = acceptConnection();
+        if (!socket_ptr) {
+            continue;
+        }
         std::thread thread(&Server::serveConnection, this, std::move(socket_ptr));
         thread.detach();
     }
+#endif
 }
 
 /**
@@ -85,28 +253,77 @@ std::unique_ptr<Socket> Server::acceptConnection() {
 */
 void Server::serveConnection(std::unique_ptr<Socket> socket) {
     n_connections++;
+    Thread_Metrics &metrics = threadMetrics();
+    metrics.accepted.add();
+    if (options_.tls) {
+        if (!socket->startTls(options_.tls, options_.header_timeout_seconds)) {
+            metrics.tls_failed.add();
+            metrics.closed.add();
+            n_connections--;
+            return;
+        }
+        metrics.tls_handshakes.add();
+        if (socket->getTls()->resumed()) {
+            metrics.tls_resumed.add();
+        }
+        if (socket->getTls()->kernelSend()) {
+            metrics.tls_kernel_send.add();
+        }
+    }
+    socket->setMaxBodySize(options_.max_body_size);
+    // Requests and the responses built for them come from an arena reset after every batch, its blocks are
+    // kept in a pool of this thread and reused.
+    std::pmr::unsynchronized_pool_resource pool(std::pmr::pool_options{0, arena_pool_max_block});
+    std::pmr::monotonic_buffer_resource arena(arena_block_size, &pool);
+    socket->setMessageResource(&arena);
+    std::vector<HTTP<Type::Response>> batch;
+    // A blocking receive only knows a timeout per call, so the idle timeout bounds every receive.
+    int timeout = options_.idle_timeout_seconds;
     while (true) {
-        int timeout = total_timeout_seconds / n_connections;
-        auto req_str_opt = socket->receiveHTTP(timeout);
-        if (!req_str_opt) {
+        // Nothing of the previous batch is alive anymore.
+        batch.clear();
+        arena.release();
+        std::unique_ptr<Body_Sink> sink;
+        bool body_complete = true;
+        auto req_opt = body_handler ? socket->receiveRequest(body_handler, sink, body_complete, timeout)
+                                    : socket->receiveRequest(timeout);
+        if (!req_opt) {
             break;
         }
-        HTTP<Type::Request> req = read_request(*req_str_opt);
-        Debug("\n-------------------------\n %s \n-------------------------\n", req.to_string(false).c_str());
-        auto resp = handler(req);
-        bool success = socket->sendHTTP(resp.to_string());
+        if (sink) {
+            metrics.requests[std::size_t(requestMethod(req_opt->get_command()))].add();
+            // The body went to the sink, which answers the request. A rejected body leaves unread bytes behind.
+            if (!socket->sendHTTP(sink->finish()) || !body_complete) {
+                break;
+            }
+            continue;
+        }
+        // Answer the requests the client pipelined behind this one before writing anything.
+        do {
+            Debug("\n-------------------------\n %s \n-------------------------\n", req_opt->to_string(false).c_str());
+            metrics.requests[std::size_t(requestMethod(req_opt->get_command()))].add();
+            auto start = Metrics_Clock::now();
+            batch.push_back(handler(*req_opt));
+            auto duration = Metrics_Clock::now() - start;
+            metrics.handler_time.record(duration);
+            logAccess(req_opt->get_command(), req_opt->get_url(), batch.back().get_status(), batch.back().body_size(),
+                      duration);
+            metrics.countResponse(batch.back().get_status());
+        } while (batch.size() < max_pipeline_batch && (req_opt = socket->receiveBufferedRequest()));
+        bool success = socket->sendHTTP(batch);
         if (!success) {
             Err("failed to send HTTP response");
             break;
         }
     }
+    metrics.closed.add();
     n_connections--;
 }
 
 /**
  * Connects to the given addr and port and returns the socket associated with the connection.
  */
-std::unique_ptr<Socket> connectToServer(const char *addr, const char *port) {
+std::unique_ptr<Socket> connectToServer(const char *addr, const char *port, std::shared_ptr<Tls_Context> tls) {
     // Get address information.
     struct addrinfo *result = NULL,
             *ptr = NULL,
@@ -150,7 +367,15 @@ std::unique_ptr<Socket> connectToServer(const char *addr, const char *port) {
         Err("Unable to connect to the server %s with port %s", addr, port);
         return nullptr;
     }
-    return std::make_unique<Socket>(socket_);
+    // Messages go out in few large writes, so holding small ones back to coalesce them only delays pipelined requests.
+    int one = 1;
+    setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, (char *) &one, sizeof(one));
+    auto socket_ptr = std::make_unique<Socket>(socket_);
+    if (tls && !socket_ptr->startTls(std::move(tls), default_timeout, addr, std::string(addr) + ':' + port)) {
+        Err("TLS handshake with the server %s with port %s failed", addr, port);
+        return nullptr;
+    }
+    return socket_ptr;
 }
 
 /**
@@ -164,6 +389,9 @@ Socket::Socket(SOCKET socket) {
  * Destroys the underlying SOCKET (RAII).
  */
 Socket::~Socket() {
+    if (tls_) {
+        tls_->shutdown();
+    }
     closesocket(socket_);
 }
 
@@ -171,12 +399,167 @@ Socket::~Socket() {
  * A blocking send for HTTP messages.
  */
 bool Socket::sendHTTP(const std::string &req) {
-    int iResult = send(socket_, req.c_str(), (int) req.size(), 0);
-    if (iResult == SOCKET_ERROR) {
-        Err("send failed: %d", WSAGetLastError());
+    IO_Buffer buffer = makeIOBuffer(req.data(), req.size());
+    return sendAll(&buffer, 1);
+}
+
+/**
+ * A blocking send for HTTP requests, the head and the body go out in one gather write
+ * without copying the body.
+ */
+bool Socket::sendHTTP(const HTTP<Type::Request> &req) {
+    return sendMessage(req);
+}
+
+/**
+ * A blocking send for HTTP responses, the head and the body go out in one gather write
+ * without copying the body.
+ */
+bool Socket::sendHTTP(const HTTP<Type::Response> &resp) {
+    return sendMessage(resp);
+}
+
+/**
+ * A blocking send for a batch of HTTP responses, e.g. the answers to pipelined requests,
+ * which go out in as few gather writes as possible.
+ */
+bool Socket::sendHTTP(const std::vector<HTTP<Type::Response>> &batch) {
+    // Heads are serialized back to back into one buffer before any pointer into it is taken.
+    head_buff.clear();
+    std::vector<std::size_t> head_ends;
+    for (const auto &resp: batch) {
+        resp.write_head(head_buff);
+        head_ends.push_back(head_buff.size());
+    }
+    std::vector<IO_Buffer> buffers;
+    std::size_t head_begin = 0;
+    for (std::size_t i = 0; i < batch.size(); i++) {
+        buffers.push_back(makeIOBuffer(head_buff.data() + head_begin, head_ends[i] - head_begin));
+        head_begin = head_ends[i];
+        std::string_view body = batch[i].get_body();
+        if (!body.empty()) {
+            buffers.push_back(makeIOBuffer(body.data(), body.size()));
+        }
+        // A file or streamed body has to be sent on its own, so flush everything gathered before it.
+        const File_Range &file_body = batch[i].get_file_body();
+        const Body_Stream &stream_body = batch[i].get_stream_body();
+        if (file_body.length != 0 || stream_body) {
+            if (!sendAll(buffers.data(), (int) buffers.size(), true)) {
+                return false;
+            }
+            if (file_body.length != 0 ? !sendFile(file_body) : !sendStream(stream_body)) {
+                return false;
+            }
+            buffers.clear();
+        }
+    }
+    return buffers.empty() || sendAll(buffers.data(), (int) buffers.size());
+}
+
+/**
+ * Sends the serialized head in head_buff followed by the body, retrying partial writes.
+ */
+template<Type T>
+bool Socket::sendMessage(const HTTP<T> &msg) {
+    head_buff.clear();
+    msg.write_head(head_buff);
+    std::string_view body = msg.get_body();
+    const File_Range &file_body = msg.get_file_body();
+    const Body_Stream &stream_body = msg.get_stream_body();
+    std::array<IO_Buffer, 2> buffers{makeIOBuffer(head_buff.data(), head_buff.size()),
+                                     makeIOBuffer(body.data(), body.size())};
+    if (!sendAll(buffers.data(), body.empty() ? 1 : 2, file_body.length != 0 || stream_body)) {
         return false;
     }
-    Debug("Bytes Sent: %d", iResult);
+    if (stream_body) {
+        return sendStream(stream_body);
+    }
+    return file_body.length == 0 || sendFile(file_body);
+}
+
+/**
+ * Sends a streamed body with the chunked transfer coding, one piece at a time.
+ */
+bool Socket::sendStream(const Body_Stream &stream) {
+    std::string chunk;
+    bool done = false;
+    while (!done) {
+        std::size_t begin = write_chunk(stream, chunk, stream_chunk_size, done);
+        IO_Buffer buffer = makeIOBuffer(chunk.data() + begin, chunk.size() - begin);
+        if (ioBufferSize(buffer) != 0 && !sendAll(&buffer, 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sends a range of a file, from the page cache where the platform allows it.
+ */
+bool Socket::sendFile(const File_Range &range) {
+    std::uint64_t offset = range.offset, remaining = range.length;
+    while (remaining > 0) {
+#ifdef __linux__
+        ssize_t iResult;
+        if (tls_) {
+            iResult = tls_->sendFile(*range.file, offset, remaining);
+        } else {
+            off_t file_offset = off_t(offset);
+            iResult = sendfile(socket_, range.file->fd(), &file_offset, remaining);
+        }
+        if (iResult == -1 && errno == EINTR) {
+            continue;
+        }
+        if (iResult <= 0) {
+            Err("sendfile failed: %d", errno);
+            return false;
+        }
+#else
+        std::size_t block_size;
+        char *block = Buffer_Pool::acquire(std::min<std::uint64_t>(remaining, 1 << 16), block_size);
+        long iResult = range.file->read_at(block, std::min<std::uint64_t>(remaining, block_size), offset);
+        // Without sendfile the file goes through user space anyway, TLS then encrypts it in sendAll.
+        IO_Buffer buffer = makeIOBuffer(block, iResult > 0 ? iResult : 0);
+        bool success = iResult > 0 && sendAll(&buffer, 1);
+        Buffer_Pool::release(block, block_size);
+        if (!success) {
+            Err("failed to send file: %d", WSAGetLastError());
+            return false;
+        }
+#endif
+        offset += iResult;
+        remaining -= iResult;
+    }
+    return true;
+}
+
+/**
+ * Sends all the buffers, retrying partial writes until everything is sent.
+ */
+bool Socket::sendAll(IO_Buffer *buffers, int count, bool more) {
+    while (count > 0) {
+        long iResult = tls_ ? tls_->write(buffers, count) : sendBuffers(socket_, buffers, count, more);
+        if (iResult == SOCKET_ERROR) {
+#ifndef _WIN32
+            if (errno == EINTR) {
+                continue;
+            }
+#endif
+            Err("send failed: %d", WSAGetLastError());
+            return false;
+        }
+        Debug("Bytes Sent: %ld", iResult);
+        // Skip the buffers that went out completely and resume from the middle of the partially sent one.
+        std::size_t sent = iResult;
+        while (count > 0 && sent >= ioBufferSize(*buffers)) {
+            sent -= ioBufferSize(*buffers);
+            buffers++;
+            count--;
+        }
+        if (count > 0) {
+            consumeIOBuffer(*buffers, sent);
+        }
+    }
     return true;
 }
 
@@ -185,64 +568,231 @@ bool Socket::sendHTTP(const std::string &req) {
  * with a timeout.
  */
 std::optional<std::string> Socket::receiveHTTP(int timeout_seconds) {
-    std::string received;
-    DWORD timeout = timeout_seconds * 1000;
-    setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout));
-    int iResult, content_length = 0, total_size = 0;
-    bool header_ended = false;
-    do {
-        if(!prev_buff.empty()){
-            received += prev_buff;
-            prev_buff.clear();
-        }else {
-            iResult = recv(socket_, buff, buffer_size, 0);
-            if (iResult > 0) {
-                Debug("Bytes received: %d", iResult);
-                for (int i = 0; i < iResult; i++) {
-                    received += buff[i];
-                }
-            } else if (iResult == -1 || iResult == 0) {
-                Debug("Connection closed");
-                return std::nullopt;
-            } else {
-                Err("recv failed: ", WSAGetLastError());
+    HTTP_Parser parser;
+    if (!receiveMessage(parser, timeout_seconds)) {
+        return std::nullopt;
+    }
+    std::string msg(recv_buff.data().substr(0, parser.message_size()));
+    recv_buff.consume(parser.message_size());
+    return msg;
+}
+
+/**
+ * Optionally returns a HTTP request using a blocking receive with a timeout.
+ */
+std::optional<HTTP<Type::Request>> Socket::receiveRequest(int timeout_seconds) {
+    HTTP_Parser parser;
+    if (!receiveMessage(parser, timeout_seconds)) {
+        return std::nullopt;
+    }
+    auto req = read_request(parser, message_resource_);
+    recv_buff.consume(parser.message_size());
+    return req;
+}
+
+/**
+ * Optionally returns a HTTP response using a blocking receive with a timeout.
+ */
+std::optional<HTTP<Type::Response>> Socket::receiveResponse(int timeout_seconds) {
+    HTTP_Parser parser;
+    if (!receiveMessage(parser, timeout_seconds)) {
+        return std::nullopt;
+    }
+    auto resp = read_response(parser, message_resource_);
+    recv_buff.consume(parser.message_size());
+    return resp;
+}
+
+/**
+ * Receives a request like receiveRequest(), but once the head of a request with a body has arrived asks the
+ * body handler for a sink. If it returns one, the body is handed to the sink piece by piece as it arrives
+ * instead of being buffered and the returned request comes without it. body_complete is false if the sink
+ * rejected the body, whose rest is then left unread.
+ */
+std::optional<HTTP<Type::Request>> Socket::receiveRequest(const Body_Handler &body_handler,
+                                                          std::unique_ptr<Body_Sink> &sink, bool &body_complete,
+                                                          int timeout_seconds) {
+    HTTP_Parser parser;
+    body_complete = true;
+    if (!receiveMessage(parser, timeout_seconds, true)) {
+        return std::nullopt;
+    }
+    if (parser.has_body()) {
+        auto head = read_request_head(parser, message_resource_);
+        sink = body_handler(head);
+        if (sink) {
+            Body_Decoder body = parser.body_decoder();
+            recv_buff.consume(parser.header_size());
+            if (!receiveBody(body, *sink, body_complete)) {
                 return std::nullopt;
             }
+            return head;
         }
-        if (!header_ended) {
-            int idx = received.find("\r\n\r\n", received.size() - iResult);
-            // HTTP Header ended.
-            if (idx != std::string::npos) {
-                Type t = message_type(received);
-                if (t == Type::Request) {
-                    auto req = read_request(received);
-                    if (req.has_header("Content-Length")) {
-                        content_length = std::stoi(req.get_header("Content-Length"));
-                    }
-                } else {
-                    auto req = read_response(received);
-                    if (req.has_header("Content-Length")) {
-                        content_length = std::stoi(req.get_header("Content-Length"));
-                    }
-                }
-                total_size = content_length + idx + 4;
-                // Subtract already received content
-                content_length -= received.size() - (idx + 4);
-                if (content_length <= 0) {
-                    break;
-                }
-                header_ended = true;
-            }
+    }
+    // The parser resumes after the head it already parsed.
+    if (!receiveMessage(parser, timeout_seconds)) {
+        return std::nullopt;
+    }
+    auto req = read_request(parser, message_resource_);
+    recv_buff.consume(parser.message_size());
+    return req;
+}
+
+/**
+ * Receives the body following a consumed head and hands it to the sink piece by piece as it arrives.
+ * Returns false if the connection was closed, timed out or sent a malformed body, complete is false
+ * if the sink rejected the body.
+ */
+bool Socket::receiveBody(Body_Decoder &body, Body_Sink &sink, bool &complete) {
+    std::uint64_t body_received = 0;
+    while (true) {
+        std::size_t consumed;
+        complete = true;
+        Parse_Status status = body.decode_all(recv_buff.data(), consumed, [&](std::string_view data) {
+            body_received += data.size();
+            return complete = body_received <= max_body_size_ && sink.write(data);
+        });
+        recv_buff.consume(consumed);
+        if (status == Parse_Status::Error) {
+            Err("received a malformed HTTP body");
+            return false;
+        }
+        if (body_received > max_body_size_) {
+            Err("received a HTTP body larger than %llu bytes", (unsigned long long) max_body_size_);
+            return false;
+        }
+        if (status == Parse_Status::Complete || !complete) {
+            return true;
+        }
+        auto [space, space_size] = recv_buff.prepare(stream_receive_size);
+        long iResult = receive(space, space_size);
+        if (iResult <= 0) {
+            Debug("Connection closed");
+            return false;
+        }
+        Debug("Bytes received: %ld", iResult);
+        recv_buff.commit(iResult);
+    }
+}
+
+/**
+ * Returns the next request only if it was already received completely, e.g. pipelined behind
+ * the previous one, without blocking.
+ */
+std::optional<HTTP<Type::Request>> Socket::receiveBufferedRequest() {
+    HTTP_Parser parser;
+    if (parser.parse(recv_buff.data()) != Parse_Status::Complete) {
+        return std::nullopt;
+    }
+    auto req = read_request(parser, message_resource_);
+    recv_buff.consume(parser.message_size());
+    return req;
+}
+
+/**
+ * Receives bytes until the parser frames a complete message, or only its head, at the front of recv_buff.
+ * Returns false if the connection was closed, timed out or sent a malformed message.
+ */
+bool Socket::receiveMessage(HTTP_Parser &parser, int timeout_seconds, bool head_only) {
+    // Receives on a connection mostly share the timeout, so it only costs a system call when it changes.
+    if (timeout_seconds != receive_timeout_) {
+        setReceiveTimeout(socket_, timeout_seconds);
+        receive_timeout_ = timeout_seconds;
+    }
+    auto parse = [&]() {
+        Parse_Status status = head_only ? parser.parse_head(recv_buff.data()) : parser.parse(recv_buff.data());
+        // A body over the limit is refused as soon as its size is announced or exceeded.
+        if (status != Parse_Status::Error &&
+            std::max<std::uint64_t>(parser.content_length(), parser.get_body().size()) > max_body_size_) {
+            Err("received a HTTP body larger than %llu bytes", (unsigned long long) max_body_size_);
+            return Parse_Status::Error;
+        }
+        return status;
+    };
+    // A previous receive may have left a whole pipelined message behind.
+    Parse_Status status = parse();
+    while (status == Parse_Status::Incomplete) {
+        std::size_t min_size = Buffer_Pool::min_block_size;
+        if (parser.header_size() != 0 && parser.message_size() > recv_buff.data().size()) {
+            // The head tells how much is left, so receive the rest of the body in as few calls as possible.
+            min_size = std::clamp<std::size_t>(parser.message_size() - recv_buff.data().size(),
+                                               min_size, Buffer_Pool::max_pooled_size);
+        }
+        auto [space, space_size] = recv_buff.prepare(min_size);
+        long iResult = receive(space, space_size);
+        if (iResult > 0) {
+            Debug("Bytes received: %ld", iResult);
+            recv_buff.commit(iResult);
+            status = parse();
+        } else if (iResult == -1 || iResult == 0) {
+            Debug("Connection closed");
+            return false;
         } else {
-            content_length -= std::min(content_length, iResult);
-            if (content_length <= 0) {
-                break;
-            }
+            Err("recv failed: %d", WSAGetLastError());
+            return false;
         }
-    } while (iResult > 0);
-    prev_buff = received.substr(total_size);
-    received.resize(total_size);
-    return received;
+    }
+    if (status == Parse_Status::Error) {
+        Err("received a malformed HTTP message");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Receives into the buffer, through TLS if the connection speaks it, with the conventions of recv.
+ */
+long Socket::receive(char *buff, std::size_t size) {
+    if (tls_) {
+        return tls_->read(buff, size);
+    }
+    return recv(socket_, buff, (int) size, 0);
+}
+
+/**
+ * Runs the TLS handshake on the connection as the side the context is for, with a timeout. A client names the
+ * server for SNI and verification and resumes the last session with peer. From then on everything sent and
+ * received is encrypted. Returns false if the handshake failed, the connection is unusable then.
+ */
+bool Socket::startTls(std::shared_ptr<Tls_Context> context, int timeout_seconds, const std::string &host,
+                      const std::string &peer) {
+    if (timeout_seconds != receive_timeout_) {
+        setReceiveTimeout(socket_, timeout_seconds);
+        receive_timeout_ = timeout_seconds;
+    }
+    try {
+        tls_ = std::make_unique<Tls_Session>(std::move(context), socket_, host, peer);
+    } catch (const std::runtime_error &e) {
+        Err("%s", e.what());
+        return false;
+    }
+    // The socket blocks, so the handshake either completes or fails, timing out as a failure.
+    if (tls_->handshake() != Handshake_Status::Done) {
+        Debug("TLS handshake failed");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the TLS state of the connection, nullptr if it is plaintext.
+ */
+const Tls_Session *Socket::getTls() const {
+    return tls_.get();
+}
+
+/**
+ * Limits the size of the bodies received from now on, a larger one fails the receive.
+ */
+void Socket::setMaxBodySize(std::uint64_t max_body_size) {
+    max_body_size_ = max_body_size;
+}
+
+/**
+ * Allocates the messages received from now on from the given memory resource, which has to outlive them.
+ */
+void Socket::setMessageResource(std::pmr::memory_resource *resource) {
+    message_resource_ = resource;
 }
 
 /**
@@ -258,9 +808,12 @@ SOCKET Socket::getRawSocket() {
 bool Socket::shutdownSender() {
     // shutdown the connection for sending since no more data will be sent
     // the client can still use the ConnectSocket for receiving data
+    if (tls_) {
+        tls_->shutdown();
+    }
     int iResult = shutdown(socket_, SD_SEND);
     if (iResult == SOCKET_ERROR) {
-        Err("shutdown failed: ", WSAGetLastError());
+        Err("shutdown failed: %d", WSAGetLastError());
         closesocket(socket_);
         return false;
     }
@@ -1,19 +1,61 @@
 #ifndef NETWORKING_H_INCLUDED
 #define NETWORKING_H_INCLUDED
 
-#define _WINNT_WIN32 0x0601
-
-#include "Http.h"
-#include <ws2tcpip.h>
-#include <winsock2.h>
+#include "http.h"
+#include "http_parser.h"
+#include "buffer.h"
+#include "platform.h"
+#include "tls.h"
 #include <functional>
+#include <optional>
 #include <atomic>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <array>
 #include <memory>
+#include <memory_resource>
 
 // Relatively high value
 constexpr int default_timeout = 1000;
+// Pipelined requests a server answers before their responses have to be flushed.
+constexpr std::size_t max_pipeline_batch = 32;
+// Largest piece a streamed body is asked for at a time, which bounds the output buffered for it.
+constexpr std::size_t stream_chunk_size = 1 << 16;
+// Free space requested for every receive of a streamed body.
+constexpr std::size_t stream_receive_size = 1 << 18;
+// First block of the arena of a connection, enough for the messages of a typical request.
+constexpr std::size_t arena_block_size = 4096;
+// Largest arena block a thread keeps for reuse instead of returning it to the heap.
+constexpr std::size_t arena_pool_max_block = 1 << 20;
+
+/**
+ * Receives the body of a request piece by piece as it arrives, so it never has to be held in memory as
+ * a whole, and answers the request once the body is complete.
+ */
+class Body_Sink
+{
+public:
+    virtual ~Body_Sink() = default;
+
+    /**
+     * Consumes the next piece of the body. Returning false rejects the rest of it, the request is then
+     * answered right away and the connection closed after the answer.
+     */
+    virtual bool write(std::string_view data) = 0;
+
+    /**
+     * Returns the answer to the request, called once the whole body arrived or write() rejected it.
+     */
+    virtual HTTP<Type::Response> finish() = 0;
+};
+
+/**
+ * Decides once the head of a request with a body has arrived whether the body is streamed: returns the sink
+ * receiving it, or nullptr to receive the body as a whole and answer the request with the regular handler.
+ */
+using Body_Handler = std::function<std::unique_ptr<Body_Sink>(const HTTP<Type::Request> &head)>;
 
 /**
  * A Wrapper class for the raw socket supplied by winsock to extend functionality.
@@ -38,11 +80,78 @@ public:
      */
     std::optional<std::string> receiveHTTP(int timeout_seconds = default_timeout);
 
+    /**
+     * Optionally returns a HTTP request using a blocking receive with a timeout.
+     */
+    std::optional<HTTP<Type::Request>> receiveRequest(int timeout_seconds = default_timeout);
+
+    /**
+     * Optionally returns a HTTP response using a blocking receive with a timeout.
+     */
+    std::optional<HTTP<Type::Response>> receiveResponse(int timeout_seconds = default_timeout);
+
+    /**
+     * Receives a request like receiveRequest(), but once the head of a request with a body has arrived asks the
+     * body handler for a sink. If it returns one, the body is handed to the sink piece by piece as it arrives
+     * instead of being buffered and the returned request comes without it. body_complete is false if the sink
+     * rejected the body, whose rest is then left unread.
+     */
+    std::optional<HTTP<Type::Request>> receiveRequest(const Body_Handler &body_handler,
+                                                      std::unique_ptr<Body_Sink> &sink, bool &body_complete,
+                                                      int timeout_seconds = default_timeout);
+
+    /**
+     * Returns the next request only if it was already received completely, e.g. pipelined behind
+     * the previous one, without blocking.
+     */
+    std::optional<HTTP<Type::Request>> receiveBufferedRequest();
+
     /**
      * A blocking send for HTTP messages.
      */
     bool sendHTTP(const std::string& req);
 
+    /**
+     * A blocking send for HTTP requests, the head and the body go out in one gather write
+     * without copying the body.
+     */
+    bool sendHTTP(const HTTP<Type::Request>& req);
+
+    /**
+     * A blocking send for HTTP responses, the head and the body go out in one gather write
+     * without copying the body.
+     */
+    bool sendHTTP(const HTTP<Type::Response>& resp);
+
+    /**
+     * A blocking send for a batch of HTTP responses, e.g. the answers to pipelined requests,
+     * which go out in as few gather writes as possible.
+     */
+    bool sendHTTP(const std::vector<HTTP<Type::Response>>& batch);
+
+    /**
+     * Limits the size of the bodies received from now on, a larger one fails the receive.
+     */
+    void setMaxBodySize(std::uint64_t max_body_size);
+
+    /**
+     * Allocates the messages received from now on from the given memory resource, which has to outlive them.
+     */
+    void setMessageResource(std::pmr::memory_resource *resource);
+
+    /**
+     * Runs the TLS handshake on the connection as the side the context is for, with a timeout. A client names the
+     * server for SNI and verification and resumes the last session with peer. From then on everything sent and
+     * received is encrypted. Returns false if the handshake failed, the connection is unusable then.
+     */
+    bool startTls(std::shared_ptr<Tls_Context> context, int timeout_seconds = default_timeout,
+                  const std::string &host = "", const std::string &peer = "");
+
+    /**
+     * Returns the TLS state of the connection, nullptr if it is plaintext.
+     */
+    const Tls_Session *getTls() const;
+
     /**
      * Shutdown sending for this socket.
      */
@@ -53,18 +162,113 @@ public:
      */
     SOCKET getRawSocket();
 private:
+    /**
+     * Receives bytes until the parser frames a complete message, or only its head, at the front of recv_buff.
+     * Returns false if the connection was closed, timed out or sent a malformed message.
+     */
+    bool receiveMessage(HTTP_Parser &parser, int timeout_seconds, bool head_only = false);
+
+    /**
+     * Receives the body following a consumed head and hands it to the sink piece by piece as it arrives.
+     * Returns false if the connection was closed, timed out or sent a malformed body, complete is false
+     * if the sink rejected the body.
+     */
+    bool receiveBody(Body_Decoder &body, Body_Sink &sink, bool &complete);
+
+    /**
+     * Receives into the buffer, through TLS if the connection speaks it, with the conventions of recv.
+     */
+    long receive(char *buff, std::size_t size);
+
+    /**
+     * Sends the serialized head in head_buff followed by the body, retrying partial writes.
+     */
+    template<Type T>
+    bool sendMessage(const HTTP<T> &msg);
+
+    /**
+     * Sends all the buffers, retrying partial writes until everything is sent.
+     */
+    bool sendAll(IO_Buffer *buffers, int count, bool more = false);
+
+    /**
+     * Sends a range of a file, from the page cache where the platform allows it.
+     */
+    bool sendFile(const File_Range &range);
+
+    /**
+     * Sends a streamed body with the chunked transfer coding, one piece at a time.
+     */
+    bool sendStream(const Body_Stream &stream);
+
     SOCKET socket_;
-    static constexpr int buffer_size = 1 << 16;
-    // Buffer used to receive data.
-    char buff[buffer_size];
-    // Has previous buffer of the previous request.
-    std::string prev_buff;
+    // Received bytes not consumed yet, including those of the next pipelined message.
+    Recv_Buffer recv_buff;
+    // Reused for serializing the head of every sent message.
+    std::string head_buff;
+    std::uint64_t max_body_size_ = UINT64_MAX;
+    std::pmr::memory_resource *message_resource_ = std::pmr::get_default_resource();
+    // Timeout last set on the socket, 0 is the default of none.
+    int receive_timeout_ = 0;
+    // Encrypts the connection once startTls succeeded.
+    std::unique_ptr<Tls_Session> tls_;
 };
 
 /**
- * Connects to the given addr and port and returns the socket associated with the connection.
+ * Connects to the given addr and port and returns the socket associated with the connection, nullptr if that
+ * fails. With a client TLS context the connection is encrypted, resuming the last session with the server.
  */
-std::unique_ptr<Socket> connectToServer(const char* addr, const char* port);
+std::unique_ptr<Socket> connectToServer(const char* addr, const char* port,
+                                        std::shared_ptr<Tls_Context> tls = nullptr);
+
+/**
+ * How a Server does the I/O of its connections on Linux. Elsewhere every connection is served on a thread of its
+ * own with blocking calls.
+ */
+enum class Server_Backend
+{
+    // Every thread runs a loop waiting for readiness with epoll and doing the I/O itself.
+    Epoll,
+    // Every thread runs a loop handing the I/O to an io_uring and waiting for its completions. Falls back to
+    // Epoll where the kernel does not support io_uring or a feature the loop relies on.
+    IO_Uring
+};
+
+/**
+ * Tunables of a Server, all of them have sensible defaults.
+ */
+struct Server_Options
+{
+    // Number of threads serving connections, 0 means one per CPU the process may run on.
+    unsigned n_threads = 0;
+    // Seconds an idle keep-alive connection is kept open, and the longest a client may take to read a response.
+    int idle_timeout_seconds = 50;
+    // Seconds a client may take to send the head of a request, counted from its first byte, or from the accept for
+    // the first request of a connection.
+    int header_timeout_seconds = 10;
+    // Seconds a client may pause while sending the body of a request.
+    int body_timeout_seconds = 30;
+    // Largest request body accepted, streamed or not. Larger ones are refused with 413 Payload Too Large.
+    std::uint64_t max_body_size = std::uint64_t(1) << 30;
+    Server_Backend backend = Server_Backend::Epoll;
+    // Gives every thread a listening socket of its own sharing the port through SO_REUSEPORT and pins the
+    // thread to a CPU. The kernel then spreads new connections over the threads, which share no accept queue
+    // and keep each of their connections to themselves. Linux only.
+    bool reuse_port = false;
+    // Runs the handler on a pool of worker threads shared by the loops instead of on the loops themselves, so a
+    // slow handler does not hold up the other connections of its loop. Linux only.
+    bool use_worker_pool = true;
+    // Number of worker threads, 0 means one per CPU the process may run on.
+    unsigned n_workers = 0;
+    // Most requests waiting for a free worker, further ones are answered with 503 Service Unavailable.
+    std::size_t max_queued_requests = 1024;
+    // Path a GET of which is answered with the metrics of the server in the Prometheus text format instead of
+    // by the handler, empty to leave every request to the handler.
+    std::string metrics_path = "/metrics";
+    // Serves HTTPS with this server context instead of plaintext HTTP, see Tls_Context. The handshake has to be
+    // done within the header timeout. The io_uring backend does not speak TLS, epoll serves instead.
+    std::shared_ptr<Tls_Context> tls;
+};
 
 /**
  * Server class to listen to a specific port that handles multiple connections and HTTP requests concurrently
@@ -78,13 +282,25 @@ public:
     /**
      * Creates a server with the specified port and the customized handler.
      */
-    Server(const char *port, Handler handler);
+    Server(const char *port, Handler handler, Server_Options options = {});
+
+    /**
+     * Creates a server with the specified port and the customized handler, whose requests may have their
+     * body streamed to a sink chosen by the body handler.
+     */
+    Server(const char *port, Handler handler, Body_Handler body_handler, Server_Options options = {});
 
     /**
      * A blocking function call that administers the server to start listening and serving requests.
      */
     [[noreturn]] [[noreturn]] void ListenAndServe();
 private:
+    /**
+     *  Creates a listening socket bound to the given port, one that other sockets can share the port with
+     *  if reuse_port is set.
+     */
+    static std::unique_ptr<Socket> listenOn(const char *port, bool reuse_port);
+
     /**
      *  A blocking function call that waits for connections and then returns
      *  the socket associated with that connection.
@@ -99,6 +315,11 @@ private:
     std::unique_ptr<Socket> ListenSocket_;
     // Customized handler initialized with the server to serve requests.
     Handler handler;
+    // Chooses the requests whose body is streamed, may be empty.
+    Body_Handler body_handler;
+    Server_Options options_;
+    // Kept for opening the listening sockets of the other threads in reuse_port mode.
+    std::string port_;
     // Number of open connections.
     std::atomic<int> n_connections{0};
 };
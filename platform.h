@@ -0,0 +1,157 @@
+#ifndef PLATFORM_H_INCLUDED
+#define PLATFORM_H_INCLUDED
+
+/**
+ * Thin portability layer so the networking code can keep using the winsock vocabulary
+ * (SOCKET, closesocket, WSAGetLastError, ...) on both Windows and POSIX systems.
+ * */
+
+#include <cstddef>
+
+#ifdef _WIN32
+
+#define _WINNT_WIN32 0x0601
+
+#include <ws2tcpip.h>
+#include <winsock2.h>
+
+/**
+ * Sets the timeout of blocking receives on the given socket.
+ * */
+inline void setReceiveTimeout(SOCKET socket, int timeout_seconds) {
+    DWORD timeout = timeout_seconds * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout));
+}
+
+using IO_Buffer = WSABUF;
+
+inline IO_Buffer makeIOBuffer(const char *data, std::size_t size) {
+    IO_Buffer buffer;
+    buffer.buf = const_cast<char *>(data);
+    buffer.len = (ULONG) size;
+    return buffer;
+}
+
+inline const char *ioBufferData(const IO_Buffer &buffer) {
+    return buffer.buf;
+}
+
+inline std::size_t ioBufferSize(const IO_Buffer &buffer) {
+    return buffer.len;
+}
+
+inline void consumeIOBuffer(IO_Buffer &buffer, std::size_t size) {
+    buffer.buf += size;
+    buffer.len -= (ULONG) size;
+}
+
+/**
+ * Sends the buffers with one gather write, returns the number of bytes sent or SOCKET_ERROR.
+ * The hint that more data follows is not available on Windows.
+ * */
+inline long sendBuffers(SOCKET socket, IO_Buffer *buffers, int count, bool more = false) {
+    DWORD sent = 0;
+    if (WSASend(socket, buffers, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    return (long) sent;
+}
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+
+using SOCKET = int;
+using DWORD = unsigned long;
+using WORD = unsigned short;
+
+constexpr SOCKET INVALID_SOCKET = -1;
+constexpr int SOCKET_ERROR = -1;
+constexpr int SD_SEND = SHUT_WR;
+
+#define MAKEWORD(a, b) ((WORD) (((a) & 0xff) | (((b) & 0xff) << 8)))
+#define ZeroMemory(ptr, size) std::memset((ptr), 0, (size))
+
+struct WSADATA {};
+
+/**
+ * POSIX sockets need no library initialization, but a peer closing its end must not kill
+ * the process with SIGPIPE the way it would by default.
+ * */
+inline int WSAStartup(WORD, WSADATA *) {
+    std::signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+inline int WSACleanup() {
+    return 0;
+}
+
+inline int WSAGetLastError() {
+    return errno;
+}
+
+inline int closesocket(SOCKET socket) {
+    return close(socket);
+}
+
+/**
+ * Sets the timeout of blocking receives on the given socket.
+ * */
+inline void setReceiveTimeout(SOCKET socket, int timeout_seconds) {
+    struct timeval timeout{};
+    timeout.tv_sec = timeout_seconds;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+using IO_Buffer = struct iovec;
+
+inline IO_Buffer makeIOBuffer(const char *data, std::size_t size) {
+    return {const_cast<char *>(data), size};
+}
+
+inline const char *ioBufferData(const IO_Buffer &buffer) {
+    return static_cast<const char *>(buffer.iov_base);
+}
+
+inline std::size_t ioBufferSize(const IO_Buffer &buffer) {
+    return buffer.iov_len;
+}
+
+inline void consumeIOBuffer(IO_Buffer &buffer, std::size_t size) {
+    buffer.iov_base = static_cast<char *>(buffer.iov_base) + size;
+    buffer.iov_len -= size;
+}
+
+/**
+ * Sends the buffers with one gather write, returns the number of bytes sent or SOCKET_ERROR.
+ * If more is set, the kernel may hold back a partial segment because more data follows right away.
+ * */
+inline long sendBuffers(SOCKET socket, IO_Buffer *buffers, int count, bool more = false) {
+    struct msghdr msg{};
+    msg.msg_iov = buffers;
+    msg.msg_iovlen = count;
+    return sendmsg(socket, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+}
+
+/**
+ * Switches the given socket to non-blocking mode.
+ * */
+inline bool setNonBlocking(SOCKET socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags != -1 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+#endif
+
+#endif // PLATFORM_H_INCLUDED
@@ -0,0 +1,225 @@
+#include "router.h"
+#include <stdexcept>
+#include <algorithm>
+
+struct Router::Node
+{
+    // Bytes of the path the edge into a static node matches.
+    std::string label;
+    // Static children, their labels start with distinct bytes.
+    std::vector<std::unique_ptr<Node>> children;
+    // Matches one non-empty segment, and the rest of the path.
+    std::unique_ptr<Node> param;
+    std::unique_ptr<Node> wildcard;
+    // Name a parameter or wildcard node captures its match as.
+    std::string name;
+    std::vector<Route> routes;
+};
+
+Router::Router() : root_(std::make_unique<Node>()) {
+    setNotFound(nullptr);
+}
+
+Router::Router(Router &&) noexcept = default;
+
+Router &Router::operator=(Router &&) noexcept = default;
+
+Router::~Router() = default;
+
+/**
+ * Registers the handler for requests of the given method whose path matches the pattern. Throws
+ * std::invalid_argument if the pattern is malformed, conflicts with the parameter names of another one or
+ * is already registered for the method.
+ */
+Router &Router::addRoute(std::string_view method, std::string_view pattern, Handler handler) {
+    return addRoute(method, pattern, std::move(handler), nullptr);
+}
+
+/**
+ * Registers a route like addRoute() whose request bodies are streamed to the sink the stream handler returns.
+ * The handler answers the requests without a body and those whose body the stream handler leaves to be
+ * received as a whole by returning nullptr.
+ */
+Router &Router::addRoute(std::string_view method, std::string_view pattern, Handler handler,
+                         Stream_Handler stream_handler) {
+    if (pattern.empty() || pattern[0] != '/') {
+        throw std::invalid_argument("route pattern must start with /: " + std::string(pattern));
+    }
+    std::size_t params = 0;
+    for (std::size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] != ':' && pattern[i] != '*') {
+            continue;
+        }
+        std::size_t end = std::min(pattern.find('/', i), pattern.size());
+        if (pattern[i - 1] != '/' || end == i + 1 || (pattern[i] == '*' && end != pattern.size())) {
+            throw std::invalid_argument("malformed route pattern: " + std::string(pattern));
+        }
+        params++;
+    }
+    if (params > Route_Params::max_params) {
+        throw std::invalid_argument("too many parameters in route pattern: " + std::string(pattern));
+    }
+    Route route{std::string(method), std::move(handler), std::move(stream_handler)};
+    insert(*root_, pattern, route);
+    return *this;
+}
+
+/**
+ * Replaces the handler of the requests matching no route, which answers 404 Not Found by default.
+ */
+Router &Router::setNotFound(Handler handler) {
+    if (!handler) {
+        handler = [](const HTTP<Type::Request> &req, const Route_Params &) {
+            return HTTP_Builder<Type::Response>(req.get_resource()).setStatus(404).build();
+        };
+    }
+    not_found_ = std::move(handler);
+    return *this;
+}
+
+/**
+ *  Adds the rest of a pattern below the node, whose edge already matched everything before it.
+ */
+void Router::insert(Node &node, std::string_view pattern, Route &route) {
+    if (pattern.empty()) {
+        for (auto &existing: node.routes) {
+            if (existing.method == route.method) {
+                throw std::invalid_argument("route registered twice for " + route.method);
+            }
+        }
+        node.routes.push_back(std::move(route));
+        return;
+    }
+    if (pattern[0] == ':' || pattern[0] == '*') {
+        std::size_t end = std::min(pattern.find('/'), pattern.size());
+        std::string_view name = pattern.substr(1, end - 1);
+        auto &child = pattern[0] == ':' ? node.param : node.wildcard;
+        if (!child) {
+            child = std::make_unique<Node>();
+            child->name = std::string(name);
+        } else if (child->name != name) {
+            throw std::invalid_argument("route parameter " + std::string(name) + " conflicts with " + child->name);
+        }
+        insert(*child, pattern.substr(end), route);
+        return;
+    }
+    std::size_t end = std::min(pattern.find_first_of(":*"), pattern.size());
+    insertStatic(node, pattern.substr(0, end), pattern.substr(end), route);
+}
+
+/**
+ *  Adds the static run at the front of a pattern below the node, splitting an edge sharing a prefix with it.
+ */
+void Router::insertStatic(Node &node, std::string_view run, std::string_view rest, Route &route) {
+    auto it = std::find_if(node.children.begin(), node.children.end(), [&](const std::unique_ptr<Node> &child) {
+        return child->label[0] == run[0];
+    });
+    if (it == node.children.end()) {
+        auto child = std::make_unique<Node>();
+        child->label = std::string(run);
+        Node &added = *child;
+        node.children.push_back(std::move(child));
+        insert(added, rest, route);
+        return;
+    }
+    Node &child = **it;
+    auto common = std::size_t(std::mismatch(run.begin(), run.end(), child.label.begin(), child.label.end()).first -
+                              run.begin());
+    if (common < child.label.size()) {
+        // The edge splits where the run leaves it, the old node continues below the new one.
+        auto split = std::make_unique<Node>();
+        split->label = child.label.substr(0, common);
+        child.label.erase(0, common);
+        split->children.push_back(std::move(*it));
+        *it = std::move(split);
+    }
+    Node &next = **it;
+    if (common == run.size()) {
+        insert(next, rest, route);
+    } else {
+        insertStatic(next, run.substr(common), rest, route);
+    }
+}
+
+/**
+ *  Finds the node whose routes match the rest of the path, capturing the parameters on the way. A static edge
+ *  is tried first, then a parameter, then a wildcard, backtracking to the next if the deeper match fails.
+ */
+const Router::Node *Router::match(const Node &node, std::string_view path, Route_Params &params) {
+    if (path.empty() && !node.routes.empty()) {
+        return &node;
+    }
+    if (!path.empty()) {
+        for (const auto &child: node.children) {
+            if (child->label[0] != path[0]) {
+                continue;
+            }
+            if (path.compare(0, child->label.size(), child->label) == 0) {
+                if (const Node *found = match(*child, path.substr(child->label.size()), params)) {
+                    return found;
+                }
+            }
+            break;
+        }
+        if (node.param) {
+            std::string_view segment = path.substr(0, path.find('/'));
+            if (!segment.empty()) {
+                std::size_t size = params.size_;
+                params.params_[params.size_++] = {node.param->name, segment};
+                if (const Node *found = match(*node.param, path.substr(segment.size()), params)) {
+                    return found;
+                }
+                params.size_ = size;
+            }
+        }
+    }
+    if (node.wildcard) {
+        params.params_[params.size_++] = {node.wildcard->name, path};
+        return node.wildcard.get();
+    }
+    return nullptr;
+}
+
+/**
+ * Answers the request with the handler of the route its method and path match. The query is not part of
+ * the path.
+ */
+HTTP<Type::Response> Router::route(const HTTP<Type::Request> &req) const {
+    std::string_view url = req.get_url();
+    std::string_view path = url.substr(0, url.find('?'));
+    Route_Params params;
+    const Node *node = match(*root_, path, params);
+    if (!node) {
+        return not_found_(req, params);
+    }
+    for (const auto &route: node->routes) {
+        if (route.method == req.get_command()) {
+            return route.handler(req, params);
+        }
+    }
+    std::string allow;
+    for (const auto &route: node->routes) {
+        allow += allow.empty() ? "" : ", ";
+        allow += route.method;
+    }
+    return HTTP_Builder<Type::Response>(req.get_resource()).setStatus(405).addHeader("Allow", allow).build();
+}
+
+/**
+ * Returns the sink the body of the request whose head arrived is streamed to, chosen by the stream handler of
+ * the route it matches, or nullptr if that route has none and the body is received as a whole.
+ */
+std::unique_ptr<Body_Sink> Router::stream(const HTTP<Type::Request> &head) const {
+    std::string_view url = head.get_url();
+    Route_Params params;
+    const Node *node = match(*root_, url.substr(0, url.find('?')), params);
+    if (!node) {
+        return nullptr;
+    }
+    for (const auto &route: node->routes) {
+        if (route.method == head.get_command()) {
+            return route.stream_handler ? route.stream_handler(head, params) : nullptr;
+        }
+    }
+    return nullptr;
+}
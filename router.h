@@ -0,0 +1,139 @@
+#ifndef ROUTER_H_INCLUDED
+#define ROUTER_H_INCLUDED
+
+#include "http.h"
+#include "networking.h"
+#include <array>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * The parameters a route captured from the path of a request, slices of its URL.
+ */
+class Route_Params
+{
+public:
+    // Most parameters a route pattern may have.
+    static constexpr std::size_t max_params = 8;
+
+    /**
+     * Returns the value of the named parameter, or std::nullopt if the route has no such parameter.
+     */
+    std::optional<std::string_view> get(std::string_view name) const {
+        for (std::size_t i = 0; i < size_; i++) {
+            if (params_[i].first == name) {
+                return params_[i].second;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+private:
+    friend class Router;
+
+    std::array<std::pair<std::string_view, std::string_view>, max_params> params_;
+    std::size_t size_ = 0;
+};
+
+/**
+ * Dispatches requests to the handlers registered for their method and path.
+ *
+ * A pattern is a path of static segments, parameters and at most one trailing wildcard:
+ *   /api/users          matches that path only,
+ *   /api/users/:id      captures one non-empty segment as id,
+ *   /static/ *path      (written without the space) captures the rest of the path, possibly empty, as path,
+ *                       e.g. to mount a directory.
+ * The patterns are kept in a radix trie, whose static edges are compressed runs of bytes shared by the patterns,
+ * so a lookup walks the path once and backtracks only where a static edge and a parameter both match. A static
+ * edge wins over a parameter and a parameter over a wildcard. A lookup does not allocate, the captured parameters
+ * point into the URL. A path matching a route of other methods only is answered with 405 Method Not Allowed,
+ * one matching no route with the not found handler. A route may stream the bodies of its requests to a sink, which
+ * the server gets through stream() as its Body_Handler.
+ *
+ * Routes are added before the server starts, lookups may then run on any number of threads.
+ */
+class Router
+{
+public:
+    using Handler = std::function<HTTP<Type::Response>(const HTTP<Type::Request> &req, const Route_Params &params)>;
+    // Chooses the sink the body of a request is streamed to once its head arrived, see Body_Handler.
+    using Stream_Handler = std::function<std::unique_ptr<Body_Sink>(const HTTP<Type::Request> &head,
+                                                                    const Route_Params &params)>;
+
+    Router();
+    Router(Router &&) noexcept;
+    Router &operator=(Router &&) noexcept;
+    ~Router();
+
+    /**
+     * Registers the handler for requests of the given method whose path matches the pattern. Throws
+     * std::invalid_argument if the pattern is malformed, conflicts with the parameter names of another one or
+     * is already registered for the method.
+     */
+    Router &addRoute(std::string_view method, std::string_view pattern, Handler handler);
+
+    /**
+     * Registers a route like addRoute() whose request bodies are streamed to the sink the stream handler returns.
+     * The handler answers the requests without a body and those whose body the stream handler leaves to be
+     * received as a whole by returning nullptr.
+     */
+    Router &addRoute(std::string_view method, std::string_view pattern, Handler handler,
+                     Stream_Handler stream_handler);
+
+    /**
+     * Replaces the handler of the requests matching no route, which answers 404 Not Found by default.
+     */
+    Router &setNotFound(Handler handler);
+
+    /**
+     * Answers the request with the handler of the route its method and path match. The query is not part of
+     * the path.
+     */
+    HTTP<Type::Response> route(const HTTP<Type::Request> &req) const;
+
+    /**
+     * Returns the sink the body of the request whose head arrived is streamed to, chosen by the stream handler of
+     * the route it matches, or nullptr if that route has none and the body is received as a whole.
+     */
+    std::unique_ptr<Body_Sink> stream(const HTTP<Type::Request> &head) const;
+private:
+    struct Node;
+
+    /**
+     * The handlers registered for a method at the end of a pattern.
+     */
+    struct Route
+    {
+        std::string method;
+        Handler handler;
+        Stream_Handler stream_handler;
+    };
+
+    /**
+     *  Adds the rest of a pattern below the node, whose edge already matched everything before it.
+     */
+    void insert(Node &node, std::string_view pattern, Route &route);
+
+    /**
+     *  Adds the static run at the front of a pattern below the node, splitting an edge sharing a prefix with it.
+     */
+    void insertStatic(Node &node, std::string_view run, std::string_view rest, Route &route);
+
+    /**
+     *  Finds the node whose routes match the rest of the path, capturing the parameters on the way.
+     */
+    static const Node *match(const Node &node, std::string_view path, Route_Params &params);
+
+    std::unique_ptr<Node> root_;
+    Handler not_found_;
+};
+
+#endif // ROUTER_H_INCLUDED
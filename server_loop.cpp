@@ -0,0 +1,438 @@
+#ifdef __linux__
+
+#include "server_loop.h"
+#include "debugger.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <algorithm>
+
+// Recycled head buffers kept per loop.
+constexpr std::size_t max_spare_heads = 256;
+// Recycled jobs kept per loop, each holds the first block of its arena.
+constexpr std::size_t max_spare_jobs = 64;
+// How precisely deadlines are kept, a connection is closed at most this late.
+constexpr std::chrono::milliseconds timer_resolution(100);
+
+/**
+ * Answers requests with the handler on the given pool, or on the loop itself if it is nullptr.
+ */
+Server_Loop::Server_Loop(const Server::Handler &handler, const Body_Handler &body_handler,
+                         const Server_Options &options, Worker_Pool *workers)
+        : handler_(handler), body_handler_(body_handler), idle_timeout_(options.idle_timeout_seconds),
+          header_timeout_(options.header_timeout_seconds), body_timeout_(options.body_timeout_seconds),
+          max_body_size_(options.max_body_size), arena_pool_(std::pmr::pool_options{0, arena_pool_max_block}),
+          workers_(workers), timers_(timer_resolution), now_(Timer_Wheel::Clock::now()) {
+    if (workers_) {
+        // Blocking, io_uring would fail a read of a non-blocking one instead of waiting. Event_Loop only reads
+        // it once it is readable.
+        wake_fd_ = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd_ == -1) {
+            throw std::runtime_error("eventfd failed: " + std::to_string(errno) + "\n");
+        }
+    }
+}
+
+Server_Loop::~Server_Loop() {
+    if (wake_fd_ != -1) {
+        close(wake_fd_);
+    }
+}
+
+/**
+ * Leaves the jobs still running to be recycled once they are done.
+ */
+Server_Loop::Connection::~Connection() {
+    for (Output &output: out) {
+        if (!output.ready) {
+            output.job.release()->conn = nullptr;
+        }
+    }
+}
+
+/**
+ *  Answers the complete requests at the front of the input in order, queueing the responses so they
+ *  are sent together. Stops after a bounded batch so a deep pipeline cannot queue unbounded output,
+ *  the rest is answered once the batch is sent. Returns true if it stopped because the batch was full.
+ */
+bool Server_Loop::processInput(Connection &conn) {
+    while (!conn.close_after_send) {
+        if (conn.out.size() - conn.out_begin >= max_pipeline_batch) {
+            return true;
+        }
+        if (conn.sink) {
+            if (!streamBody(conn)) {
+                break;
+            }
+            continue;
+        }
+        auto parse_start = Metrics_Clock::now();
+        Parse_Status status = conn.parser.parse_head(conn.in.data());
+        if (status == Parse_Status::Complete) {
+            // An announced body over the limit is refused before any of it is received.
+            if (conn.parser.content_length() > max_body_size_) {
+                queueError(conn, 413);
+                break;
+            }
+            if (startStream(conn)) {
+                continue;
+            }
+            status = conn.parser.parse(conn.in.data());
+        }
+        if (status != Parse_Status::Error && conn.parser.get_body().size() > max_body_size_) {
+            queueError(conn, 413);
+            break;
+        }
+        if (status == Parse_Status::Incomplete) {
+            break;
+        }
+        if (status == Parse_Status::Error) {
+            queueError(conn, 400);
+            break;
+        }
+        std::unique_ptr<Job> job = workers_ ? takeJob() : nullptr;
+        HTTP<Type::Request> req = read_request(conn.parser, job ? &job->arena : &conn.arena);
+        Thread_Metrics &metrics = threadMetrics();
+        metrics.parse_time.record(Metrics_Clock::now() - parse_start);
+        metrics.requests[std::size_t(requestMethod(req.get_command()))].add();
+        // The header deadline of the next request starts with its first byte.
+        conn.wait = Wait::Idle;
+        auto connection = conn.parser.find_header("Connection");
+        conn.close_after_send = connection && iequals(*connection, "close");
+        conn.in.consume(conn.parser.message_size());
+        conn.parser.reset();
+        conn.buffer_body = false;
+        Debug("\n-------------------------\n %s \n-------------------------\n", req.to_string(false).c_str());
+        if (job) {
+            job->request.emplace(std::move(req));
+            dispatch(conn, std::move(job));
+        } else {
+            queueResponse(conn, answer(req));
+        }
+    }
+    return false;
+}
+
+/**
+ *  Hands the request read into the arena of the job to the workers, reserving its place among the queued
+ *  responses. Answers 503 Service Unavailable right away if the workers have too many requests queued,
+ *  keeping the connection open since the request was read completely.
+ */
+void Server_Loop::dispatch(Connection &conn, std::unique_ptr<Job> job) {
+    Job &raw = *job;
+    raw.conn = &conn;
+    raw.output = conn.out.size();
+    conn.out.emplace_back(std::move(job), std::string(), HTTP<Type::Response>(&raw.arena));
+    conn.out.back().ready = false;
+    if (workers_->trySubmit([this, &raw] { runJob(raw); })) {
+        return;
+    }
+    Debug("Worker queue is full, refusing the request");
+    job = std::move(conn.out.back().job);
+    conn.out.pop_back();
+    recycleJob(std::move(job));
+    HTTP_Builder<Type::Response> builder(&conn.arena);
+    queueResponse(conn, builder.setStatus(503).addHeader("Retry-After", "1").build());
+}
+
+/**
+ *  Answers the request of the job, called on a worker. Only the first job finished since the loop last
+ *  looked wakes it up.
+ */
+void Server_Loop::runJob(Job &job) {
+    job.response.emplace(answer(*job.request));
+    bool was_empty;
+    {
+        std::scoped_lock lock(done_mutex_);
+        was_empty = done_.empty();
+        done_.push_back(&job);
+    }
+    if (was_empty) {
+        std::uint64_t one = 1;
+        if (write(wake_fd_, &one, sizeof(one)) == -1) {
+            Err("eventfd write failed: %d", errno);
+        }
+    }
+}
+
+/**
+ *  Calls the handler, timing it and logging the access line.
+ */
+HTTP<Type::Response> Server_Loop::answer(const HTTP<Type::Request> &req) {
+    auto start = Metrics_Clock::now();
+    HTTP<Type::Response> resp = handler_(req);
+    auto duration = Metrics_Clock::now() - start;
+    threadMetrics().handler_time.record(duration);
+    logAccess(req.get_command(), req.get_url(), resp.get_status(), resp.body_size(), duration);
+    return resp;
+}
+
+/**
+ *  Puts the response of a finished job in the place reserved for it. It is moved within the arena of the job,
+ *  one the handler allocated elsewhere is copied into it.
+ */
+void Server_Loop::completeJob(Job &job) {
+    Output &output = job.conn->out[job.output];
+    output.response = std::move(*job.response);
+    job.response.reset();
+    job.request.reset();
+    output.head = takeHead();
+    output.response.write_head(output.head);
+    output.ready = true;
+    output.queued = Metrics_Clock::now();
+    threadMetrics().countResponse(output.response.get_status());
+}
+
+std::unique_ptr<Server_Loop::Job> Server_Loop::takeJob() {
+    if (spare_jobs_.empty()) {
+        return std::make_unique<Job>();
+    }
+    std::unique_ptr<Job> job = std::move(spare_jobs_.back());
+    spare_jobs_.pop_back();
+    return job;
+}
+
+/**
+ *  Resets a job nothing points into anymore and keeps it for the next requests.
+ */
+void Server_Loop::recycleJob(std::unique_ptr<Job> job) {
+    if (spare_jobs_.size() >= max_spare_jobs) {
+        return;
+    }
+    job->request.reset();
+    job->response.reset();
+    job->arena.release();
+    job->conn = nullptr;
+    spare_jobs_.push_back(std::move(job));
+}
+
+/**
+ *  Returns a recycled head buffer, or an empty one.
+ */
+std::string Server_Loop::takeHead() {
+    std::string head;
+    if (!spare_heads_.empty()) {
+        head = std::move(spare_heads_.back());
+        spare_heads_.pop_back();
+    }
+    return head;
+}
+
+/**
+ *  Asks the body handler whether the body of the request whose head was just parsed is streamed and
+ *  starts streaming it if so. Returns false if it is received as a whole.
+ */
+bool Server_Loop::startStream(Connection &conn) {
+    if (!body_handler_ || conn.buffer_body || !conn.parser.has_body()) {
+        return false;
+    }
+    HTTP<Type::Request> head = read_request_head(conn.parser, &conn.arena);
+    conn.sink = body_handler_(head);
+    if (!conn.sink) {
+        // processInput counts and logs the request once its whole body arrived.
+        conn.buffer_body = true;
+        return false;
+    }
+    threadMetrics().requests[std::size_t(requestMethod(head.get_command()))].add();
+    Debug("\n-------------------------\n %s \n-------------------------\n", head.to_string(false).c_str());
+    auto connection = head.find_header(Header_Id::Connection);
+    conn.close_after_body = connection && iequals(*connection, "close");
+    conn.body = conn.parser.body_decoder();
+    conn.body_received = 0;
+    conn.in.consume(conn.parser.header_size());
+    conn.parser.reset();
+    return true;
+}
+
+/**
+ *  Hands the received bytes of a streamed body to its sink. Returns true once the body is complete,
+ *  rejected or too large and the response is queued, false if more input is needed.
+ */
+bool Server_Loop::streamBody(Connection &conn) {
+    std::size_t consumed;
+    bool accepted = true;
+    Parse_Status status = conn.body.decode_all(conn.in.data(), consumed, [&](std::string_view data) {
+        conn.body_received += data.size();
+        return accepted = conn.body_received <= max_body_size_ && conn.sink->write(data);
+    });
+    conn.in.consume(consumed);
+    if (status == Parse_Status::Incomplete && accepted) {
+        return false;
+    }
+    if (status == Parse_Status::Error) {
+        queueError(conn, 400);
+    } else if (conn.body_received > max_body_size_) {
+        // Dropping the sink without finishing it aborts what it did with the body so far.
+        queueError(conn, 413);
+    } else {
+        queueResponse(conn, conn.sink->finish());
+        // The rest of a rejected body is still on its way, so the connection cannot carry another request.
+        conn.close_after_send = conn.close_after_body || !accepted;
+    }
+    conn.sink.reset();
+    return true;
+}
+
+/**
+ *  Serializes the head of the response into a recycled buffer and queues it on the connection.
+ */
+void Server_Loop::queueResponse(Connection &conn, HTTP<Type::Response> resp) {
+    std::string head = takeHead();
+    resp.write_head(head);
+    threadMetrics().countResponse(resp.get_status());
+    // Moved in by construction, assigning to a default one would copy an arena response to the heap.
+    conn.out.emplace_back(nullptr, std::move(head), std::move(resp));
+    conn.out.back().queued = Metrics_Clock::now();
+}
+
+/**
+ *  Queues a response with the given error status, closing the connection once it is sent.
+ */
+void Server_Loop::queueError(Connection &conn, int status) {
+    HTTP_Builder<Type::Response> builder(&conn.arena);
+    queueResponse(conn, builder.setStatus(status).addHeader(Header_Id::Connection, "close").build());
+    conn.close_after_send = true;
+}
+
+/**
+ *  Collects the unsent in-memory parts of as many queued responses as fit into the buffers, stopping at
+ *  the first one that continues with a file or a stream and setting more if so. Returns the buffer count.
+ */
+int Server_Loop::gatherOutput(const Connection &conn, IO_Buffer *buffers, int max_buffers, bool &more) {
+    int count = 0;
+    more = false;
+    for (std::size_t i = conn.out_begin; i < conn.out.size() && count + 2 <= max_buffers; i++) {
+        const Output &output = conn.out[i];
+        if (!output.ready) {
+            break;
+        }
+        std::string_view body = output.response.get_body();
+        if (output.sent < output.head.size()) {
+            buffers[count++] = makeIOBuffer(output.head.data() + output.sent, output.head.size() - output.sent);
+        }
+        std::size_t body_sent = output.sent - std::min(output.sent, output.head.size());
+        if (body_sent < body.size()) {
+            buffers[count++] = makeIOBuffer(body.data() + body_sent, body.size() - body_sent);
+        }
+        if (output.response.get_file_body().length != 0 || output.response.get_stream_body()) {
+            more = true;
+            break;
+        }
+    }
+    return count;
+}
+
+/**
+ *  Counts sent bytes of the in-memory parts of the queued responses, retiring those that went out
+ *  completely. One with a streamed body is retired once the stream is exhausted.
+ */
+void Server_Loop::commitSent(Connection &conn, std::size_t sent) {
+    // The last response counted may be partially sent.
+    while (conn.out_begin < conn.out.size()) {
+        Output &output = conn.out[conn.out_begin];
+        if (!output.ready) {
+            break;
+        }
+        std::size_t size = output.head.size() + output.response.body_size();
+        std::size_t progress = std::min(sent, size - output.sent);
+        output.sent += progress;
+        sent -= progress;
+        if (output.sent < size || output.response.get_stream_body()) {
+            break;
+        }
+        retireFront(conn);
+    }
+}
+
+/**
+ *  Drops the completely sent front response, keeping its head buffer for the next ones.
+ */
+void Server_Loop::retireFront(Connection &conn) {
+    Output &output = conn.out[conn.out_begin];
+    threadMetrics().send_time.record(Metrics_Clock::now() - output.queued);
+    if (spare_heads_.size() < max_spare_heads) {
+        output.head.clear();
+        spare_heads_.push_back(std::move(output.head));
+    }
+    conn.out_begin++;
+}
+
+/**
+ *  Frees the output of a connection once all of it is sent and resets its arena, which nothing
+ *  points into anymore: requests only live while they are answered and responses until they are sent.
+ */
+void Server_Loop::releaseOutput(Connection &conn) {
+    // The responses of the jobs live in their arenas, so the recycled jobs are reset only after them.
+    std::size_t recycled = spare_jobs_.size();
+    for (Output &output: conn.out) {
+        if (output.job && spare_jobs_.size() < max_spare_jobs) {
+            spare_jobs_.push_back(std::move(output.job));
+        }
+    }
+    std::vector<Output>().swap(conn.out);
+    for (std::size_t i = recycled; i < spare_jobs_.size(); i++) {
+        spare_jobs_[i]->arena.release();
+        spare_jobs_[i]->conn = nullptr;
+    }
+    conn.out_begin = 0;
+    conn.arena.release();
+}
+
+/**
+ *  Moves the deadline of the connection to what it waits for now, called whenever it made progress.
+ *  The timer is only moved when the deadline gets earlier, a later one is picked up when it fires.
+ */
+void Server_Loop::updateDeadline(Connection &conn) {
+    if (conn.out_begin < conn.out.size()) {
+        // A client that does not read its responses is as idle as one that sends nothing.
+        conn.wait = Wait::Idle;
+        conn.deadline = now_ + idle_timeout_;
+    } else if (conn.sink || conn.parser.header_size() != 0) {
+        conn.wait = Wait::Body;
+        conn.deadline = now_ + body_timeout_;
+    } else if (conn.handshaking || !conn.in.empty() || !conn.scheduled()) {
+        // A new connection has to finish its TLS handshake and send its first head within the header timeout as well.
+        if (conn.wait != Wait::Header || !conn.scheduled()) {
+            conn.wait = Wait::Header;
+            conn.deadline = now_ + header_timeout_;
+        }
+    } else {
+        conn.wait = Wait::Idle;
+        conn.deadline = now_ + idle_timeout_;
+    }
+    if (!conn.scheduled() || conn.deadline < timers_.expiry(conn)) {
+        timers_.schedule(conn, conn.deadline);
+    }
+}
+
+/**
+ *  Returns the milliseconds until the timers are due next, -1 if there are none.
+ */
+int Server_Loop::timerTimeout() const {
+    auto wakeup = timers_.nextWakeup();
+    if (wakeup == Timer_Wheel::Clock::time_point::max()) {
+        return -1;
+    }
+    auto now = Timer_Wheel::Clock::now();
+    if (wakeup <= now) {
+        return 0;
+    }
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(wakeup - now).count();
+    return static_cast<int>(std::min<decltype(ms)>(ms, INT32_MAX));
+}
+
+/**
+ *  Checks a connection whose timer fired, rescheduling it if its deadline moved since. Returns true if
+ *  the deadline passed.
+ */
+bool Server_Loop::expired(Connection &conn) {
+    if (conn.deadline > now_) {
+        timers_.schedule(conn, conn.deadline);
+        return false;
+    }
+    static const char *const waits[] = {"idle", "header", "body"};
+    Debug("Connection timed out (%s)", waits[static_cast<int>(conn.wait)]);
+    return true;
+}
+
+#endif // __linux__
@@ -0,0 +1,306 @@
+#ifndef SERVER_LOOP_H_INCLUDED
+#define SERVER_LOOP_H_INCLUDED
+
+#ifdef __linux__
+
+#include "networking.h"
+#include "buffer.h"
+#include "timer_wheel.h"
+#include "worker_pool.h"
+#include "metrics.h"
+#include <array>
+#include <chrono>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * The part of a loop serving the connections of a Server that does not depend on how it does its I/O:
+ * framing the received requests, handing streamed bodies to their sinks and queueing the responses in order.
+ *
+ * With a worker pool the handler does not run on the loop: every request is handed to the pool together with an
+ * arena of its own, and the worker returns the response through a queue the loop is woken up for with an eventfd.
+ * The response takes the place reserved for it among the queued ones, so pipelined requests are still answered
+ * in order.
+ */
+class Server_Loop
+{
+public:
+    virtual ~Server_Loop();
+
+    /**
+     * A blocking function call that runs the loop forever.
+     */
+    [[noreturn]] virtual void run() = 0;
+protected:
+    /**
+     * Answers requests with the handler on the given pool, or on the loop itself if it is nullptr.
+     */
+    Server_Loop(const Server::Handler &handler, const Body_Handler &body_handler, const Server_Options &options,
+                Worker_Pool *workers);
+
+    struct Connection;
+
+    /**
+     * A request handed to a worker, which allocates the response from the arena of the request as well.
+     */
+    struct Job
+    {
+        Job() : arena(buffer.data(), buffer.size()) {}
+
+        // The arena starts in the job itself, so a recycled job answers a typical request without allocating.
+        std::array<char, arena_block_size> buffer;
+        std::pmr::monotonic_buffer_resource arena;
+        std::optional<HTTP<Type::Request>> request;
+        std::optional<HTTP<Type::Response>> response;
+        // Only touched by the loop: the connection waiting for the response and the index of its place in out,
+        // nullptr once the connection is closed.
+        Connection *conn = nullptr;
+        std::size_t output = 0;
+    };
+
+    /**
+     * A response queued on a connection, sent as its serialized head followed by its body.
+     */
+    struct Output
+    {
+        Output(std::unique_ptr<Job> job, std::string head, HTTP<Type::Response> response)
+            : job(std::move(job)), head(std::move(head)), response(std::move(response)) {}
+
+        // The job whose arena holds the response, destroyed after it.
+        std::unique_ptr<Job> job;
+        std::string head;
+        HTTP<Type::Response> response;
+        // False while the job is still running, nothing from here on is sent until it is done.
+        bool ready = true;
+        Metrics_Clock::time_point queued;
+        // Bytes of the head and the body already sent.
+        std::size_t sent = 0;
+        // The framed piece of a streamed body being sent, chunk[0, chunk_begin) is already sent.
+        std::string chunk;
+        std::size_t chunk_begin = 0;
+        bool stream_done = false;
+    };
+
+    /**
+     * What a connection is waiting for, which decides the deadline it has to make.
+     */
+    enum class Wait
+    {
+        // The next request of a kept-alive connection or the client reading a response.
+        Idle,
+        // The rest of a request head, the deadline counts from its first byte.
+        Header,
+        // More of a request body, the deadline counts from the last bytes received.
+        Body
+    };
+
+    /**
+     * Request state of a single client connection, timed by the timer it is based on.
+     */
+    struct Connection : Timer_Wheel::Timer
+    {
+        explicit Connection(std::pmr::memory_resource *upstream) : arena(arena_block_size, upstream) {}
+
+        /**
+         * Leaves the jobs still running to be recycled once they are done.
+         */
+        ~Connection();
+
+        // Requests and the responses built for them, released at once whenever all output has been sent.
+        std::pmr::monotonic_buffer_resource arena;
+        // Received bytes that do not form a complete message yet, empty and unallocated while idle.
+        Recv_Buffer in;
+        // Parses the message at the front of in, remembering how far it got between receives.
+        HTTP_Parser parser;
+        // Receives the body of the current request while it is streamed, body decodes it.
+        std::unique_ptr<Body_Sink> sink;
+        Body_Decoder body;
+        std::uint64_t body_received = 0;
+        // The body handler left the body of the current request to be received as a whole.
+        bool buffer_body = false;
+        // The streamed request asked to close the connection after its answer.
+        bool close_after_body = false;
+        // Responses waiting to be sent, out[0, out_begin) are already sent.
+        std::vector<Output> out;
+        std::size_t out_begin = 0;
+        // Close once everything in out has been sent.
+        bool close_after_send = false;
+        // The TLS handshake is still running, it has to be done within the header timeout.
+        bool handshaking = false;
+        // The connection is closed once the deadline passes, its timer fires no later than that.
+        Wait wait = Wait::Idle;
+        Timer_Wheel::Clock::time_point deadline;
+    };
+
+    /**
+     *  Answers the complete requests at the front of the input in order, queueing the responses so they
+     *  are sent together. Returns true if it stopped because the batch was full.
+     */
+    bool processInput(Connection &conn);
+
+    /**
+     *  Hands the request read into the arena of the job to the workers, reserving its place among the queued
+     *  responses. Answers 503 Service Unavailable right away if the workers have too many requests queued.
+     */
+    void dispatch(Connection &conn, std::unique_ptr<Job> job);
+
+    /**
+     *  Answers the request of the job, called on a worker.
+     */
+    void runJob(Job &job);
+
+    /**
+     *  Calls the handler, timing it and logging the access line.
+     */
+    HTTP<Type::Response> answer(const HTTP<Type::Request> &req);
+
+    /**
+     *  Puts the responses of the finished jobs in their places and hands every connection one was waiting for
+     *  to resume, which sends what is ready now. Called by the loops once wake_fd_ was read.
+     */
+    template<class Resume>
+    void finishJobs(Resume &&resume);
+
+    /**
+     *  Puts the response of a finished job in the place reserved for it.
+     */
+    void completeJob(Job &job);
+
+    std::unique_ptr<Job> takeJob();
+
+    /**
+     *  Resets a job nothing points into anymore and keeps it for the next requests.
+     */
+    void recycleJob(std::unique_ptr<Job> job);
+
+    /**
+     *  Returns a recycled head buffer, or an empty one.
+     */
+    std::string takeHead();
+
+    /**
+     *  Asks the body handler whether the body of the request whose head was just parsed is streamed and
+     *  starts streaming it if so. Returns false if it is received as a whole.
+     */
+    bool startStream(Connection &conn);
+
+    /**
+     *  Hands the received bytes of a streamed body to its sink. Returns true once the body is complete,
+     *  rejected or too large and the response is queued, false if more input is needed.
+     */
+    bool streamBody(Connection &conn);
+
+    /**
+     *  Serializes the head of the response into a recycled buffer and queues it on the connection.
+     */
+    void queueResponse(Connection &conn, HTTP<Type::Response> resp);
+
+    /**
+     *  Queues a response with the given error status, closing the connection once it is sent.
+     */
+    void queueError(Connection &conn, int status);
+
+    /**
+     *  Collects the unsent in-memory parts of as many queued responses as fit into the buffers, stopping at
+     *  the first one that continues with a file or a stream and setting more if so. Returns the buffer count.
+     */
+    static int gatherOutput(const Connection &conn, IO_Buffer *buffers, int max_buffers, bool &more);
+
+    /**
+     *  Counts sent bytes of the in-memory parts of the queued responses, retiring those that went out
+     *  completely. One with a streamed body is retired once the stream is exhausted.
+     */
+    void commitSent(Connection &conn, std::size_t sent);
+
+    /**
+     *  Drops the completely sent front response, keeping its head buffer for the next ones.
+     */
+    void retireFront(Connection &conn);
+
+    /**
+     *  Frees the output of a connection once all of it is sent and resets its arena, which nothing
+     *  points into anymore.
+     */
+    void releaseOutput(Connection &conn);
+
+    /**
+     *  Moves the deadline of the connection to what it waits for now, called whenever it made progress.
+     */
+    void updateDeadline(Connection &conn);
+
+    /**
+     *  Returns the milliseconds until the timers are due next, -1 if there are none.
+     */
+    int timerTimeout() const;
+
+    /**
+     *  Advances the timers to now_ and hands every connection whose deadline passed to close.
+     */
+    template<class Close>
+    void expireConnections(Close &&close);
+
+    /**
+     *  Checks a connection whose timer fired, rescheduling it if its deadline moved since. Returns true if
+     *  the deadline passed.
+     */
+    bool expired(Connection &conn);
+
+    const Server::Handler &handler_;
+    const Body_Handler &body_handler_;
+    std::chrono::seconds idle_timeout_;
+    std::chrono::seconds header_timeout_;
+    std::chrono::seconds body_timeout_;
+    std::uint64_t max_body_size_;
+    // Head buffers of sent responses, kept for serializing the next ones.
+    std::vector<std::string> spare_heads_;
+    // Where the arenas of the connections get their blocks from and return them to, only used by this loop.
+    std::pmr::unsynchronized_pool_resource arena_pool_;
+    // Runs the handler if set. Workers push the jobs they finished to done_ and signal wake_fd_ when it was empty.
+    Worker_Pool *workers_;
+    int wake_fd_ = -1;
+    std::mutex done_mutex_;
+    std::vector<Job *> done_;
+    // The jobs being finished, swapped with done_.
+    std::vector<Job *> finished_;
+    std::vector<std::unique_ptr<Job>> spare_jobs_;
+    // Deadlines of the connections, checked against now_, which the loops update after every wait.
+    Timer_Wheel timers_;
+    Timer_Wheel::Clock::time_point now_;
+};
+
+template<class Close>
+void Server_Loop::expireConnections(Close &&close) {
+    timers_.advance(now_, [&](Timer_Wheel::Timer &timer) {
+        auto &conn = static_cast<Connection &>(timer);
+        if (expired(conn)) {
+            close(conn);
+        }
+    });
+}
+
+template<class Resume>
+void Server_Loop::finishJobs(Resume &&resume) {
+    {
+        std::scoped_lock lock(done_mutex_);
+        finished_.swap(done_);
+    }
+    for (Job *job: finished_) {
+        // Resuming may close a connection, whose jobs left in the list are then orphaned.
+        if (!job->conn) {
+            recycleJob(std::unique_ptr<Job>(job));
+            continue;
+        }
+        Connection &conn = *job->conn;
+        completeJob(*job);
+        resume(conn);
+    }
+    finished_.clear();
+}
+
+#endif // __linux__
+
+#endif // SERVER_LOOP_H_INCLUDED
@@ -0,0 +1,447 @@
+#include "static_file.h"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+
+/**
+ * A satisfiable range of bytes of a file.
+ * */
+struct Byte_Range{
+    std::uint64_t first;
+    std::uint64_t length;
+};
+
+/**
+ * The ranges a Range header asks for that overlap the file.
+ * */
+struct Byte_Ranges{
+    std::array<Byte_Range, max_byte_ranges> ranges;
+    std::size_t size = 0;
+};
+
+enum class Range_Status{Satisfiable, Unsatisfiable, Ignored};
+
+static std::string_view trim(std::string_view value)
+{
+    while(!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+    {
+        value.remove_prefix(1);
+    }
+    while(!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+    {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+/**
+ * Parses a non-empty run of digits, returns false if there is anything else or it overflows.
+ * */
+static bool parse_position(std::string_view digits, std::uint64_t& value)
+{
+    if(digits.empty())
+    {
+        return false;
+    }
+    auto result = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    return result.ec == std::errc() && result.ptr == digits.data() + digits.size();
+}
+
+/**
+ * Parses the value of a Range header, "bytes=0-99,200-,-50", against a file of the given size into the ranges
+ * overlapping the file, clipped to it. Malformed values, other units and too many ranges are Ignored, as if the
+ * request had no Range header.
+ * */
+static Range_Status parse_ranges(std::string_view value, std::uint64_t size, Byte_Ranges& out)
+{
+    constexpr std::string_view unit = "bytes=";
+    value = trim(value);
+    if(value.size() < unit.size() || !iequals(value.substr(0, unit.size()), unit))
+    {
+        return Range_Status::Ignored;
+    }
+    value.remove_prefix(unit.size());
+    std::size_t n_specs = 0;
+    while(!value.empty())
+    {
+        std::size_t comma = value.find(',');
+        std::string_view spec = trim(value.substr(0, comma));
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+        // Empty list elements are allowed.
+        if(spec.empty())
+        {
+            continue;
+        }
+        std::size_t dash = spec.find('-');
+        if(dash == std::string_view::npos || ++n_specs > max_byte_ranges)
+        {
+            return Range_Status::Ignored;
+        }
+        std::string_view first_digits = spec.substr(0, dash), last_digits = spec.substr(dash + 1);
+        std::uint64_t first, last;
+        if(first_digits.empty())
+        {
+            // A suffix, the last bytes of the file.
+            if(!parse_position(last_digits, last))
+            {
+                return Range_Status::Ignored;
+            }
+            if(last != 0 && size != 0)
+            {
+                first = last < size ? size - last : 0;
+                out.ranges[out.size++] = {first, size - first};
+            }
+            continue;
+        }
+        if(!parse_position(first_digits, first))
+        {
+            return Range_Status::Ignored;
+        }
+        last = UINT64_MAX;
+        if(!last_digits.empty() && (!parse_position(last_digits, last) || last < first))
+        {
+            return Range_Status::Ignored;
+        }
+        if(first < size)
+        {
+            last = std::min(last, size - 1);
+            out.ranges[out.size++] = {first, last - first + 1};
+        }
+    }
+    if(n_specs == 0)
+    {
+        return Range_Status::Ignored;
+    }
+    return out.size != 0 ? Range_Status::Satisfiable : Range_Status::Unsatisfiable;
+}
+
+/**
+ * Splits the next entity tag off a list like the value of If-None-Match, without its weakness indicator.
+ * Returns false once the list is exhausted or malformed.
+ * */
+static bool next_etag(std::string_view& list, std::string_view& opaque_tag)
+{
+    while(!list.empty() && (list.front() == ',' || list.front() == ' ' || list.front() == '\t'))
+    {
+        list.remove_prefix(1);
+    }
+    if(list.size() >= 2 && list.substr(0, 2) == "W/")
+    {
+        list.remove_prefix(2);
+    }
+    if(list.empty() || list.front() != '"')
+    {
+        return false;
+    }
+    std::size_t end = list.find('"', 1);
+    if(end == std::string_view::npos)
+    {
+        return false;
+    }
+    opaque_tag = list.substr(0, end + 1);
+    list.remove_prefix(end + 1);
+    return true;
+}
+
+/**
+ * Whether a list of entity tags, or "*", matches the entity tag of the file using the weak comparison.
+ * */
+static bool etag_matches(std::string_view list, std::string_view etag)
+{
+    list = trim(list);
+    if(list == "*")
+    {
+        return true;
+    }
+    if(etag.size() >= 2 && etag.substr(0, 2) == "W/")
+    {
+        etag.remove_prefix(2);
+    }
+    std::string_view tag;
+    while(next_etag(list, tag))
+    {
+        if(tag == etag)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Whether the copy of the client is still current according to If-None-Match, or If-Modified-Since if there
+ * is none, so the request is answered with 304 Not Modified.
+ * */
+static bool not_modified(const HTTP<Type::Request>& req, std::optional<std::string_view> etag,
+                         std::optional<std::string_view> last_modified)
+{
+    if(auto if_none_match = req.find_header(Header_Id::If_None_Match))
+    {
+        return etag && etag_matches(*if_none_match, *etag);
+    }
+    auto if_modified_since = req.find_header(Header_Id::If_Modified_Since);
+    if(!if_modified_since || !last_modified)
+    {
+        return false;
+    }
+    auto since = parse_http_date(trim(*if_modified_since));
+    auto modified = parse_http_date(*last_modified);
+    return since && modified && *modified <= *since;
+}
+
+/**
+ * Whether the Range header of the request still applies: If-Range, if present, has to name the current
+ * version of the file, by its strong entity tag or its exact modification date.
+ * */
+static bool range_applies(const HTTP<Type::Request>& req, std::optional<std::string_view> etag,
+                          std::optional<std::string_view> last_modified)
+{
+    auto if_range = req.find_header(Header_Id::If_Range);
+    if(!if_range)
+    {
+        return true;
+    }
+    std::string_view validator = trim(*if_range);
+    if(!validator.empty() && validator.front() == '"')
+    {
+        return etag && *etag == validator;
+    }
+    if(validator.size() >= 2 && validator.substr(0, 2) == "W/")
+    {
+        return false;
+    }
+    auto date = parse_http_date(validator);
+    auto modified = last_modified ? parse_http_date(*last_modified) : std::nullopt;
+    return date && modified && *date == *modified;
+}
+
+/**
+ * Starts an answer with the given status carrying the headers of the full response, except those describing
+ * its body, which the answer replaces.
+ * */
+static HTTP_Builder<Type::Response> answer_from(const HTTP<Type::Response>& full, int status,
+                                                std::pmr::memory_resource* resource, bool keep_content_type)
+{
+    HTTP_Builder<Type::Response> builder(resource);
+    builder.setStatus(status);
+    const Header_Map& headers = full.get_headers();
+    builder.reserveHeaders(headers.wire().size() + 64);
+    for(std::size_t i = 0; i < headers.size(); i++)
+    {
+        Header_View header = headers[i];
+        Header_Id id = header_id(header.name);
+        if(id != Header_Id::Content_Length && (keep_content_type || id != Header_Id::Content_Type))
+        {
+            builder.addHeader(header.name, header.value);
+        }
+    }
+    return builder;
+}
+
+static std::string content_range(std::uint64_t first, std::uint64_t length, std::uint64_t size)
+{
+    return "bytes " + std::to_string(first) + "-" + std::to_string(first + length - 1) + "/" + std::to_string(size);
+}
+
+/**
+ * Where the bytes of the full response come from: its in-memory body followed by its file body, either may
+ * be empty.
+ * */
+struct Body_Source{
+    Shared_Bytes memory;
+    File_Range file;
+
+    explicit Body_Source(const HTTP<Type::Response>& full) : memory(full.get_shared_body()), file(full.get_file_body())
+    {
+        // A body owned by the response does not outlive it, the slices need a copy of their own.
+        if(!memory.owner && !full.get_body().empty())
+        {
+            auto copy = std::make_shared<const std::string>(full.get_body());
+            memory = {copy, *copy};
+        }
+    }
+
+    /**
+     * Uses the given range of the bytes as the body of the answer.
+     * */
+    void slice(HTTP_Builder<Type::Response>& builder, const Byte_Range& range) const
+    {
+        std::uint64_t in_memory = memory.data.size();
+        if(range.first < in_memory)
+        {
+            std::uint64_t length = std::min(range.length, in_memory - range.first);
+            builder.addBody(Shared_Bytes{memory.owner, memory.data.substr(range.first, length)});
+        }
+        std::uint64_t end = range.first + range.length;
+        if(end > in_memory)
+        {
+            std::uint64_t first = std::max(range.first, in_memory) - in_memory;
+            builder.addFileBody({file.file, file.offset + first, end - in_memory - first});
+        }
+    }
+
+    /**
+     * Appends at most max_size bytes of the range starting at the given offset into it, returns false if the
+     * file could not be read.
+     * */
+    bool read(std::string& out, const Byte_Range& range, std::uint64_t offset, std::size_t max_size) const
+    {
+        std::uint64_t position = range.first + offset;
+        std::uint64_t length = std::min<std::uint64_t>(range.length - offset, max_size);
+        std::uint64_t in_memory = memory.data.size();
+        if(position < in_memory)
+        {
+            std::uint64_t piece = std::min(length, in_memory - position);
+            out.append(memory.data.substr(position, piece));
+            position += piece;
+            length -= piece;
+        }
+        if(length == 0)
+        {
+            return true;
+        }
+        std::size_t begin = out.size();
+        out.resize(begin + length);
+        long n = file.file->read_at(&out[begin], length, file.offset + position - in_memory);
+        out.resize(begin + std::size_t(n > 0 ? n : 0));
+        return n > 0;
+    }
+};
+
+/**
+ * Returns a boundary for a multipart body, random so it does not occur in the files it separates.
+ * */
+static std::string make_boundary()
+{
+    thread_local std::mt19937_64 random{std::random_device{}()};
+    char digits[16];
+    auto result = std::to_chars(digits, digits + sizeof(digits), random(), 16);
+    return "byteranges_" + std::string(digits, result.ptr);
+}
+
+/**
+ * Streams several ranges of the file as a multipart/byteranges body, one part with the bytes of every range
+ * read only once the part is being sent.
+ * */
+class Multipart_Stream{
+public:
+    Multipart_Stream(Body_Source source, const Byte_Ranges& ranges, std::uint64_t size, std::string boundary,
+                     std::string_view content_type)
+        : source_(std::move(source)), ranges_(ranges), size_(size), boundary_(std::move(boundary)),
+          content_type_(content_type) {}
+
+    bool operator()(std::string& out, std::size_t max_size)
+    {
+        std::size_t begin = out.size();
+        while(part_ < ranges_.size && out.size() - begin < max_size)
+        {
+            const Byte_Range& range = ranges_.ranges[part_];
+            if(!started_)
+            {
+                out += "\r\n--";
+                out += boundary_;
+                if(!content_type_.empty())
+                {
+                    out += "\r\nContent-Type: ";
+                    out += content_type_;
+                }
+                out += "\r\nContent-Range: ";
+                out += content_range(range.first, range.length, size_);
+                out += "\r\n\r\n";
+                started_ = true;
+            }
+            std::size_t before = out.size();
+            if(!source_.read(out, range, offset_, max_size - std::min(max_size, before - begin)))
+            {
+                // The file shrank or failed, the body ends short of what was announced.
+                return false;
+            }
+            offset_ += out.size() - before;
+            if(offset_ == range.length)
+            {
+                part_++;
+                offset_ = 0;
+                started_ = false;
+            }
+        }
+        if(part_ < ranges_.size)
+        {
+            return true;
+        }
+        out += "\r\n--";
+        out += boundary_;
+        out += "--\r\n";
+        return false;
+    }
+private:
+    Body_Source source_;
+    Byte_Ranges ranges_;
+    std::uint64_t size_;
+    std::string boundary_;
+    std::string content_type_;
+    // The part being sent and how many of its bytes are sent already.
+    std::size_t part_ = 0;
+    std::uint64_t offset_ = 0;
+    bool started_ = false;
+};
+
+/**
+ * Answers a GET of a static file given the full 200 response for it, which carries the ETag and Last-Modified
+ * of the file and its contents as an in-memory or file body. Returns
+ * - 304 Not Modified if If-None-Match, or If-Modified-Since without it, shows the copy of the client is current,
+ * - 206 Partial Content with the ranges asked for by Range, unless If-Range no longer matches the file, several
+ *   of them as a multipart/byteranges body,
+ * - 416 Range Not Satisfiable if none of the ranges asked for overlaps the file,
+ * - the full response otherwise.
+ * The ranges are slices of the body of the full response, so no more of a file than they cover is ever read.
+ * Other answers than the full response are allocated from the resource of the request.
+ * */
+HTTP<Type::Response> answer_file_request(const HTTP<Type::Request>& req, HTTP<Type::Response> full)
+{
+    if(full.get_status().substr(0, 3) != "200" || full.get_stream_body())
+    {
+        return full;
+    }
+    auto etag = full.find_header(Header_Id::ETag);
+    auto last_modified = full.find_header(Header_Id::Last_Modified);
+    std::pmr::memory_resource* resource = req.get_resource();
+    if(not_modified(req, etag, last_modified))
+    {
+        return answer_from(full, 304, resource, false).build();
+    }
+    auto range = req.find_header(Header_Id::Range);
+    if(!range || !range_applies(req, etag, last_modified))
+    {
+        return full;
+    }
+    std::uint64_t size = full.body_size();
+    Byte_Ranges ranges;
+    switch(parse_ranges(*range, size, ranges))
+    {
+    case Range_Status::Ignored:
+        return full;
+    case Range_Status::Unsatisfiable:
+        return answer_from(full, 416, resource, false)
+        .addHeader(Header_Id::Content_Range, "bytes */" + std::to_string(size)).build();
+    case Range_Status::Satisfiable:
+        break;
+    }
+    if(ranges.size == 1)
+    {
+        const Byte_Range& only = ranges.ranges[0];
+        auto builder = answer_from(full, 206, resource, true);
+        builder.addHeader(Header_Id::Content_Range, content_range(only.first, only.length, size));
+        Body_Source(full).slice(builder, only);
+        return builder.build();
+    }
+    std::string boundary = make_boundary();
+    auto builder = answer_from(full, 206, resource, false);
+    builder.addHeader(Header_Id::Content_Type, "multipart/byteranges; boundary=" + boundary);
+    std::string_view content_type = full.find_header(Header_Id::Content_Type).value_or("");
+    return builder.addStreamBody(Multipart_Stream(Body_Source(full), ranges, size, std::move(boundary),
+                                                  content_type)).build();
+}
@@ -0,0 +1,23 @@
+#ifndef STATIC_FILE_H_INCLUDED
+#define STATIC_FILE_H_INCLUDED
+
+#include "http.h"
+#include <cstddef>
+
+// Most ranges a single request may ask for, a Range header with more is ignored and the whole file sent.
+constexpr std::size_t max_byte_ranges = 16;
+
+/**
+ * Answers a GET of a static file given the full 200 response for it, which carries the ETag and Last-Modified
+ * of the file and its contents as an in-memory or file body. Returns
+ * - 304 Not Modified if If-None-Match, or If-Modified-Since without it, shows the copy of the client is current,
+ * - 206 Partial Content with the ranges asked for by Range, unless If-Range no longer matches the file, several
+ *   of them as a multipart/byteranges body,
+ * - 416 Range Not Satisfiable if none of the ranges asked for overlaps the file,
+ * - the full response otherwise.
+ * The ranges are slices of the body of the full response, so no more of a file than they cover is ever read.
+ * Other answers than the full response are allocated from the resource of the request.
+ * */
+HTTP<Type::Response> answer_file_request(const HTTP<Type::Request>& req, HTTP<Type::Response> full);
+
+#endif // STATIC_FILE_H_INCLUDED
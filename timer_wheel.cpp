@@ -0,0 +1,118 @@
+#include "timer_wheel.h"
+#include <algorithm>
+
+/**
+ * Creates an empty wheel ticking at the given resolution from now on.
+ */
+Timer_Wheel::Timer_Wheel(Clock::duration resolution, Clock::time_point now)
+        : resolution_(resolution), start_(now) {
+    for (Timer &head: slots_) {
+        head.prev_ = head.next_ = &head;
+    }
+}
+
+/**
+ * Makes the timer fire at the deadline, moving it if it is already scheduled.
+ */
+void Timer_Wheel::schedule(Timer &timer, Clock::time_point deadline) {
+    cancel(timer);
+    // Rounded up, and a deadline already passed fires with the next tick.
+    std::uint64_t expires = current_ + 1;
+    if (deadline > start_) {
+        expires = std::max(expires, std::uint64_t((deadline - start_ + resolution_ - Clock::duration(1)) / resolution_));
+    }
+    insert(timer, expires);
+}
+
+/**
+ * Unlinks the timer if it is scheduled.
+ */
+void Timer_Wheel::cancel(Timer &timer) {
+    if (timer.scheduled()) {
+        unlink(timer);
+    }
+}
+
+/**
+ * Returns when the wheel has to be advanced next, either because a timer fires or because timers move
+ * down a level, or Clock::time_point::max() if it holds no timers.
+ */
+Timer_Wheel::Clock::time_point Timer_Wheel::nextWakeup() const {
+    if (size_ == 0) {
+        return Clock::time_point::max();
+    }
+    // The first level only holds timers of the coming round, so its first occupied slot after the current
+    // tick is the earliest of them.
+    std::uint64_t next = UINT64_MAX;
+    if (occupied_[0] != 0) {
+        unsigned begin = (current_ + 1) & (slots - 1);
+        std::uint64_t rotated = (occupied_[0] >> begin) | (occupied_[0] << ((slots - begin) & (slots - 1)));
+        next = current_ + 1 + __builtin_ctzll(rotated);
+    }
+    for (unsigned level = 1; level < levels; level++) {
+        if (occupied_[level] != 0) {
+            // The upper timers move down once the first level starts its next round.
+            next = std::min(next, ((current_ >> slot_bits) + 1) << slot_bits);
+            break;
+        }
+    }
+    return start_ + next * resolution_;
+}
+
+/**
+ * Links the timer into the slot covering its tick, which may not lie before the current one.
+ */
+void Timer_Wheel::insert(Timer &timer, std::uint64_t expires) {
+    std::uint64_t delta = expires - current_;
+    if (delta >= span) {
+        expires = current_ + span - 1;
+        delta = span - 1;
+    }
+    unsigned level = 0;
+    while (delta >= (std::uint64_t(1) << (slot_bits * (level + 1)))) {
+        level++;
+    }
+    unsigned index = unsigned(expires >> (slot_bits * level)) & (slots - 1);
+    Timer &head = slots_[level * slots + index];
+    timer.prev_ = head.prev_;
+    timer.next_ = &head;
+    head.prev_->next_ = &timer;
+    head.prev_ = &timer;
+    timer.expires_ = expires;
+    timer.slot_ = level * slots + index;
+    occupied_[level] |= std::uint64_t(1) << index;
+    size_++;
+}
+
+/**
+ * Unlinks the timer from its slot.
+ */
+void Timer_Wheel::unlink(Timer &timer) {
+    timer.prev_->next_ = timer.next_;
+    timer.next_->prev_ = timer.prev_;
+    Timer &head = slots_[timer.slot_];
+    if (head.next_ == &head) {
+        occupied_[timer.slot_ / slots] &= ~(std::uint64_t(1) << (timer.slot_ % slots));
+    }
+    timer.prev_ = timer.next_ = nullptr;
+    size_--;
+}
+
+/**
+ * Enters the next tick, moving the timers of the upper slots that start with it down a level.
+ */
+void Timer_Wheel::tick() {
+    current_++;
+    for (unsigned level = 1; level < levels; level++) {
+        // A slot of a level starts with the tick where all the levels below begin a new round.
+        if ((current_ >> (slot_bits * (level - 1))) & (slots - 1)) {
+            break;
+        }
+        Timer &head = slots_[level * slots + ((current_ >> (slot_bits * level)) & (slots - 1))];
+        while (head.next_ != &head) {
+            Timer &timer = *head.next_;
+            unlink(timer);
+            insert(timer, timer.expires_);
+        }
+    }
+}
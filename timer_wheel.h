@@ -0,0 +1,136 @@
+#ifndef TIMER_WHEEL_H_INCLUDED
+#define TIMER_WHEEL_H_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+#include <array>
+
+/**
+ * A hierarchical timing wheel keeping deadlines at a fixed resolution.
+ *
+ * Every level has 64 slots, each slot of a level spans a whole round of the level below. A timer is linked into
+ * the slot of the lowest level covering its deadline and moves down a level whenever the level below comes
+ * around to it, so scheduling, rescheduling and cancelling a timer are O(1) and advancing the wheel costs O(1)
+ * per tick plus at most one move per level for every timer. Deadlines are rounded up to the resolution, so a
+ * timer never fires early, and the ones beyond the reach of the top level fire when it ends.
+ */
+class Timer_Wheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * A timer that can be linked into the wheel, meant as the base of what it times. It has to be cancelled
+     * before it is destroyed.
+     */
+    class Timer
+    {
+    public:
+        Timer() = default;
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        bool scheduled() const {
+            return next_ != nullptr;
+        }
+    private:
+        friend class Timer_Wheel;
+        Timer *prev_ = nullptr;
+        Timer *next_ = nullptr;
+        std::uint64_t expires_ = 0;
+        std::uint32_t slot_ = 0;
+    };
+
+    /**
+     * Creates an empty wheel ticking at the given resolution from now on.
+     */
+    explicit Timer_Wheel(Clock::duration resolution, Clock::time_point now = Clock::now());
+    Timer_Wheel(const Timer_Wheel &) = delete;
+    Timer_Wheel &operator=(const Timer_Wheel &) = delete;
+
+    /**
+     * Makes the timer fire at the deadline, moving it if it is already scheduled.
+     */
+    void schedule(Timer &timer, Clock::time_point deadline);
+
+    /**
+     * Unlinks the timer if it is scheduled.
+     */
+    void cancel(Timer &timer);
+
+    /**
+     * Returns when a scheduled timer fires.
+     */
+    Clock::time_point expiry(const Timer &timer) const {
+        return start_ + timer.expires_ * resolution_;
+    }
+
+    /**
+     * Returns when the wheel has to be advanced next, either because a timer fires or because timers move
+     * down a level, or Clock::time_point::max() if it holds no timers.
+     */
+    Clock::time_point nextWakeup() const;
+
+    /**
+     * Fires every timer whose deadline is not after now, unlinking it and passing it to expire, which may
+     * schedule timers again.
+     */
+    template<class Expire>
+    void advance(Clock::time_point now, Expire &&expire);
+
+    std::size_t size() const {
+        return size_;
+    }
+private:
+    static constexpr unsigned slot_bits = 6;
+    static constexpr unsigned slots = 1 << slot_bits;
+    static constexpr unsigned levels = 4;
+    // Ticks the top level reaches ahead.
+    static constexpr std::uint64_t span = std::uint64_t(1) << (slot_bits * levels);
+
+    /**
+     * Links the timer into the slot covering its tick, which may not lie before the current one.
+     */
+    void insert(Timer &timer, std::uint64_t expires);
+
+    /**
+     * Unlinks the timer from its slot.
+     */
+    void unlink(Timer &timer);
+
+    /**
+     * Enters the next tick, moving the timers of the upper slots that start with it down a level.
+     */
+    void tick();
+
+    Clock::duration resolution_;
+    Clock::time_point start_;
+    // The last tick whose timers were fired.
+    std::uint64_t current_ = 0;
+    // Circular lists headed by the slots, whose timers are the ones they link to.
+    std::array<Timer, slots * levels> slots_;
+    // A bit per non-empty slot of every level.
+    std::array<std::uint64_t, levels> occupied_{};
+    std::size_t size_ = 0;
+};
+
+template<class Expire>
+void Timer_Wheel::advance(Clock::time_point now, Expire &&expire) {
+    auto target = std::uint64_t((now - start_) / resolution_);
+    while (current_ < target) {
+        if (size_ == 0) {
+            current_ = target;
+            return;
+        }
+        tick();
+        Timer &head = slots_[current_ & (slots - 1)];
+        // Every timer of the slot fires now, those expire schedules again land in later slots.
+        while (head.next_ != &head) {
+            Timer &timer = *head.next_;
+            unlink(timer);
+            expire(timer);
+        }
+    }
+}
+
+#endif // TIMER_WHEEL_H_INCLUDED
@@ -0,0 +1,417 @@
+#include "tls.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <stdexcept>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+
+// Largest plaintext of a TLS record, what small writes are coalesced up to.
+static constexpr std::size_t max_record_size = 16384;
+
+#ifdef HAVE_OPENSSL
+
+// The only protocol offered and accepted through ALPN, in its wire format.
+static constexpr unsigned char alpn_protocols[] = "\x08http/1.1";
+// Sessions of a server context are only resumed by connections of the same context.
+static constexpr unsigned char session_id_context[] = "Network_lab";
+
+static std::string lastError() {
+    unsigned long error = ERR_get_error();
+    ERR_clear_error();
+    if (error == 0) {
+        return "unknown error";
+    }
+    char message[256];
+    ERR_error_string_n(error, message, sizeof(message));
+    return message;
+}
+
+/**
+ * Picks http/1.1 if the client offers it and refuses the connection otherwise, since nothing else is spoken.
+ */
+static int selectAlpn(SSL *, const unsigned char **out, unsigned char *out_length, const unsigned char *in,
+                      unsigned int in_length, void *) {
+    unsigned char *selected = nullptr;
+    if (SSL_select_next_proto(&selected, out_length, alpn_protocols, sizeof(alpn_protocols) - 1, in, in_length) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Applies what servers and clients have in common to a new context.
+ */
+static void configure(SSL_CTX *ctx) {
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    uint64_t options = SSL_OP_NO_RENEGOTIATION;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // A peer closing without close_notify is as good as one closing a plaintext connection.
+    options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    // Hands the record layer to the kernel after the handshake where the tls module is loaded.
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(ctx, options);
+    // Writes behave like send on a non-blocking socket: they may be partial and are retried from buffers that
+    // moved in the meantime. Idle connections give their record buffers back.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+}
+
+std::shared_ptr<Tls_Context> Tls_Context::server(const std::string &cert_file, const std::string &key_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == nullptr) {
+        throw std::runtime_error("SSL_CTX_new failed: " + lastError() + "\n");
+    }
+    std::shared_ptr<Tls_Context> context(new Tls_Context(ctx, true));
+    configure(ctx);
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1) {
+        throw std::runtime_error("Loading certificate " + cert_file + " failed: " + lastError() + "\n");
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        throw std::runtime_error("Loading private key " + key_file + " failed: " + lastError() + "\n");
+    }
+    // Tickets are stateless, the server cache additionally resumes TLS 1.2 clients by session id.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_alpn_select_cb(ctx, selectAlpn, nullptr);
+    return context;
+}
+
+std::shared_ptr<Tls_Context> Tls_Context::client(const std::string &ca_file, bool verify) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == nullptr) {
+        throw std::runtime_error("SSL_CTX_new failed: " + lastError() + "\n");
+    }
+    std::shared_ptr<Tls_Context> context(new Tls_Context(ctx, false));
+    configure(ctx);
+    if (verify) {
+        int loaded = ca_file.empty() ? SSL_CTX_set_default_verify_paths(ctx)
+                                     : SSL_CTX_load_verify_locations(ctx, ca_file.c_str(), nullptr);
+        if (loaded != 1) {
+            throw std::runtime_error("Loading CA certificates failed: " + lastError() + "\n");
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    }
+    // Sessions are kept per server by the context itself, see keepSession.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, Tls_Session::onNewSession);
+    return context;
+}
+
+Tls_Context::~Tls_Context() {
+    for (auto &[peer, session]: sessions_) {
+        SSL_SESSION_free(session);
+    }
+    SSL_CTX_free(ctx_);
+}
+
+ssl_session_st *Tls_Context::findSession(const std::string &peer) {
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    auto it = sessions_.find(peer);
+    if (it == sessions_.end()) {
+        return nullptr;
+    }
+    SSL_SESSION_up_ref(it->second);
+    return it->second;
+}
+
+void Tls_Context::keepSession(const std::string &peer, ssl_session_st *session) {
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+    auto [it, inserted] = sessions_.try_emplace(peer, session);
+    if (!inserted) {
+        SSL_SESSION_free(it->second);
+        it->second = session;
+    }
+}
+
+Tls_Session::Tls_Session(std::shared_ptr<Tls_Context> context, SOCKET socket, const std::string &host,
+                         const std::string &peer) : context_(std::move(context)), peer_(peer) {
+    ssl_ = SSL_new(context_->native());
+    if (ssl_ == nullptr) {
+        throw std::runtime_error("SSL_new failed: " + lastError() + "\n");
+    }
+    SSL_set_app_data(ssl_, this);
+    if (SSL_set_fd(ssl_, int(socket)) != 1) {
+        SSL_free(ssl_);
+        throw std::runtime_error("SSL_set_fd failed: " + lastError() + "\n");
+    }
+    if (context_->isServer()) {
+        SSL_set_accept_state(ssl_);
+        return;
+    }
+    SSL_set_connect_state(ssl_);
+    if (!host.empty()) {
+        // SNI carries host names only, addresses are verified against the IP entries of the certificate.
+        ASN1_OCTET_STRING *address = a2i_IPADDRESS(host.c_str());
+        if (address == nullptr) {
+            SSL_set_tlsext_host_name(ssl_, host.c_str());
+            SSL_set1_host(ssl_, host.c_str());
+        } else {
+            ASN1_OCTET_STRING_free(address);
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl_), host.c_str());
+        }
+    }
+    SSL_set_alpn_protos(ssl_, alpn_protocols, sizeof(alpn_protocols) - 1);
+    if (!peer_.empty()) {
+        if (SSL_SESSION *session = context_->findSession(peer_)) {
+            SSL_set_session(ssl_, session);
+            SSL_SESSION_free(session);
+        }
+    }
+}
+
+Tls_Session::~Tls_Session() {
+    SSL_free(ssl_);
+}
+
+int Tls_Session::onNewSession(ssl_st *ssl, ssl_session_st *session) {
+    auto *self = static_cast<Tls_Session *>(SSL_get_app_data(ssl));
+    if (self == nullptr || self->peer_.empty()) {
+        return 0;
+    }
+    self->context_->keepSession(self->peer_, session);
+    return 1;
+}
+
+Handshake_Status Tls_Session::handshake() {
+    int result = SSL_do_handshake(ssl_);
+    if (result == 1) {
+        established_ = true;
+        wants_write_ = false;
+        return Handshake_Status::Done;
+    }
+    switch (SSL_get_error(ssl_, result)) {
+        case SSL_ERROR_WANT_READ:
+            wants_write_ = false;
+            return Handshake_Status::Want_Read;
+        case SSL_ERROR_WANT_WRITE:
+            wants_write_ = true;
+            return Handshake_Status::Want_Write;
+        default:
+            ERR_clear_error();
+            failed_ = true;
+            return Handshake_Status::Failed;
+    }
+}
+
+bool Tls_Session::resumed() const {
+    return SSL_session_reused(ssl_) == 1;
+}
+
+bool Tls_Session::kernelSend() const {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl_));
+}
+
+bool Tls_Session::kernelReceive() const {
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+}
+
+long Tls_Session::fail(int result) {
+    switch (SSL_get_error(ssl_, result)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+            wants_write_ = false;
+            errno = EAGAIN;
+            return SOCKET_ERROR;
+        case SSL_ERROR_WANT_WRITE:
+            wants_write_ = true;
+            errno = EAGAIN;
+            return SOCKET_ERROR;
+        default:
+            ERR_clear_error();
+            failed_ = true;
+            errno = ECONNRESET;
+            return SOCKET_ERROR;
+    }
+}
+
+long Tls_Session::read(char *buff, std::size_t size) {
+    int result = SSL_read(ssl_, buff, int(std::min<std::size_t>(size, INT_MAX)));
+    return result > 0 ? result : fail(result);
+}
+
+long Tls_Session::write(const IO_Buffer *buffers, int count) {
+    long sent = 0;
+    int index = 0;
+    std::size_t offset = 0;
+    while (index < count) {
+        const char *data;
+        std::size_t size;
+        std::size_t remaining = ioBufferSize(buffers[index]) - offset;
+        if (remaining >= max_record_size) {
+            data = ioBufferData(buffers[index]) + offset;
+            size = remaining;
+        } else {
+            // Copying up to a full record keeps small heads and chunks from going out as records of their own. A
+            // retry sees the same bytes at the front, or more of them, as OpenSSL requires.
+            staging_.clear();
+            for (int i = index; i < count && staging_.size() < max_record_size; i++) {
+                std::size_t from = i == index ? offset : 0;
+                std::size_t take = std::min(ioBufferSize(buffers[i]) - from, max_record_size - staging_.size());
+                staging_.append(ioBufferData(buffers[i]) + from, take);
+            }
+            data = staging_.data();
+            size = staging_.size();
+        }
+        if (size == 0) {
+            index++;
+            offset = 0;
+            continue;
+        }
+        int result = SSL_write(ssl_, data, int(std::min<std::size_t>(size, INT_MAX)));
+        if (result <= 0) {
+            if (sent > 0) {
+                ERR_clear_error();
+                return sent;
+            }
+            long failed = fail(result);
+            if (failed == 0) {
+                errno = EPIPE;
+                return SOCKET_ERROR;
+            }
+            return failed;
+        }
+        sent += result;
+        // Skip what went out over the buffers.
+        std::size_t written = std::size_t(result);
+        while (written > 0 && index < count) {
+            std::size_t step = std::min(written, ioBufferSize(buffers[index]) - offset);
+            written -= step;
+            offset += step;
+            if (offset == ioBufferSize(buffers[index])) {
+                index++;
+                offset = 0;
+            }
+        }
+        if (std::size_t(result) < size) {
+            return sent;
+        }
+    }
+    return sent;
+}
+
+long Tls_Session::sendFile(const File_Handle &file, std::uint64_t offset, std::size_t size) {
+    int result;
+#ifdef SSL_OP_ENABLE_KTLS
+    if (kernelSend()) {
+        ossl_ssize_t sent = SSL_sendfile(ssl_, file.fd(), off_t(offset), size, 0);
+        if (sent > 0) {
+            return long(sent);
+        }
+        result = int(sent);
+    } else
+#endif
+    {
+        staging_.resize(std::min(size, max_record_size));
+        long read = file.read_at(staging_.data(), staging_.size(), offset);
+        if (read <= 0) {
+            // The file shrank or cannot be read, the response cannot be completed.
+            errno = EIO;
+            return SOCKET_ERROR;
+        }
+        result = SSL_write(ssl_, staging_.data(), int(read));
+        if (result > 0) {
+            return result;
+        }
+    }
+    long failed = fail(result);
+    if (failed == 0) {
+        errno = EPIPE;
+        return SOCKET_ERROR;
+    }
+    return failed;
+}
+
+bool Tls_Session::pending() const {
+    return SSL_pending(ssl_) > 0 || SSL_has_pending(ssl_) == 1;
+}
+
+void Tls_Session::shutdown() {
+    // A second SSL_shutdown would wait for the close_notify of the peer.
+    if (established_ && !failed_ && !(SSL_get_shutdown(ssl_) & SSL_SENT_SHUTDOWN)) {
+        SSL_shutdown(ssl_);
+        ERR_clear_error();
+    }
+}
+
+#else
+
+std::shared_ptr<Tls_Context> Tls_Context::server(const std::string &, const std::string &) {
+    throw std::runtime_error("TLS is not available, OpenSSL was not found at build time\n");
+}
+
+std::shared_ptr<Tls_Context> Tls_Context::client(const std::string &, bool) {
+    throw std::runtime_error("TLS is not available, OpenSSL was not found at build time\n");
+}
+
+Tls_Context::~Tls_Context() = default;
+
+ssl_session_st *Tls_Context::findSession(const std::string &) {
+    return nullptr;
+}
+
+void Tls_Context::keepSession(const std::string &, ssl_session_st *) {}
+
+Tls_Session::Tls_Session(std::shared_ptr<Tls_Context>, SOCKET, const std::string &, const std::string &)
+        : ssl_(nullptr) {
+    throw std::runtime_error("TLS is not available, OpenSSL was not found at build time\n");
+}
+
+Tls_Session::~Tls_Session() = default;
+
+int Tls_Session::onNewSession(ssl_st *, ssl_session_st *) {
+    return 0;
+}
+
+Handshake_Status Tls_Session::handshake() {
+    return Handshake_Status::Failed;
+}
+
+bool Tls_Session::resumed() const {
+    return false;
+}
+
+bool Tls_Session::kernelSend() const {
+    return false;
+}
+
+bool Tls_Session::kernelReceive() const {
+    return false;
+}
+
+long Tls_Session::fail(int) {
+    errno = ENOTCONN;
+    return SOCKET_ERROR;
+}
+
+long Tls_Session::read(char *, std::size_t) {
+    return fail(0);
+}
+
+long Tls_Session::write(const IO_Buffer *, int) {
+    return fail(0);
+}
+
+long Tls_Session::sendFile(const File_Handle &, std::uint64_t, std::size_t) {
+    return fail(0);
+}
+
+bool Tls_Session::pending() const {
+    return false;
+}
+
+void Tls_Session::shutdown() {}
+
+#endif
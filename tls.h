@@ -0,0 +1,184 @@
+#ifndef TLS_H_INCLUDED
+#define TLS_H_INCLUDED
+
+#include "platform.h"
+#include "file_body.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// OpenSSL types, so including this header does not pull in OpenSSL.
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+
+/**
+ * The TLS setup shared by every connection of a server or a client, built on OpenSSL. Only available where the
+ * library was found at build time, creating one elsewhere throws.
+ *
+ * Both sides negotiate http/1.1 through ALPN. Servers hand out session tickets, encrypted with keys shared by every
+ * connection of the context, and clients keep the last session of every server, so reconnecting skips the full
+ * handshake. Where the kernel supports it, the record layer of a connection is offloaded to kernel TLS once the
+ * handshake is done, so files are sent with sendfile without being copied into user space.
+ */
+class Tls_Context
+{
+public:
+    /**
+     * Creates the context of a server presenting the certificate chain and private key in the given PEM files.
+     * Throws std::runtime_error if they cannot be loaded.
+     */
+    static std::shared_ptr<Tls_Context> server(const std::string &cert_file, const std::string &key_file);
+
+    /**
+     * Creates the context of a client verifying servers against the CA certificates in the given PEM file, or
+     * the default ones of the system if it is empty. Without verify any certificate is accepted, e.g. a
+     * self-signed one when testing.
+     */
+    static std::shared_ptr<Tls_Context> client(const std::string &ca_file = "", bool verify = true);
+
+    Tls_Context(const Tls_Context &) = delete;
+    Tls_Context &operator=(const Tls_Context &) = delete;
+    ~Tls_Context();
+
+    bool isServer() const {
+        return server_;
+    }
+
+    ssl_ctx_st *native() const {
+        return ctx_;
+    }
+
+    /**
+     * Returns the session last established with the given server to resume it, nullptr if there is none. The
+     * caller owns a reference to it.
+     */
+    ssl_session_st *findSession(const std::string &peer);
+
+    /**
+     * Remembers a session established with the given server, taking over the reference to it.
+     */
+    void keepSession(const std::string &peer, ssl_session_st *session);
+private:
+    Tls_Context(ssl_ctx_st *ctx, bool server) : ctx_(ctx), server_(server) {}
+
+    ssl_ctx_st *ctx_;
+    bool server_;
+    // The last session of every server a client connected to.
+    std::mutex sessions_mutex_;
+    std::unordered_map<std::string, ssl_session_st *> sessions_;
+};
+
+/**
+ * Outcome of advancing a handshake.
+ */
+enum class Handshake_Status
+{
+    Done, Want_Read, Want_Write, Failed
+};
+
+/**
+ * The TLS state of a single connection over a socket it does not own, blocking or not as the socket is.
+ *
+ * Reads and writes follow the conventions of recv and send: they return the number of bytes transferred, 0 once
+ * the peer closed the connection, or SOCKET_ERROR with errno set to EAGAIN if a non-blocking socket has to become
+ * readable or writable first, to anything else if the connection failed. A write that failed with EAGAIN has to be
+ * repeated with the same bytes at its front.
+ */
+class Tls_Session
+{
+public:
+    /**
+     * Starts the server or client side of a connection on the socket as the context is for. A client names the
+     * server it connects to for SNI and certificate verification and resumes the last session with peer, if any.
+     * Throws std::runtime_error if OpenSSL cannot create the connection.
+     */
+    Tls_Session(std::shared_ptr<Tls_Context> context, SOCKET socket, const std::string &host = "",
+                const std::string &peer = "");
+    Tls_Session(const Tls_Session &) = delete;
+    Tls_Session &operator=(const Tls_Session &) = delete;
+    ~Tls_Session();
+
+    /**
+     * Advances the handshake as far as the socket allows, a blocking socket runs it to the end.
+     */
+    Handshake_Status handshake();
+
+    bool established() const {
+        return established_;
+    }
+
+    /**
+     * Whether the last step of the handshake waits for the socket to become writable, rather than readable.
+     */
+    bool wantsWrite() const {
+        return wants_write_;
+    }
+
+    /**
+     * Whether the handshake resumed an earlier session instead of running in full.
+     */
+    bool resumed() const;
+
+    /**
+     * Whether the kernel encrypts what is sent, which lets files go out with sendfile.
+     */
+    bool kernelSend() const;
+
+    /**
+     * Whether the kernel decrypts what is received.
+     */
+    bool kernelReceive() const;
+
+    long read(char *buff, std::size_t size);
+
+    /**
+     * Sends the buffers, coalescing small ones into full records.
+     */
+    long write(const IO_Buffer *buffers, int count);
+
+    /**
+     * Sends up to size bytes of the file at the given offset, with sendfile if the kernel encrypts, otherwise
+     * a record at a time through a buffer.
+     */
+    long sendFile(const File_Handle &file, std::uint64_t offset, std::size_t size);
+
+    /**
+     * Whether received bytes are buffered that the socket will not report as readable anymore, so read has to
+     * be called again without waiting.
+     */
+    bool pending() const;
+
+    /**
+     * Sends close_notify without waiting for the peer's, unless the connection failed. OpenSSL only lets sessions
+     * of connections closed this way be resumed.
+     */
+    void shutdown();
+private:
+    friend class Tls_Context;
+
+    /**
+     * Keeps a session a client received for resuming it later, called by OpenSSL.
+     */
+    static int onNewSession(ssl_st *ssl, ssl_session_st *session);
+
+    /**
+     * Maps the error of an OpenSSL call that returned result onto the recv and send conventions.
+     */
+    long fail(int result);
+
+    std::shared_ptr<Tls_Context> context_;
+    ssl_st *ssl_;
+    // Where a client keeps the session it established.
+    std::string peer_;
+    bool established_ = false;
+    bool wants_write_ = false;
+    // A fatal error occurred, nothing may be sent anymore.
+    bool failed_ = false;
+    // Small buffers and file pieces are copied here to go out as full records.
+    std::string staging_;
+};
+
+#endif // TLS_H_INCLUDED
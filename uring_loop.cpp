@@ -0,0 +1,684 @@
+#include "uring_loop.h"
+
+#ifdef HAVE_IO_URING
+
+#include "debugger.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+// Entries of the submission queue, the completion queue gets twice as many.
+constexpr unsigned ring_entries = 1024;
+// Provided receive buffers per loop, a power of two as the buffer ring requires, and their size.
+constexpr unsigned provided_buffer_count = 512;
+constexpr unsigned provided_buffer_size = 1 << 14;
+constexpr unsigned short buffer_group = 0;
+// Most connections a loop keeps in its registered file table.
+constexpr unsigned max_ring_connections = 1 << 14;
+// Largest pipe requested for splicing file bodies, which bounds a single splice.
+constexpr int max_pipe_size = 1 << 20;
+// Passed as the offset of a splice end that has none.
+constexpr std::uint64_t no_offset = ~std::uint64_t(0);
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                      const void *arg = nullptr, std::size_t arg_size = 0) {
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uringRegister(int ring_fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/**
+ * Sets up a ring that accepts from the given listening socket and answers requests using the handlers,
+ * on the worker pool if there is one. Throws std::runtime_error if the kernel lacks io_uring or one of the
+ * features the loop relies on.
+ */
+Uring_Loop::Uring_Loop(SOCKET listen_socket, const Server::Handler &handler, const Body_Handler &body_handler,
+                       const Server_Options &options, Worker_Pool *workers)
+        : Server_Loop(handler, body_handler, options, workers), listen_socket_(listen_socket) {
+    auto fail = [this](const std::string &what) {
+        std::string err_msg = what + " failed: " + std::to_string(errno) + "\n";
+        teardown();
+        throw std::runtime_error(err_msg);
+    };
+    struct io_uring_params params{};
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    ring_fd_ = uringSetup(ring_entries, &params);
+    if (ring_fd_ == -1) {
+        fail("io_uring_setup");
+    }
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        errno = ENOSYS;
+        fail("io_uring feature check");
+    }
+
+    // Both queues live in one mapping, the submission entries in another.
+    rings_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                           params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    void *rings = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                       IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        fail("mmap of the rings");
+    }
+    rings_ = rings;
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        fail("mmap of the submission entries");
+    }
+    sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+    char *base = static_cast<char *>(rings_);
+    sq_head_ = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    sq_array_ = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    sq_mask_ = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    cq_head_ = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(base + params.cq_off.cqes);
+    sq_local_tail_ = *sq_tail_;
+    completions_.reserve(params.cq_entries);
+
+    // A kernel may be built without some of the operations even if it knows them.
+    std::vector<char> probe_memory(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    auto *probe = reinterpret_cast<struct io_uring_probe *>(probe_memory.data());
+    if (uringRegister(ring_fd_, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        fail("io_uring probe");
+    }
+    for (unsigned op: {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SEND, IORING_OP_SPLICE,
+                       IORING_OP_SHUTDOWN, IORING_OP_CLOSE, IORING_OP_TIMEOUT, IORING_OP_READ}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            errno = ENOSYS;
+            fail("io_uring probe of operation " + std::to_string(op));
+        }
+    }
+
+    // A sparse file table the accepted sockets are allocated in. Sparse registration, the buffer ring and
+    // multishot accept arrived in the same kernel release, so the registrations failing also rules out the
+    // latter on older kernels.
+    struct rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    struct io_uring_rsrc_register files{};
+    files.nr = unsigned(std::min<rlim_t>(limit.rlim_cur, max_ring_connections));
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (uringRegister(ring_fd_, IORING_REGISTER_FILES2, &files, sizeof(files)) == -1) {
+        fail("io_uring file registration");
+    }
+    connections_.resize(files.nr);
+
+    void *buf_ring = mmap(nullptr, provided_buffer_count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        fail("mmap of the buffer ring");
+    }
+    buf_ring_ = static_cast<struct io_uring_buf_ring *>(buf_ring);
+    void *buffers = mmap(nullptr, std::size_t(provided_buffer_count) * provided_buffer_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        fail("mmap of the provided buffers");
+    }
+    buffers_ = static_cast<char *>(buffers);
+    struct io_uring_buf_reg buf_reg{};
+    buf_reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring_);
+    buf_reg.ring_entries = provided_buffer_count;
+    buf_reg.bgid = buffer_group;
+    if (uringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &buf_reg, 1) == -1) {
+        fail("io_uring buffer ring registration");
+    }
+    for (unsigned i = 0; i < provided_buffer_count; i++) {
+        recycleBuffer((unsigned short) i);
+    }
+
+    // Sockets accepted into the file table cannot be configured, they inherit the option from the listener.
+    int one = 1;
+    setsockopt(listen_socket_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/**
+ * Tears down the ring, which closes every connection in its file table.
+ */
+Uring_Loop::~Uring_Loop() {
+    teardown();
+}
+
+/**
+ *  Unmaps the rings and the buffers and closes the ring, whatever part of them was set up.
+ */
+void Uring_Loop::teardown() {
+    for (auto &conn: connections_) {
+        if (conn && conn->pipe[0] != -1) {
+            close(conn->pipe[0]);
+            close(conn->pipe[1]);
+        }
+    }
+    connections_.clear();
+    if (ring_fd_ != -1) {
+        close(ring_fd_);
+        ring_fd_ = -1;
+    }
+    if (buffers_) {
+        munmap(buffers_, std::size_t(provided_buffer_count) * provided_buffer_size);
+        buffers_ = nullptr;
+    }
+    if (buf_ring_) {
+        munmap(buf_ring_, provided_buffer_count * sizeof(struct io_uring_buf));
+        buf_ring_ = nullptr;
+    }
+    if (sqes_) {
+        munmap(sqes_, sqes_size_);
+        sqes_ = nullptr;
+    }
+    if (rings_) {
+        munmap(rings_, rings_size_);
+        rings_ = nullptr;
+    }
+}
+
+/**
+ * A blocking function call that runs the loop forever.
+ */
+[[noreturn]] void Uring_Loop::run() {
+    armAccept();
+    if (wake_fd_ != -1) {
+        armWake();
+    }
+    while (true) {
+        submit(1);
+        now_ = Timer_Wheel::Clock::now();
+        takeCompletions();
+        // Handling may take more completions while it waits for free submission entries, they are appended.
+        for (std::size_t i = 0; i < completions_.size(); i++) {
+            struct io_uring_cqe cqe = completions_[i];
+            handleCompletion(cqe);
+        }
+        completions_.clear();
+        // Every receive handled above gave its buffer back, so the starved ones find one now.
+        for (unsigned slot: starved_) {
+            Connection *conn = connections_[slot].get();
+            if (conn && !conn->closing && !conn->receiving && conn->sending == 0) {
+                armReceive(*conn);
+            }
+        }
+        starved_.clear();
+        expireConnections([this](Server_Loop::Connection &conn) {
+            closeConnection(static_cast<Connection &>(conn));
+        });
+    }
+}
+
+/**
+ *  Returns a free submission queue entry, submitting the queued ones first if there are not enough
+ *  free entries for a chain of count of them. Throws if the kernel fails to take them.
+ */
+struct io_uring_sqe *Uring_Loop::getSqe(unsigned count) {
+    while (sq_entries_ - (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)) < count) {
+        // With the completion queue overflowed the kernel refuses new entries with EBUSY until it has room again.
+        // The completions are taken instead of handled here, handling one could close the connection being
+        // queued on.
+        takeCompletions();
+        int submitted = uringEnter(ring_fd_, to_submit_, 0, IORING_ENTER_GETEVENTS);
+        if (submitted >= 0) {
+            to_submit_ -= unsigned(submitted);
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            throw std::runtime_error("io_uring_enter failed: " + std::to_string(errno) + "\n");
+        }
+    }
+    unsigned index = sq_local_tail_ & sq_mask_;
+    struct io_uring_sqe *sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    sq_local_tail_++;
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    to_submit_++;
+    return sqe;
+}
+
+/**
+ *  Moves the completions of the completion queue to completions_, handing their entries back to the kernel.
+ */
+void Uring_Loop::takeCompletions() {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        completions_.push_back(cqes_[head & cq_mask_]);
+        head++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+/**
+ *  Queues an operation on the connection, counting it as pending.
+ */
+struct io_uring_sqe *Uring_Loop::queueOp(Connection &conn, Op op, unsigned count) {
+    struct io_uring_sqe *sqe = getSqe(count);
+    sqe->user_data = (std::uint64_t(conn.slot) << 8) | std::uint64_t(op);
+    conn.pending++;
+    return sqe;
+}
+
+/**
+ *  Submits the queued entries and waits for wait_for completions, but no longer than until the next deadline.
+ */
+void Uring_Loop::submit(unsigned wait_for) {
+    int submitted;
+    int timeout = wait_for ? timerTimeout() : -1;
+    if (timeout >= 0) {
+        struct __kernel_timespec ts{};
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        struct io_uring_getevents_arg arg{};
+        arg.ts = reinterpret_cast<std::uint64_t>(&ts);
+        submitted = uringEnter(ring_fd_, to_submit_, wait_for, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                               &arg, sizeof(arg));
+    } else {
+        submitted = uringEnter(ring_fd_, to_submit_, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0);
+    }
+    if (submitted >= 0) {
+        to_submit_ -= unsigned(submitted);
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME) {
+        Err("io_uring_enter failed: %d", errno);
+    }
+}
+
+void Uring_Loop::handleCompletion(const struct io_uring_cqe &cqe) {
+    auto op = Op(cqe.user_data & 0xff);
+    auto slot = unsigned(cqe.user_data >> 8);
+    switch (op) {
+        case Op::Accept:
+            if (cqe.res >= 0) {
+                openConnection(unsigned(cqe.res));
+            } else if (cqe.res != -ENFILE) {
+                Err("accept failed: %d", -cqe.res);
+            }
+            // The accept stops on errors. A full file table lets it rest until a connection is closed.
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                accepting_ = false;
+                if (cqe.res != -ENFILE) {
+                    armAccept();
+                }
+            }
+            return;
+        case Op::Close:
+            if (cqe.res < 0) {
+                Err("close failed: %d", -cqe.res);
+            }
+            return;
+        case Op::Wake:
+            if (cqe.res < 0) {
+                Err("eventfd read failed: %d", -cqe.res);
+            }
+            armWake();
+            handleWake();
+            return;
+        default:
+            break;
+    }
+    Connection &conn = *connections_[slot];
+    conn.pending--;
+    if (op == Op::Receive) {
+        handleReceive(conn, cqe);
+    } else if (op != Op::Shutdown) {
+        handleSend(conn, op, cqe.res);
+    }
+    if (!conn.closing) {
+        updateDeadline(conn);
+    } else if (conn.pending == 0) {
+        releaseConnection(conn);
+    }
+}
+
+void Uring_Loop::armAccept() {
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_socket_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = std::uint64_t(Op::Accept);
+    accepting_ = true;
+}
+
+void Uring_Loop::armReceive(Connection &conn) {
+    struct io_uring_sqe *sqe = queueOp(conn, Op::Receive);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = int(conn.slot);
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    sqe->len = provided_buffer_size;
+    conn.receiving = true;
+}
+
+/**
+ *  Queues a read of wake_fd_, which completes once a worker finished a job.
+ */
+void Uring_Loop::armWake() {
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd_;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&wake_count_);
+    sqe->len = sizeof(wake_count_);
+    sqe->off = no_offset;
+    sqe->user_data = std::uint64_t(Op::Wake);
+}
+
+/**
+ *  Sends the responses the workers finished and moves their connections on. The completed read already reset
+ *  the eventfd, so a job finished from now on signals again.
+ */
+void Uring_Loop::handleWake() {
+    finishJobs([this](Server_Loop::Connection &loop_conn) {
+        auto &conn = static_cast<Connection &>(loop_conn);
+        if (conn.closing) {
+            return;
+        }
+        if (conn.sending == 0) {
+            advance(conn);
+        }
+        if (!conn.closing) {
+            updateDeadline(conn);
+        }
+    });
+}
+
+/**
+ *  Sets up a connection for a socket accepted into the given slot of the file table.
+ */
+void Uring_Loop::openConnection(unsigned slot) {
+    auto conn = std::make_unique<Connection>(&arena_pool_);
+    conn->slot = slot;
+    updateDeadline(*conn);
+    armReceive(*conn);
+    connections_[slot] = std::move(conn);
+    threadMetrics().accepted.add();
+}
+
+/**
+ *  Hands the provided buffer with the given id back to the ring for the next receives.
+ */
+void Uring_Loop::recycleBuffer(unsigned short id) {
+    // Only this thread writes the tail, the kernel only reads it.
+    unsigned short tail = buf_ring_->tail;
+    // The entries are indexed by hand, the flexible array member of the header is misplaced when compiled as C++.
+    struct io_uring_buf &buffer = reinterpret_cast<struct io_uring_buf *>(buf_ring_)[tail & (provided_buffer_count - 1)];
+    buffer.addr = reinterpret_cast<std::uint64_t>(buffers_ + std::size_t(id) * provided_buffer_size);
+    buffer.len = provided_buffer_size;
+    buffer.bid = id;
+    __atomic_store_n(&buf_ring_->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ *  Takes the received bytes out of a provided buffer and hands the buffer back to the ring. They are copied
+ *  into the input of the connection because a message is framed in place there, and a provided buffer held
+ *  until its message completes would starve the receives of the other connections.
+ */
+void Uring_Loop::handleReceive(Connection &conn, const struct io_uring_cqe &cqe) {
+    conn.receiving = false;
+    bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+    auto id = (unsigned short) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    if (cqe.res > 0 && has_buffer && !conn.closing) {
+        auto [space, space_size] = conn.in.prepare(cqe.res);
+        std::memcpy(space, buffers_ + std::size_t(id) * provided_buffer_size, cqe.res);
+        conn.in.commit(cqe.res);
+        threadMetrics().bytes_in.add(cqe.res);
+        recycleBuffer(id);
+        advance(conn);
+        return;
+    }
+    if (has_buffer) {
+        recycleBuffer(id);
+    }
+    if (conn.closing) {
+        return;
+    }
+    if (cqe.res == -ENOBUFS) {
+        starved_.push_back(conn.slot);
+        return;
+    }
+    if (cqe.res == 0) {
+        Debug("Connection closed");
+    } else {
+        Err("recv failed: %d", -cqe.res);
+    }
+    closeConnection(conn);
+}
+
+/**
+ *  Counts a completed send of the connection, closing it if the send failed.
+ */
+void Uring_Loop::handleSend(Connection &conn, Op op, int result) {
+    conn.sending--;
+    if (conn.closing) {
+        return;
+    }
+    if (result == -ECANCELED) {
+        // The send linked before this one fell short, what is left is sent again below.
+    } else if (result < 0) {
+        Err("send failed: %d", -result);
+        closeConnection(conn);
+        return;
+    } else {
+        Debug("Bytes Sent: %d", result);
+        if (op != Op::Splice_File) {
+            threadMetrics().bytes_out.add(result);
+        }
+        Output &front = conn.out[conn.out_begin];
+        switch (op) {
+            case Op::Send:
+                commitSent(conn, result);
+                break;
+            case Op::Send_Chunk:
+                front.chunk_begin += result;
+                break;
+            case Op::Splice_File:
+                if (result == 0) {
+                    Err("file shrank while being sent");
+                    closeConnection(conn);
+                    return;
+                }
+                conn.piped += result;
+                break;
+            case Op::Splice_Socket:
+                conn.piped -= result;
+                front.sent += result;
+                if (front.sent == front.head.size() + front.response.body_size()) {
+                    retireFront(conn);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    if (conn.sending == 0) {
+        advance(conn);
+    }
+}
+
+/**
+ *  Moves the connection on once no send is in flight: sends the queued output, answers the buffered
+ *  requests once it is sent and receives more input once they are used up. Nothing is received while
+ *  output is pending, so a client that does not read its answers cannot make the server queue more.
+ */
+void Uring_Loop::advance(Connection &conn) {
+    while (!conn.closing && conn.sending == 0) {
+        if (conn.out_begin < conn.out.size()) {
+            if (!conn.out[conn.out_begin].ready) {
+                // Sent once the worker answering it is done.
+                return;
+            }
+            submitOutput(conn);
+            continue;
+        }
+        // Give the memory back while the connection is idle.
+        releaseOutput(conn);
+        if (conn.close_after_send) {
+            closeConnection(conn);
+            return;
+        }
+        processInput(conn);
+        if (conn.out.empty()) {
+            if (!conn.receiving) {
+                armReceive(conn);
+            }
+            return;
+        }
+    }
+}
+
+/**
+ *  Queues the sends of the pending output, a gather of its in-memory parts, the next piece of a
+ *  streamed body or the splices of a file body.
+ */
+void Uring_Loop::submitOutput(Connection &conn) {
+    Output &front = conn.out[conn.out_begin];
+    std::size_t front_memory = front.head.size() + front.response.get_body().size();
+    if (front.sent >= front_memory && front.response.get_stream_body()) {
+        // Only one piece is buffered at a time, the stream is asked for the next one once it is sent.
+        while (front.chunk_begin == front.chunk.size()) {
+            if (front.stream_done) {
+                retireFront(conn);
+                return;
+            }
+            front.chunk_begin = write_chunk(front.response.get_stream_body(), front.chunk, stream_chunk_size,
+                                            front.stream_done);
+        }
+        struct io_uring_sqe *sqe = queueOp(conn, Op::Send_Chunk);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = int(conn.slot);
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = reinterpret_cast<std::uint64_t>(front.chunk.data() + front.chunk_begin);
+        sqe->len = unsigned(front.chunk.size() - front.chunk_begin);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        conn.sending++;
+        return;
+    }
+    if (front.sent >= front_memory) {
+        if (!openPipe(conn)) {
+            closeConnection(conn);
+            return;
+        }
+        queueFileSplices(conn, false);
+        return;
+    }
+    bool more;
+    int count = gatherOutput(conn, conn.buffers.data(), max_send_buffers, more);
+    // The file body of the front response follows its head in the same chain.
+    bool link = more && front.response.get_file_body().length != 0 && conn.piped == 0 && openPipe(conn);
+    conn.msg = {};
+    conn.msg.msg_iov = conn.buffers.data();
+    conn.msg.msg_iovlen = count;
+    struct io_uring_sqe *sqe = queueOp(conn, Op::Send, link ? 3 : 1);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = int(conn.slot);
+    sqe->flags = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+    sqe->addr = reinterpret_cast<std::uint64_t>(&conn.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    conn.sending++;
+    if (link) {
+        queueFileSplices(conn, true);
+    }
+}
+
+/**
+ *  Creates the pipe of the connection unless it has one already, returns false on failure.
+ */
+bool Uring_Loop::openPipe(Connection &conn) {
+    if (conn.pipe[0] != -1) {
+        return true;
+    }
+    if (pipe2(conn.pipe, O_CLOEXEC) == -1) {
+        Err("pipe failed: %d", errno);
+        return false;
+    }
+    // A larger pipe moves more of the file per splice, the size actually granted depends on the limits.
+    fcntl(conn.pipe[1], F_SETPIPE_SZ, max_pipe_size);
+    int size = fcntl(conn.pipe[1], F_GETPIPE_SZ);
+    conn.pipe_size = size > 0 ? std::size_t(size) : 1 << 16;
+    return true;
+}
+
+/**
+ *  Queues the splices moving the next piece of the file body of the front response through the pipe,
+ *  linked after the send queued just before if linked is set. The pipe has to be open.
+ */
+void Uring_Loop::queueFileSplices(Connection &conn, bool linked) {
+    std::size_t length = conn.piped;
+    if (length == 0) {
+        // The pipe is empty, so a piece no larger than it is never left waiting for room, which would
+        // stall the chain since the splice draining it only starts once this one completes.
+        const Output &front = conn.out[conn.out_begin];
+        std::size_t front_memory = front.head.size() + front.response.get_body().size();
+        const File_Range &file_body = front.response.get_file_body();
+        std::uint64_t file_sent = front.sent - std::min(front.sent, front_memory);
+        length = std::min<std::uint64_t>(file_body.length - file_sent, conn.pipe_size);
+        struct io_uring_sqe *sqe = queueOp(conn, Op::Splice_File, linked ? 1 : 2);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = conn.pipe[1];
+        sqe->off = no_offset;
+        sqe->splice_fd_in = file_body.file->fd();
+        sqe->splice_off_in = file_body.offset + file_sent;
+        sqe->len = unsigned(length);
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+        conn.sending++;
+    }
+    // Otherwise a previous splice into the socket fell short and the rest of its piece is sent first.
+    struct io_uring_sqe *sqe = queueOp(conn, Op::Splice_Socket);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = int(conn.slot);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->off = no_offset;
+    sqe->splice_fd_in = conn.pipe[0];
+    sqe->splice_off_in = no_offset;
+    sqe->len = unsigned(length);
+    sqe->splice_flags = SPLICE_F_MOVE;
+    conn.sending++;
+}
+
+/**
+ *  Shuts the connection down so its pending operations complete, it is closed once they have.
+ */
+void Uring_Loop::closeConnection(Connection &conn) {
+    if (conn.closing) {
+        return;
+    }
+    conn.closing = true;
+    timers_.cancel(conn);
+    struct io_uring_sqe *sqe = queueOp(conn, Op::Shutdown);
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = int(conn.slot);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->len = SHUT_RDWR;
+}
+
+/**
+ *  Closes the socket of a connection with nothing pending anymore and drops its state.
+ */
+void Uring_Loop::releaseConnection(Connection &conn) {
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = conn.slot + 1;
+    sqe->user_data = std::uint64_t(Op::Close);
+    if (conn.pipe[0] != -1) {
+        close(conn.pipe[0]);
+        close(conn.pipe[1]);
+    }
+    connections_[conn.slot].reset();
+    threadMetrics().closed.add();
+    // The slot is free again once the close is submitted, ahead of the accept.
+    if (!accepting_) {
+        armAccept();
+    }
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,213 @@
+#ifndef URING_LOOP_H_INCLUDED
+#define URING_LOOP_H_INCLUDED
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include "server_loop.h"
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <memory>
+#include <vector>
+#include <array>
+
+/**
+ * A single threaded loop doing all of its socket I/O through an io_uring, set up with the raw system calls.
+ *
+ * Connections are accepted by one multishot accept straight into the registered file table, so they never
+ * get a regular file descriptor and every operation on them skips the descriptor lookup. Receives take
+ * their memory from a provided buffer ring shared by all connections instead of holding a buffer each while
+ * they wait. The head of a response with a file body is sent linked to the splices moving the file through
+ * a pipe into the socket, so the whole response needs one submission and the file is never copied.
+ */
+class Uring_Loop : public Server_Loop
+{
+public:
+    /**
+     * Sets up a ring that accepts from the given listening socket and answers requests using the handlers,
+     * on the worker pool if there is one. Throws std::runtime_error if the kernel lacks io_uring or one of the
+     * features the loop relies on.
+     */
+    Uring_Loop(SOCKET listen_socket, const Server::Handler &handler, const Body_Handler &body_handler,
+               const Server_Options &options, Worker_Pool *workers);
+    Uring_Loop(const Uring_Loop &) = delete;
+    Uring_Loop &operator=(const Uring_Loop &) = delete;
+
+    /**
+     * Tears down the ring, which closes every connection in its file table.
+     */
+    ~Uring_Loop() override;
+
+    /**
+     * A blocking function call that runs the loop forever.
+     */
+    [[noreturn]] void run() override;
+private:
+    // Buffers gathered into a single send.
+    static constexpr int max_send_buffers = 64;
+
+    /**
+     * Operation a completion belongs to, kept in the low byte of its user data next to the connection slot.
+     */
+    enum class Op : std::uint8_t
+    {
+        Accept, Receive, Send, Send_Chunk, Splice_File, Splice_Socket, Shutdown, Close, Wake
+    };
+
+    /**
+     * State of a single client connection.
+     */
+    struct Connection : Server_Loop::Connection
+    {
+        using Server_Loop::Connection::Connection;
+
+        // Index of the socket in the registered file table.
+        unsigned slot;
+        // Submitted operations that have not completed yet, the connection lives until they have.
+        unsigned pending = 0;
+        // Sends in flight, the output is left alone until they complete.
+        unsigned sending = 0;
+        bool receiving = false;
+        // Shut down and closed once nothing is pending anymore.
+        bool closing = false;
+        // Pipe file bodies are spliced through, created for the first one. piped bytes of it are not sent yet.
+        int pipe[2] = {-1, -1};
+        std::size_t pipe_size = 0;
+        std::size_t piped = 0;
+        // Describes the gather send in flight.
+        struct msghdr msg{};
+        std::array<IO_Buffer, max_send_buffers> buffers{};
+    };
+
+    /**
+     *  Returns a free submission queue entry, submitting the queued ones first if there are not enough
+     *  free entries for a chain of count of them. Throws if the kernel fails to take them.
+     */
+    struct io_uring_sqe *getSqe(unsigned count = 1);
+
+    /**
+     *  Moves the completions of the completion queue to completions_, handing their entries back to the kernel.
+     */
+    void takeCompletions();
+
+    /**
+     *  Queues an operation on the connection, counting it as pending.
+     */
+    struct io_uring_sqe *queueOp(Connection &conn, Op op, unsigned count = 1);
+
+    /**
+     *  Submits the queued entries and waits for wait_for completions, but no longer than until the next
+     *  deadline.
+     */
+    void submit(unsigned wait_for);
+
+    /**
+     *  Unmaps the rings and the buffers and closes the ring, whatever part of them was set up.
+     */
+    void teardown();
+
+    void handleCompletion(const struct io_uring_cqe &cqe);
+
+    void armAccept();
+
+    void armReceive(Connection &conn);
+
+    /**
+     *  Queues a read of wake_fd_, which completes once a worker finished a job.
+     */
+    void armWake();
+
+    /**
+     *  Sends the responses the workers finished and moves their connections on.
+     */
+    void handleWake();
+
+    /**
+     *  Sets up a connection for a socket accepted into the given slot of the file table.
+     */
+    void openConnection(unsigned slot);
+
+    /**
+     *  Hands the provided buffer with the given id back to the ring for the next receives.
+     */
+    void recycleBuffer(unsigned short id);
+
+    /**
+     *  Takes the received bytes out of a provided buffer and hands the buffer back to the ring.
+     */
+    void handleReceive(Connection &conn, const struct io_uring_cqe &cqe);
+
+    /**
+     *  Counts a completed send of the connection, closing it if the send failed.
+     */
+    void handleSend(Connection &conn, Op op, int result);
+
+    /**
+     *  Moves the connection on once no send is in flight: sends the queued output, answers the buffered
+     *  requests once it is sent and receives more input once they are used up.
+     */
+    void advance(Connection &conn);
+
+    /**
+     *  Queues the sends of the pending output, a gather of its in-memory parts, the next piece of a
+     *  streamed body or the splices of a file body.
+     */
+    void submitOutput(Connection &conn);
+
+    /**
+     *  Creates the pipe of the connection unless it has one already, returns false on failure.
+     */
+    static bool openPipe(Connection &conn);
+
+    /**
+     *  Queues the splices moving the next piece of the file body of the front response through the pipe,
+     *  linked after the send queued just before if linked is set. The pipe has to be open.
+     */
+    void queueFileSplices(Connection &conn, bool linked);
+
+    /**
+     *  Shuts the connection down so its pending operations complete, it is closed once they have.
+     */
+    void closeConnection(Connection &conn);
+
+    /**
+     *  Closes the socket of a connection with nothing pending anymore and drops its state.
+     */
+    void releaseConnection(Connection &conn);
+
+    SOCKET listen_socket_;
+    int ring_fd_ = -1;
+    // The rings shared with the kernel.
+    void *rings_ = nullptr;
+    std::size_t rings_size_ = 0;
+    struct io_uring_sqe *sqes_ = nullptr;
+    std::size_t sqes_size_ = 0;
+    unsigned *sq_head_, *sq_tail_, *sq_array_, sq_mask_, sq_entries_;
+    unsigned *cq_head_, *cq_tail_, cq_mask_;
+    struct io_uring_cqe *cqes_;
+    unsigned sq_local_tail_ = 0;
+    unsigned to_submit_ = 0;
+    // The provided buffer ring and the memory of its buffers.
+    struct io_uring_buf_ring *buf_ring_ = nullptr;
+    char *buffers_ = nullptr;
+    // Whether the multishot accept is armed, it stops while the file table is full.
+    bool accepting_ = false;
+    // Where the read of wake_fd_ puts the count of the signals.
+    std::uint64_t wake_count_ = 0;
+    std::vector<std::unique_ptr<Connection>> connections_;
+    // Connections whose receive found no provided buffer, armed again after the completions are handled.
+    std::vector<unsigned> starved_;
+    // Completions taken from the queue and not handled yet, oldest first.
+    std::vector<struct io_uring_cqe> completions_;
+};
+
+#endif // HAVE_IO_URING
+
+#endif // URING_LOOP_H_INCLUDED
@@ -0,0 +1,104 @@
+#include "worker_pool.h"
+#include <algorithm>
+
+/**
+ * Starts n_workers threads, 0 means one per CPU of the machine, which hold at most max_queued tasks that
+ * have not started yet.
+ */
+Worker_Pool::Worker_Pool(unsigned n_workers, std::size_t max_queued) : max_queued_(max_queued) {
+    if (n_workers == 0) {
+        n_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < n_workers; i++) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    for (unsigned i = 0; i < n_workers; i++) {
+        threads_.emplace_back(&Worker_Pool::run, this, i);
+    }
+}
+
+/**
+ * Lets the workers finish the task they are running and joins them, queued tasks are dropped.
+ */
+Worker_Pool::~Worker_Pool() {
+    {
+        std::scoped_lock lock(sleep_mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto &thread: threads_) {
+        thread.join();
+    }
+}
+
+/**
+ * Queues the task for the next free worker. Returns false without queueing it if max_queued tasks are
+ * waiting already. Safe to call from any thread.
+ */
+bool Worker_Pool::trySubmit(Task task) {
+    // The slot is reserved before the task is queued, so a worker taking it at once never counts below zero.
+    std::size_t queued = queued_.load(std::memory_order_relaxed);
+    do {
+        if (queued >= max_queued_) {
+            return false;
+        }
+    } while (!queued_.compare_exchange_weak(queued, queued + 1, std::memory_order_relaxed));
+    Worker &worker = *workers_[next_.fetch_add(1, std::memory_order_relaxed) % workers_.size()];
+    {
+        std::scoped_lock lock(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+    }
+    {
+        // Taken once the task is queued, so a worker that checked the count before cannot miss the wakeup.
+        std::scoped_lock lock(sleep_mutex_);
+    }
+    wake_.notify_one();
+    return true;
+}
+
+/**
+ *  Runs tasks on the worker with the given index until the pool is destroyed.
+ */
+void Worker_Pool::run(unsigned index) {
+    Task task;
+    while (true) {
+        if (takeTask(index, task)) {
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock lock(sleep_mutex_);
+        // A task counted but not taken yet may sit in any queue, or be about to, the scan above can have missed it.
+        wake_.wait(lock, [this] { return stopping_ || queued_.load(std::memory_order_relaxed) != 0; });
+        if (stopping_) {
+            return;
+        }
+    }
+}
+
+/**
+ *  Takes the oldest task of the worker's own queue, or steals the newest one of another worker. Returns false
+ *  if every queue is empty.
+ */
+bool Worker_Pool::takeTask(unsigned index, Task &task) {
+    {
+        Worker &own = *workers_[index];
+        std::scoped_lock lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    for (std::size_t i = 1; i < workers_.size(); i++) {
+        Worker &victim = *workers_[(index + i) % workers_.size()];
+        std::scoped_lock lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
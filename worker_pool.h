@@ -0,0 +1,89 @@
+#ifndef WORKER_POOL_H_INCLUDED
+#define WORKER_POOL_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of threads running submitted tasks, so how many run at once does not grow with the load.
+ *
+ * Every worker has a queue of its own, submitted tasks are spread over them in turn. A worker takes the oldest
+ * task of its own queue and once that is empty steals the newest one of another, so a worker stuck on a slow task
+ * does not hold back the ones queued behind it. The number of queued tasks is bounded, a task that does not fit
+ * is refused instead of queueing without limit.
+ */
+class Worker_Pool
+{
+public:
+    using Task = std::function<void()>;
+
+    /**
+     * Starts n_workers threads, 0 means one per CPU of the machine, which hold at most max_queued tasks that
+     * have not started yet.
+     */
+    Worker_Pool(unsigned n_workers, std::size_t max_queued);
+    Worker_Pool(const Worker_Pool &) = delete;
+    Worker_Pool &operator=(const Worker_Pool &) = delete;
+
+    /**
+     * Lets the workers finish the task they are running and joins them, queued tasks are dropped.
+     */
+    ~Worker_Pool();
+
+    /**
+     * Queues the task for the next free worker. Returns false without queueing it if max_queued tasks are
+     * waiting already. Safe to call from any thread.
+     */
+    bool trySubmit(Task task);
+
+    /**
+     * Tasks submitted that no worker has started yet.
+     */
+    std::size_t queued() const {
+        return queued_.load(std::memory_order_relaxed);
+    }
+
+    std::size_t maxQueued() const {
+        return max_queued_;
+    }
+
+    unsigned size() const {
+        return unsigned(workers_.size());
+    }
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    /**
+     *  Runs tasks on the worker with the given index until the pool is destroyed.
+     */
+    void run(unsigned index);
+
+    /**
+     *  Takes the next task of the worker's own queue, or steals one from another worker. Returns false if
+     *  every queue is empty.
+     */
+    bool takeTask(unsigned index, Task &task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::size_t max_queued_;
+    std::atomic<std::size_t> queued_{0};
+    // Spreads submitted tasks over the queues.
+    std::atomic<unsigned> next_{0};
+    // Idle workers sleep here until a task is queued.
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+};
+
+#endif // WORKER_POOL_H_INCLUDED